@@ -0,0 +1,76 @@
+// Microbenchmark for string hashing and interning at different lengths.
+// Build it against the interpreter sources, leaving out main.c:
+//   cc -O2 -Isrc profiler/bench_strings.c $(ls src/*.c | grep -v main.c) -o bench_strings
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define KEYS 256
+#define MAX_LENGTH 4096
+
+static char keys[KEYS][MAX_LENGTH];
+
+static double seconds(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void fillKeys(int length) {
+    for (int i = 0; i < KEYS; i++) {
+        for (int j = 0; j < length; j++) {
+            keys[i][j] = 'a' + (char)((i * 31 + j * 7) % 26);
+        }
+        // make the keys distinct even when they are short
+        memcpy(keys[i], &i, sizeof(i) < (size_t)length ? sizeof(i) : (size_t)length);
+    }
+}
+
+static void benchLength(int length, int rounds) {
+    fillKeys(length);
+
+    clock_t start = clock();
+    uint32_t sink = 0;
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < KEYS; i++) sink ^= hashString(keys[i], length);
+    }
+    double hashTime = seconds(start);
+
+    // the first round interns the keys, the others only hit the table
+    start = clock();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < KEYS; i++) sink ^= copyString(keys[i], length)->length;
+    }
+    double copyTime = seconds(start);
+
+    start = clock();
+    int found = 0;
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < KEYS; i++) {
+            uint32_t hash = hashString(keys[i], length);
+            found += tableFindString(&vm.strings, keys[i], length, hash) != NULL;
+        }
+    }
+    double findTime = seconds(start);
+
+    double calls = (double)rounds * KEYS;
+    printf("%6d bytes: hashString %8.1f ns, copyString %8.1f ns, tableFindString %8.1f ns (found %d, %u)\n",
+            length, hashTime * 1e9 / calls, copyTime * 1e9 / calls, findTime * 1e9 / calls,
+            found, sink & 1);
+}
+
+int main() {
+    initVM();
+
+    int lengths[] = { 4, 16, 31, 32, 64, 256, 1024, 4096 };
+    for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+        benchLength(lengths[i], 2000);
+    }
+
+    freeVM();
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Microbenchmark for Table with get/set/delete mixes at different sizes.
+// Build it against the interpreter sources, leaving out main.c:
+//   cc -O2 -Isrc profiler/bench_table.c $(ls src/*.c | grep -v main.c) -o bench_table
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define MAX_KEYS 65536
+#define OPS 4000000
+
+static ObjString* keys[MAX_KEYS];
+
+static double seconds(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// xorshift, so every run does the same operations
+static uint32_t nextRandom(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void makeKeys(int count) {
+    vm.isCollecting = true; // the keys are only rooted from this array
+    for (int i = 0; i < count; i++) {
+        char buffer[32];
+        int length = snprintf(buffer, sizeof(buffer), "key%d", i);
+        keys[i] = copyString(buffer, length);
+    }
+    vm.isCollecting = false;
+}
+
+// getPercent and setPercent of the operations are lookups and inserts,
+// the rest are deletes. Half of the lookups miss
+static void benchMix(const char* name, int size, int getPercent, int setPercent) {
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < size / 2; i++) tableSet(&table, keys[i], NUMBER_VAL(i));
+
+    uint32_t state = 2463534242u;
+    int hits = 0;
+    Value value;
+
+    clock_t start = clock();
+    for (int i = 0; i < OPS; i++) {
+        uint32_t r = nextRandom(&state);
+        ObjString* key = keys[(r >> 8) % size];
+        int op = (int)(r & 0xFF) % 100;
+
+        if (op < getPercent) {
+            hits += tableGet(&table, key, &value);
+        } else if (op < getPercent + setPercent) {
+            tableSet(&table, key, NUMBER_VAL(i));
+        } else {
+            tableDelete(&table, key);
+        }
+    }
+    double elapsed = seconds(start);
+
+    printf("%-12s %6d keys: %6.1f ns/op (hits %d)\n", name, size, elapsed * 1e9 / OPS, hits);
+    freeTable(&table);
+}
+
+int main() {
+    initVM();
+    makeKeys(MAX_KEYS);
+
+    int sizes[] = { 8, 64, 1024, MAX_KEYS };
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        benchMix("get only", sizes[i], 100, 0);
+        benchMix("get/set", sizes[i], 80, 20);
+        benchMix("churn", sizes[i], 50, 25);
+    }
+
+    freeVM();
+    return 0;
+}
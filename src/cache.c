@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+#include "clox_compiler.h"
+
+// A .loxc file is a header followed by the script function. Functions
+// are written depth first: their name, code, line table and constants,
+// nested functions included. Numbers are in the byte order of the
+// machine that wrote them, the header rejects anything else
+#define CACHE_MAGIC "LOXC"
+#define CACHE_VERSION 5
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    // a cache from a build with other opcodes or values can't be loaded
+    uint32_t opcodeCount;
+    uint32_t valueSize;
+    // -O and -O0 don't share their caches
+    uint32_t optimizationLevel;
+    uint64_t sourceHash;
+} CacheHeader;
+
+typedef enum {
+    CACHED_NIL,
+    CACHED_FALSE,
+    CACHED_TRUE,
+    CACHED_NUMBER,
+    CACHED_STRING,
+    CACHED_FUNCTION
+} CachedType;
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Writer;
+
+typedef struct {
+    const uint8_t* curr;
+    const uint8_t* end;
+} Reader;
+
+//FNV-1a, 64 bits wide so unrelated sources practically never collide
+uint64_t hashSource(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// script.lox is cached in script.loxc, any other name gets .loxc appended
+void cachePathFor(const char* path, char* cachePath, size_t size) {
+    size_t length = strlen(path);
+    if (length >= 4 && strcmp(path + length - 4, ".lox") == 0) {
+        snprintf(cachePath, size, "%sc", path);
+    } else {
+        snprintf(cachePath, size, "%s.loxc", path);
+    }
+}
+
+static void writeBytes(Writer* writer, const void* bytes, size_t count) {
+    if (writer->capacity < writer->count + count) {
+        while (writer->capacity < writer->count + count) {
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        }
+        writer->bytes = realloc(writer->bytes, writer->capacity);
+
+        if (writer->bytes == NULL) {
+            printf("Failed to realloc cache buffer\n");
+            exit(1);
+        }
+    }
+
+    memcpy(writer->bytes + writer->count, bytes, count);
+    writer->count += count;
+}
+
+static void writeInt(Writer* writer, int32_t value) {
+    writeBytes(writer, &value, sizeof(int32_t));
+}
+
+static void writeType(Writer* writer, CachedType type) {
+    uint8_t tag = (uint8_t)type;
+    writeBytes(writer, &tag, 1);
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function);
+
+static void writeValue(Writer* writer, Value value) {
+    if (IS_NIL(value)) {
+        writeType(writer, CACHED_NIL);
+    } else if (IS_BOOL(value)) {
+        writeType(writer, AS_BOOL(value) ? CACHED_TRUE : CACHED_FALSE);
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        writeType(writer, CACHED_NUMBER);
+        writeBytes(writer, &number, sizeof(double));
+    } else if (IS_STRING(value)) {
+        ObjString* string = AS_STRING(value);
+        writeType(writer, CACHED_STRING);
+        writeInt(writer, string->length);
+        writeBytes(writer, string->chars, string->length);
+    } else {
+        // the compiler puts nothing else in a constant pool
+        writeFunction(writer, AS_FUNCTION(value));
+    }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+
+    writeType(writer, CACHED_FUNCTION);
+    writeInt(writer, function->arity);
+    writeInt(writer, function->upvalueCount);
+    writeInt(writer, function->maxStack);
+    writeValue(writer, function->name == NULL ? NIL_VAL : OBJ_VAL(function->name));
+
+    writeInt(writer, chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+
+    writeInt(writer, chunk->lineArray.count);
+    for (int i = 0; i < chunk->lineArray.count; i++) {
+        writeInt(writer, chunk->lineArray.lines[i].line);
+        writeInt(writer, chunk->lineArray.lines[i].offsetCount);
+    }
+
+    writeInt(writer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeValue(writer, chunk->constants.values[i]);
+    }
+}
+
+// Written to a temporary file first: a run reading the cache while
+// another one writes it sees either the old file or the new one
+bool writeBytecodeCache(const char* path, ObjFunction* function, uint64_t sourceHash) {
+    Writer writer = {NULL, 0, 0};
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.opcodeCount = OP_WIDE + 1;
+    header.valueSize = sizeof(Value);
+    header.optimizationLevel = optimizationLevel;
+    header.sourceHash = sourceHash;
+
+    writeBytes(&writer, &header, sizeof(CacheHeader));
+    writeFunction(&writer, function);
+
+    char tempPath[4096];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+
+    FILE* file = fopen(tempPath, "wb");
+    bool written = file != NULL
+                   && fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+    if (file != NULL && fclose(file) != 0) written = false;
+    free(writer.bytes);
+
+    if (!written) {
+        remove(tempPath);
+        return false;
+    }
+
+    // rename doesn't replace an existing file everywhere
+    remove(path);
+    return rename(tempPath, path) == 0;
+}
+
+static bool readBytes(Reader* reader, void* bytes, size_t count) {
+    if ((size_t)(reader->end - reader->curr) < count) return false;
+    memcpy(bytes, reader->curr, count);
+    reader->curr += count;
+    return true;
+}
+
+static bool readInt(Reader* reader, int32_t* value) {
+    return readBytes(reader, value, sizeof(int32_t)) && *value >= 0;
+}
+
+static bool readFunction(Reader* reader, Value* result);
+
+// Strings and functions are allocated as they're read, so a collection
+// can move anything read before. Callers keep their objects on the
+// stack and store a value before reading the next one
+static bool readValue(Reader* reader, Value* result) {
+    uint8_t tag;
+    if (!readBytes(reader, &tag, 1)) return false;
+
+    switch (tag) {
+        case CACHED_NIL: *result = NIL_VAL; return true;
+        case CACHED_FALSE: *result = BOOL_VAL(false); return true;
+        case CACHED_TRUE: *result = BOOL_VAL(true); return true;
+        case CACHED_NUMBER: {
+            double number;
+            if (!readBytes(reader, &number, sizeof(double))) return false;
+            *result = NUMBER_VAL(number);
+            return true;
+        }
+        case CACHED_STRING: {
+            int32_t length;
+            if (!readInt(reader, &length)) return false;
+            if (reader->end - reader->curr < length) return false;
+
+            *result = OBJ_VAL(copyString((const char*)reader->curr, length));
+            reader->curr += length;
+            return true;
+        }
+        case CACHED_FUNCTION:
+            return readFunction(reader, result);
+        default:
+            return false;
+    }
+}
+
+static bool readFunction(Reader* reader, Value* result) {
+    push(OBJ_VAL(newFunction()));
+    Value* slot = vm.stackTop - 1;
+
+    int32_t arity, upvalueCount, maxStack;
+    if (!readInt(reader, &arity) || !readInt(reader, &upvalueCount)
+        || !readInt(reader, &maxStack) || maxStack <= arity) return false;
+
+    Value name;
+    if (!readValue(reader, &name)) return false;
+    if (!IS_NIL(name) && !IS_STRING(name)) return false;
+
+    ObjFunction* function = AS_FUNCTION(*slot);
+    function->arity = arity;
+    function->upvalueCount = upvalueCount;
+    function->maxStack = maxStack;
+    function->name = IS_NIL(name) ? NULL : AS_STRING(name);
+    // a collection while reading may have promoted the function
+    markDirty((Obj*)function);
+
+    Chunk* chunk = &function->chunk;
+    int32_t codeCount;
+    if (!readInt(reader, &codeCount)) return false;
+    if (reader->end - reader->curr < codeCount) return false;
+
+    chunk->code = ALLOCATE(uint8_t, codeCount);
+    chunk->capacity = codeCount;
+    chunk->count = codeCount;
+    readBytes(reader, chunk->code, codeCount);
+
+    int32_t lineCount;
+    if (!readInt(reader, &lineCount)) return false;
+    if ((reader->end - reader->curr) / (2 * sizeof(int32_t)) < (size_t)lineCount) return false;
+
+    chunk->lineArray.lines = ALLOCATE(Line, lineCount);
+    chunk->lineArray.capacity = lineCount;
+    chunk->lineArray.count = lineCount;
+    for (int i = 0; i < lineCount; i++) {
+        readInt(reader, &chunk->lineArray.lines[i].line);
+        readInt(reader, &chunk->lineArray.lines[i].offsetCount);
+    }
+
+    int32_t constantCount;
+    if (!readInt(reader, &constantCount)) return false;
+
+    for (int i = 0; i < constantCount; i++) {
+        Value constant;
+        if (!readValue(reader, &constant)) return false;
+
+        function = AS_FUNCTION(*slot);
+        writeValueArray(&function->chunk.constants, constant);
+        markDirty((Obj*)function);
+    }
+
+    *result = pop();
+    return true;
+}
+
+static uint8_t* readCacheFile(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    uint8_t* buffer = fileSize > 0 ? (uint8_t*)malloc(fileSize) : NULL;
+    if (buffer == NULL || fread(buffer, 1, fileSize, file) < (size_t)fileSize) {
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    *size = (size_t)fileSize;
+    return buffer;
+}
+
+// NULL when there's no usable cache at path for this source
+ObjFunction* readBytecodeCache(const char* path, uint64_t sourceHash) {
+    size_t size;
+    uint8_t* buffer = readCacheFile(path, &size);
+    if (buffer == NULL) return NULL;
+
+    Reader reader = {buffer, buffer + size};
+    CacheHeader header;
+    if (!readBytes(&reader, &header, sizeof(CacheHeader))
+        || memcmp(header.magic, CACHE_MAGIC, 4) != 0
+        || header.version != CACHE_VERSION
+        || header.opcodeCount != OP_WIDE + 1
+        || header.valueSize != sizeof(Value)
+        || header.optimizationLevel != (uint32_t)optimizationLevel
+        || header.sourceHash != sourceHash) {
+
+        free(buffer);
+        return NULL;
+    }
+
+    // whatever was read before a failure is left to the collector
+    Value* stackTop = vm.stackTop;
+    Value script;
+    bool isValid = readValue(&reader, &script) && IS_FUNCTION(script)
+                   && reader.curr == reader.end;
+
+    vm.stackTop = stackTop;
+    free(buffer);
+    return isValid ? AS_FUNCTION(script) : NULL;
+}
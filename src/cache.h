@@ -0,0 +1,14 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+#include "common.h"
+#include "object.h"
+
+// Compiled scripts saved next to their source (.loxc), so later runs of
+// an unchanged file skip scanning and compiling. The cache is keyed by a
+// hash of the source, anything stale or unreadable is just ignored
+uint64_t hashSource(const char* source, size_t length);
+void cachePathFor(const char* path, char* cachePath, size_t size);
+ObjFunction* readBytecodeCache(const char* path, uint64_t sourceHash);
+bool writeBytecodeCache(const char* path, ObjFunction* function, uint64_t sourceHash);
+
+#endif
@@ -1,7 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk) {
@@ -44,8 +46,26 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 }
 
 
+// Drops the code from count on, along with the lines it was on
+void truncateChunk(Chunk* chunk, int count) {
+    int dropped = chunk->count - count;
+    chunk->count = count;
+
+    while (dropped > 0) {
+        Line* last = &chunk->lineArray.lines[chunk->lineArray.count - 1];
+        if (last->offsetCount > dropped) {
+            last->offsetCount -= dropped;
+            break;
+        }
+
+        dropped -= last->offsetCount;
+        chunk->lineArray.count--;
+    }
+}
+
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(Line, chunk->lineArray.lines, chunk->lineArray.capacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -58,19 +78,241 @@ uint32_t addConstant(Chunk* chunk, Value value) {
 }
 
 
+// An instruction with a byte operand, behind OP_WIDE when it's larger
+void writeOperand(Chunk* chunk, OpCode opcode, uint32_t operand, int line) {
+    if (operand > UINT8_MAX) {
+        writeChunk(chunk, OP_WIDE, line);
+        writeChunk(chunk, (operand >> 16) & 0xff, line);
+        writeChunk(chunk, (operand >> 8) & 0xff, line);
+    }
+
+    writeChunk(chunk, opcode, line);
+    writeChunk(chunk, operand & 0xff, line);
+}
+
+// A jump back to start, behind OP_WIDE when it's further than 16 bits
+// reach. The offset is from past the OP_LOOP, back over the prefix too
+void writeLoop(Chunk* chunk, int start, int line) {
+    uint32_t offset = chunk->count - start + 3;
+    if (offset > UINT16_MAX) {
+        offset += 3;
+        writeChunk(chunk, OP_WIDE, line);
+        writeChunk(chunk, (offset >> 24) & 0xff, line);
+        writeChunk(chunk, (offset >> 16) & 0xff, line);
+    }
+
+    writeChunk(chunk, OP_LOOP, line);
+    writeChunk(chunk, (offset >> 8) & 0xff, line);
+    writeChunk(chunk, offset & 0xff, line);
+}
+
 void writeConstant(Chunk* chunk, Value value, int line) {
+    writeOperand(chunk, OP_CONSTANT, addConstant(chunk, value), line);
+}
+
 
-    uint32_t constant = addConstant(chunk, value);
+// The same for the compiler filling a hashed match table and the VM
+// looking a value up in it. -0 hashes as 0, the two are equal
+uint32_t hashMatchKey(Value key) {
+    if (IS_STRING(key)) {
+        ObjString* string = AS_STRING(key);
+        // uninterned strings aren't hashed yet
+        return string->isInterned ? string->hash : hashString(string->chars, string->length);
+    }
 
-    if (constant < 256) {
-        writeChunk(chunk, OP_CONSTANT, line);
-        writeChunk(chunk, constant, line);
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        if (number == 0) number = 0;
 
-    } else {
-        writeChunk(chunk, OP_CONSTANT_LONG, line);
-        writeChunk(chunk, (uint8_t)((constant & 0x000000ff)), line);
-        writeChunk(chunk, (uint8_t)((constant & 0x0000ff00) >> 8), line);
-        writeChunk(chunk, (uint8_t)((constant & 0x00ff0000) >> 16), line);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
     }
+
+    return 0;
 }
 
+// One pass in code order: the depth at an offset is the highest the
+// instruction before it or a jump to it leaves there. Loops are entered
+// by falling into them and the compiler leaves the stack as high where
+// paths join, so the jumps back are skipped. Where the effect depends on
+// the values, it's the larger one: overcounting only commits more stack
+int chunkMaxStack(Chunk* chunk, int base) {
+    if (chunk->count == 0) return base;
+
+    int* depths = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+    depths[0] = base;
+
+    int maxStack = base;
+    uint32_t wide = 0;
+    int offset = 0;
+
+    while (offset < chunk->count) {
+        uint8_t* code = chunk->code + offset;
+        int length = 1;
+        int effect = 0;
+        // pushed on the way, above where the instruction ends
+        int peak = 0;
+        bool fallsThrough = true;
+        int target = -1;
+
+        switch (code[0]) {
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_SAVE_VALUE:
+            case OP_DEQUE:
+                effect = 1;
+                break;
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_GET_GLOBAL:
+            case OP_GET_UPVALUE:
+            case OP_PUSH:
+            case OP_PUSH_FROM:
+            case OP_CLASS:
+            // a native method goes above its receiver, a field replaces it
+            case OP_GET_PROPERTY:
+                length = 2;
+                effect = 1;
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_GLOBAL:
+            case OP_SET_UPVALUE:
+            case OP_GET_ELEMENT:
+            case OP_GET_ELEMENT_GLOBAL:
+            case OP_GET_ELEMENT_UPVALUE:
+            case OP_FOR_EACH:
+            case OP_REVERSE_N:
+            case OP_CHECK_TYPE:
+            // a dictionary keeps the index under the result
+            case OP_SET_ELEMENT_GLOBAL:
+                length = 2;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_CONST_GLOBAL:
+            case OP_SET_ELEMENT:
+            case OP_SET_PROPERTY:
+            case OP_METHOD:
+            case OP_GET_SUPER:
+                length = 2;
+                effect = -1;
+                break;
+            case OP_SET_ELEMENT_UPVALUE:
+                length = 2;
+                effect = -2;
+                break;
+            case OP_SWAP:
+            case OP_DEFINE_PROPERTY:
+                length = 3;
+                break;
+            case OP_POP:
+            case OP_CLOSE_UPVALUE:
+            case OP_GET_ELEMENT_FROM_TOP:
+            case OP_QUEUE:
+            case OP_RANGE:
+            case OP_PRINT:
+            case OP_INHERIT:
+            case OP_EQUAL:
+            case OP_EQUAL_AND:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_ADD_NUM:
+            case OP_SUBTRACT_NUM:
+            case OP_MULTIPLY_NUM:
+            case OP_DIVIDE_NUM:
+            case OP_GREATER_NUM:
+            case OP_LESS_NUM:
+                effect = -1;
+                break;
+            case OP_ADD:
+                // concatenating pushes both strings first
+                effect = -1;
+                peak = 2;
+                break;
+            case OP_INDIRECT_STORE:
+                effect = -2;
+                break;
+            case OP_ARRAY:
+            case OP_MAP:
+                // the new object goes above the elements before they're popped
+                length = 2;
+                effect = 1 - (int)(wide | code[1]);
+                peak = 1;
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                length = 2;
+                effect = -code[1];
+                break;
+            case OP_ARRAY_CALL:
+                length = 2;
+                effect = -code[1] - 1;
+                break;
+            case OP_INVOKE:
+                length = 3;
+                effect = -code[2];
+                break;
+            case OP_CLOSURE: {
+                ObjFunction* function = AS_FUNCTION(chunk->constants.values[wide | code[1]]);
+                length = 2 + 2 * function->upvalueCount;
+                effect = 1;
+                break;
+            }
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                length = 3;
+                target = offset + 3 + (int)(wide << 8 | code[1] << 8 | code[2]);
+                fallsThrough = code[0] == OP_JUMP_IF_FALSE;
+                break;
+            case OP_LOOP:
+                length = 3;
+                fallsThrough = false;
+                break;
+            case OP_RETURN:
+                fallsThrough = false;
+                break;
+            case OP_MATCH_TABLE: {
+                int size = code[2] << 8 | code[3];
+                int header = code[1] == MATCH_DENSE ? 10 : 6;
+                int entrySize = code[1] == MATCH_DENSE ? 2 : 4;
+                length = header + size * entrySize;
+                fallsThrough = false;
+
+                int end = offset + length;
+                target = end + (code[4] << 8 | code[5]);
+                for (int i = 0; i < size && depths[offset] >= 0; i++) {
+                    uint8_t* entry = code + header + i * entrySize + entrySize - 2;
+                    int arm = entry[0] << 8 | entry[1];
+                    if (arm == MATCH_EMPTY || end + arm >= chunk->count) continue;
+                    if (depths[end + arm] < depths[offset]) depths[end + arm] = depths[offset];
+                }
+                break;
+            }
+            case OP_WIDE:
+                length = 3;
+                break;
+        }
+
+        int depth = depths[offset];
+        if (depth >= 0) {
+            int after = depth + effect;
+            int highest = (effect > 0 ? after : depth) + peak;
+            if (highest > maxStack) maxStack = highest;
+
+            if (target >= 0 && target < chunk->count && depths[target] < after) depths[target] = after;
+            int next = offset + length;
+            if (fallsThrough && next < chunk->count && depths[next] < after) depths[next] = after;
+        }
+
+        wide = code[0] == OP_WIDE ? (uint32_t)(code[1] << 16 | code[2] << 8) : 0;
+        offset += length;
+    }
+
+    FREE_ARRAY(int, depths, chunk->count);
+    return maxStack;
+}
@@ -8,7 +8,6 @@
 
 typedef enum {
     OP_CONSTANT,
-    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
@@ -19,16 +18,14 @@ typedef enum {
     OP_LOOP,
     OP_GET_LOCAL,
     OP_GET_GLOBAL,
-    OP_GET_GLOBAL_LONG,
     OP_DEFINE_GLOBAL,
     OP_DEFINE_CONST_GLOBAL,
-    OP_DEFINE_GLOBAL_LONG,
-    OP_DEFINE_CONST_GLOBAL_LONG,
     OP_SET_LOCAL,
     OP_SET_GLOBAL,
-    OP_SET_GLOBAL_LONG,
     OP_CLOSURE,
     OP_CALL,
+    // a call whose result is returned right away, run in the caller's frame
+    OP_TAIL_CALL,
     OP_ARRAY_CALL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
@@ -38,15 +35,11 @@ typedef enum {
     OP_SWAP,
     OP_CLOSE_UPVALUE,
     OP_ARRAY,
-    OP_ARRAY_LONG,
     OP_MAP,
-    OP_MAP_LONG,
     OP_GET_ELEMENT,
     OP_SET_ELEMENT,
     OP_GET_ELEMENT_GLOBAL,
     OP_SET_ELEMENT_GLOBAL,
-    OP_GET_ELEMENT_GLOBAL_LONG,
-    OP_SET_ELEMENT_GLOBAL_LONG,
     OP_FOR_EACH,
     OP_SAVE_VALUE,
     OP_REVERSE_N,
@@ -63,6 +56,7 @@ typedef enum {
     OP_RANGE,
     OP_EQUAL,
     OP_EQUAL_AND,
+    OP_MATCH_TABLE,
     OP_GREATER,
     OP_LESS,
     OP_ADD,
@@ -71,6 +65,15 @@ typedef enum {
     OP_DIVIDE,
     OP_NOT,
     OP_NEGATE,
+    // the same without the type checks, for operands the optimizing
+    // compiler knows to be numbers
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_NEGATE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
     OP_PRINT,
     OP_RETURN,
     OP_CLASS,
@@ -81,14 +84,7 @@ typedef enum {
     OP_INVOKE,
     OP_INHERIT,
     OP_GET_SUPER,
-    OP_GET_PROPERTY_LONG,
-    OP_SET_PROPERTY_LONG,
-    OP_DEFINE_PROPERTY_LONG,
-    OP_INVOKE_LONG,
-    OP_GET_SUPER_LONG,
-    OP_METHOD_LONG,
-    OP_CLASS_LONG,
-    OP_CLOSURE_LONG
+    OP_WIDE
 } OpCode;
 
 
@@ -116,7 +112,34 @@ typedef struct {
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count);
 uint32_t addConstant(Chunk* chunk, Value value);
+
+// OP_WIDE carries the high bits of the next instruction's operand, for
+// operands past a byte: its word goes above that instruction's operand
+// byte, or above the word of a jump. Constant indices and the sizes of
+// array and map literals reach 24 bits this way, jumps 32. Loop exits
+// and breaks always have the prefix, zero until the body is known
+#define WIDE_MAX 0xffffff
+
+void writeOperand(Chunk* chunk, OpCode opcode, uint32_t operand, int line);
+void writeLoop(Chunk* chunk, int start, int line);
+
+// OP_MATCH_TABLE is followed by its table: a kind byte, then the entry
+// count and the default target as words, for a dense table the
+// smallest key as four bytes, then the entries. A dense table has a
+// target per key from the smallest one up, a hashed one a constant
+// index and a target per entry, probed linearly. Targets are offsets
+// from the end of the table, MATCH_EMPTY marks an entry with no key
+#define MATCH_DENSE 0
+#define MATCH_HASHED 1
+#define MATCH_EMPTY 0xffff
+
+uint32_t hashMatchKey(Value key);
+
+// How many stack slots running the chunk takes at most, counting the
+// base ones its frame starts with: the callee and its arguments
+int chunkMaxStack(Chunk* chunk, int base);
 void writeConstant(Chunk* chunk, Value value, int line);
 
 #endif
@@ -0,0 +1,533 @@
+#include <stdlib.h>
+#include <string.h>
+#include "clox_ast.h"
+#include "memory.h"
+
+typedef struct {
+    Token name;
+    // -1 while its initializer is parsed
+    int depth;
+    int variable;
+    bool isConst;
+} AstLocal;
+
+typedef struct {
+    Ast* ast;
+    Token previous;
+    Token current;
+    bool failed;
+
+    AstLocal locals[UINT8_COUNT];
+    int localCount;
+    int scopeDepth;
+    int loopDepth;
+
+    // children of the lists being parsed, moved to ast->lists when
+    // each list is complete so its entries stay contiguous
+    int* pending;
+    int pendingCount;
+    int pendingCapacity;
+} AstParser;
+
+static AstParser astParser;
+
+void initAst(Ast* ast) {
+    ast->nodes = NULL;
+    ast->count = 0;
+    ast->capacity = 0;
+    ast->lists = NULL;
+    ast->listCount = 0;
+    ast->listCapacity = 0;
+    ast->localCount = 0;
+    ast->arity = 0;
+    ast->body = -1;
+}
+
+void freeAst(Ast* ast) {
+    FREE_ARRAY(Node, ast->nodes, ast->capacity);
+    FREE_ARRAY(int, ast->lists, ast->listCapacity);
+    initAst(ast);
+}
+
+// Gives up on the function. Callers return -1 and everything above
+// them unwinds without looking at the tree
+static int fail() {
+    astParser.failed = true;
+    return -1;
+}
+
+static void advance() {
+    astParser.previous = astParser.current;
+    astParser.current = scanToken();
+    if (astParser.current.type == TOKEN_ERROR) fail();
+}
+
+static bool check(TokenTypes type) {
+    return astParser.current.type == type;
+}
+
+static bool match(TokenTypes type) {
+    if (astParser.failed || !check(type)) return false;
+    advance();
+    return true;
+}
+
+static bool expect(TokenTypes type) {
+    if (!match(type)) {
+        fail();
+        return false;
+    }
+    return true;
+}
+
+static int addNode(NodeType type, Token token) {
+    Ast* ast = astParser.ast;
+    if (ast->capacity < ast->count + 1) {
+        int oldCapacity = ast->capacity;
+        ast->capacity = GROW_CAPACITY(oldCapacity);
+        ast->nodes = GROW_ARRAY(Node, ast->nodes, oldCapacity, ast->capacity);
+    }
+
+    Node* node = &ast->nodes[ast->count];
+    node->type = type;
+    node->token = token;
+    node->number = 0;
+    node->variable = -1;
+    for (int i = 0; i < 4; i++) node->children[i] = -1;
+    node->first = 0;
+    node->count = 0;
+    return ast->count++;
+}
+
+static void setChildren(int node, int a, int b, int c, int d) {
+    Node* n = &astParser.ast->nodes[node];
+    n->children[0] = a;
+    n->children[1] = b;
+    n->children[2] = c;
+    n->children[3] = d;
+}
+
+static void pushPending(int child) {
+    if (astParser.pendingCapacity < astParser.pendingCount + 1) {
+        int oldCapacity = astParser.pendingCapacity;
+        astParser.pendingCapacity = GROW_CAPACITY(oldCapacity);
+        astParser.pending = GROW_ARRAY(int, astParser.pending, oldCapacity,
+                                       astParser.pendingCapacity);
+    }
+    astParser.pending[astParser.pendingCount++] = child;
+}
+
+// Moves the children pushed since base into node's list
+static void endList(int node, int base) {
+    Ast* ast = astParser.ast;
+    int count = astParser.pendingCount - base;
+    ast->nodes[node].first = ast->listCount;
+    ast->nodes[node].count = count;
+    if (count == 0) return;
+
+    if (ast->listCapacity < ast->listCount + count) {
+        int oldCapacity = ast->listCapacity;
+        while (ast->listCapacity < ast->listCount + count) {
+            ast->listCapacity = GROW_CAPACITY(ast->listCapacity);
+        }
+        ast->lists = GROW_ARRAY(int, ast->lists, oldCapacity, ast->listCapacity);
+    }
+
+    memcpy(ast->lists + ast->listCount, astParser.pending + base, sizeof(int) * count);
+    ast->listCount += count;
+    astParser.pendingCount = base;
+}
+
+static bool identifiersEqual(Token* a, Token* b) {
+    if (a->length != b->length) return false;
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+static AstLocal* resolveLocal(Token* name) {
+    for (int i = astParser.localCount - 1; i >= 0; i--) {
+        if (identifiersEqual(name, &astParser.locals[i].name)) {
+            return &astParser.locals[i];
+        }
+    }
+    return NULL;
+}
+
+static bool declareLocal(Token name, bool isConst) {
+    for (int i = astParser.localCount - 1; i >= 0; i--) {
+        AstLocal* local = &astParser.locals[i];
+        if (local->depth != -1 && local->depth < astParser.scopeDepth) break;
+        if (identifiersEqual(&name, &local->name)) return false;
+    }
+    if (astParser.localCount == UINT8_COUNT) return false;
+
+    AstLocal* local = &astParser.locals[astParser.localCount++];
+    local->name = name;
+    local->depth = -1;
+    local->variable = astParser.ast->localCount++;
+    local->isConst = isConst;
+    return true;
+}
+
+static void endScope() {
+    astParser.scopeDepth--;
+    while (astParser.localCount > 0
+           && astParser.locals[astParser.localCount - 1].depth > astParser.scopeDepth) {
+        astParser.localCount--;
+    }
+}
+
+static int expression();
+static int parsePrecedence(Precedence precedence);
+static int statement();
+static int declaration();
+
+// Infix precedences, as in the compiler's rule table. Operators the
+// tree doesn't hold stop the parse when they're reached
+static Precedence infixPrecedence(TokenTypes type) {
+    switch (type) {
+        case TOKEN_LEFT_PAREN:
+        case TOKEN_DOT:             return PREC_CALL;
+        case TOKEN_MINUS:
+        case TOKEN_PLUS:            return PREC_TERM;
+        case TOKEN_SLASH:
+        case TOKEN_STAR:            return PREC_FACTOR;
+        case TOKEN_BANG_EQUAL:
+        case TOKEN_EQUAL_EQUAL:     return PREC_EQUALITY;
+        case TOKEN_GREATER:
+        case TOKEN_GREATER_EQUAL:
+        case TOKEN_LESS:
+        case TOKEN_LESS_EQUAL:      return PREC_COMPARISON;
+        case TOKEN_AND:             return PREC_AND;
+        case TOKEN_OR:              return PREC_OR;
+        case TOKEN_QUESTION:        return PREC_TERNARY;
+
+        default: return PREC_NONE;
+    }
+}
+
+static int variable(bool canAssign) {
+    Token name = astParser.previous;
+
+    // indexing and compound assignment stay with the single-pass compiler
+    if (check(TOKEN_LEFT_SQUARE_BRACE) || check(TOKEN_PLUS_EQUAL)
+        || check(TOKEN_MINUS_EQUAL)) return fail();
+
+    AstLocal* local = resolveLocal(&name);
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        if (local != NULL && local->isConst) return fail();
+
+        int value = expression();
+        int node = addNode(local != NULL ? NODE_ASSIGN_LOCAL : NODE_ASSIGN_NONLOCAL, name);
+        setChildren(node, value, -1, -1, -1);
+        if (local != NULL) astParser.ast->nodes[node].variable = local->variable;
+        return node;
+    }
+
+    if (local != NULL && local->depth == -1) return fail();
+
+    int node = addNode(local != NULL ? NODE_LOCAL : NODE_NONLOCAL, name);
+    if (local != NULL) astParser.ast->nodes[node].variable = local->variable;
+    return node;
+}
+
+static int prefix(bool canAssign) {
+    Token token = astParser.previous;
+
+    switch (token.type) {
+        case TOKEN_NUMBER: {
+            int node = addNode(NODE_NUMBER, token);
+            astParser.ast->nodes[node].number = strtod(token.start, NULL);
+            return node;
+        }
+        case TOKEN_STRING:  return addNode(NODE_STRING, token);
+        case TOKEN_NIL:     return addNode(NODE_NIL, token);
+        case TOKEN_TRUE:    return addNode(NODE_TRUE, token);
+        case TOKEN_FALSE:   return addNode(NODE_FALSE, token);
+        case TOKEN_IDENTIFIER: return variable(canAssign);
+        case TOKEN_LEFT_PAREN: {
+            int inner = expression();
+            expect(TOKEN_RIGHT_PAREN);
+            return inner;
+        }
+        case TOKEN_MINUS:
+        case TOKEN_BANG: {
+            int operand = parsePrecedence(PREC_UNARY);
+            int node = addNode(NODE_UNARY, token);
+            setChildren(node, operand, -1, -1, -1);
+            return node;
+        }
+
+        default: return fail();
+    }
+}
+
+static int infix(int left) {
+    Token token = astParser.previous;
+
+    switch (token.type) {
+        case TOKEN_LEFT_PAREN: {
+            int node = addNode(NODE_CALL, token);
+            setChildren(node, left, -1, -1, -1);
+
+            int base = astParser.pendingCount;
+            if (!check(TOKEN_RIGHT_PAREN)) {
+                do {
+                    pushPending(expression());
+                    if (astParser.pendingCount - base > UINT8_MAX) return fail();
+                } while (match(TOKEN_COMMA));
+            }
+            expect(TOKEN_RIGHT_PAREN);
+            endList(node, base);
+            return node;
+        }
+        case TOKEN_AND:
+        case TOKEN_OR: {
+            int right = parsePrecedence(token.type == TOKEN_AND ? PREC_AND : PREC_OR);
+            int node = addNode(token.type == TOKEN_AND ? NODE_AND : NODE_OR, token);
+            setChildren(node, left, right, -1, -1);
+            return node;
+        }
+        case TOKEN_QUESTION: {
+            int thenBranch = parsePrecedence(PREC_TERNARY);
+            expect(TOKEN_COLON);
+            int elseBranch = parsePrecedence(PREC_TERNARY);
+            int node = addNode(NODE_TERNARY, token);
+            setChildren(node, left, thenBranch, elseBranch, -1);
+            return node;
+        }
+        case TOKEN_DOT: return fail();
+
+        default: {
+            int right = parsePrecedence((Precedence)(infixPrecedence(token.type) + 1));
+            int node = addNode(NODE_BINARY, token);
+            setChildren(node, left, right, -1, -1);
+            return node;
+        }
+    }
+}
+
+static int parsePrecedence(Precedence precedence) {
+    if (astParser.failed) return -1;
+    advance();
+
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    int node = prefix(canAssign);
+
+    while (!astParser.failed && precedence <= infixPrecedence(astParser.current.type)) {
+        advance();
+        node = infix(node);
+    }
+
+    if (canAssign && check(TOKEN_EQUAL)) return fail();
+    return astParser.failed ? -1 : node;
+}
+
+static int expression() {
+    return parsePrecedence(PREC_ASSIGNMENT);
+}
+
+static int varDeclaration(bool isConst) {
+    if (!expect(TOKEN_IDENTIFIER)) return -1;
+    Token name = astParser.previous;
+    if (!declareLocal(name, isConst)) return fail();
+
+    int initializer = -1;
+    if (match(TOKEN_EQUAL)) initializer = expression();
+    expect(TOKEN_SEMICOLON);
+
+    AstLocal* local = &astParser.locals[astParser.localCount - 1];
+    local->depth = astParser.scopeDepth;
+
+    int node = addNode(NODE_VAR, name);
+    setChildren(node, initializer, -1, -1, -1);
+    astParser.ast->nodes[node].variable = local->variable;
+    return node;
+}
+
+static int expressionStatement() {
+    Token token = astParser.current;
+    int value = expression();
+    expect(TOKEN_SEMICOLON);
+
+    int node = addNode(NODE_EXPRESSION, token);
+    setChildren(node, value, -1, -1, -1);
+    return node;
+}
+
+// Statements up to the closing brace, in the current scope
+static int blockBody(Token token) {
+    int node = addNode(NODE_BLOCK, token);
+    int base = astParser.pendingCount;
+
+    while (!astParser.failed && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        pushPending(declaration());
+    }
+    expect(TOKEN_RIGHT_BRACE);
+
+    endList(node, base);
+    return node;
+}
+
+static int ifStatement() {
+    Token token = astParser.previous;
+    expect(TOKEN_LEFT_PAREN);
+    int condition = expression();
+    expect(TOKEN_RIGHT_PAREN);
+
+    int thenBranch = statement();
+    int elseBranch = match(TOKEN_ELSE) ? statement() : -1;
+
+    int node = addNode(NODE_IF, token);
+    setChildren(node, condition, thenBranch, elseBranch, -1);
+    return node;
+}
+
+static int whileStatement() {
+    Token token = astParser.previous;
+    expect(TOKEN_LEFT_PAREN);
+    int condition = expression();
+    expect(TOKEN_RIGHT_PAREN);
+
+    astParser.loopDepth++;
+    int body = statement();
+    astParser.loopDepth--;
+
+    int node = addNode(NODE_WHILE, token);
+    setChildren(node, condition, body, -1, -1);
+    return node;
+}
+
+static int forStatement() {
+    Token token = astParser.previous;
+    // for each loops keep their own compiler
+    if (check(TOKEN_IDENTIFIER)) return fail();
+
+    astParser.scopeDepth++;
+    expect(TOKEN_LEFT_PAREN);
+
+    int initializer = -1;
+    if (match(TOKEN_SEMICOLON)) {
+        // no initializer
+    } else if (match(TOKEN_CONST)) {
+        if (expect(TOKEN_VAR)) initializer = varDeclaration(true);
+    } else if (match(TOKEN_VAR)) {
+        initializer = varDeclaration(false);
+    } else {
+        initializer = expressionStatement();
+    }
+
+    int condition = -1;
+    if (!match(TOKEN_SEMICOLON)) {
+        condition = expression();
+        expect(TOKEN_SEMICOLON);
+    }
+
+    int increment = -1;
+    if (!match(TOKEN_RIGHT_PAREN)) {
+        increment = expression();
+        expect(TOKEN_RIGHT_PAREN);
+    }
+
+    astParser.loopDepth++;
+    int body = statement();
+    astParser.loopDepth--;
+    endScope();
+
+    int node = addNode(NODE_FOR, token);
+    setChildren(node, initializer, condition, increment, body);
+    return node;
+}
+
+static int returnStatement() {
+    Token token = astParser.previous;
+    int value = -1;
+    if (!match(TOKEN_SEMICOLON)) {
+        value = expression();
+        expect(TOKEN_SEMICOLON);
+    }
+
+    int node = addNode(NODE_RETURN, token);
+    setChildren(node, value, -1, -1, -1);
+    return node;
+}
+
+static int statement() {
+    if (astParser.failed) return -1;
+
+    if (match(TOKEN_PRINT)) {
+        Token token = astParser.previous;
+        int value = expression();
+        expect(TOKEN_SEMICOLON);
+
+        int node = addNode(NODE_PRINT, token);
+        setChildren(node, value, -1, -1, -1);
+        return node;
+    }
+    if (match(TOKEN_IF)) return ifStatement();
+    if (match(TOKEN_WHILE)) return whileStatement();
+    if (match(TOKEN_FOR)) return forStatement();
+    if (match(TOKEN_RETURN)) return returnStatement();
+    if (match(TOKEN_LEFT_BRACE)) {
+        astParser.scopeDepth++;
+        int node = blockBody(astParser.previous);
+        endScope();
+        return node;
+    }
+
+    // break and continue are statements only inside a loop
+    if (check(TOKEN_BREAK) || check(TOKEN_CONTINUE)) {
+        if (astParser.loopDepth == 0) return fail();
+        advance();
+        Token token = astParser.previous;
+        expect(TOKEN_SEMICOLON);
+        return addNode(token.type == TOKEN_BREAK ? NODE_BREAK : NODE_CONTINUE, token);
+    }
+
+    return expressionStatement();
+}
+
+static int declaration() {
+    if (astParser.failed) return -1;
+
+    if (match(TOKEN_CONST)) {
+        if (!expect(TOKEN_VAR)) return -1;
+        return varDeclaration(true);
+    }
+    if (match(TOKEN_VAR)) return varDeclaration(false);
+
+    // functions and classes declared inside stay with the single-pass compiler
+    if (check(TOKEN_FN) || check(TOKEN_CLASS)) return fail();
+    return statement();
+}
+
+bool parseFunctionBody(Ast* ast, Compiler* compiler, Token first) {
+    astParser.ast = ast;
+    astParser.current = first;
+    astParser.failed = first.type == TOKEN_ERROR;
+    astParser.localCount = 0;
+    astParser.loopDepth = 0;
+    astParser.pendingCount = 0;
+
+    // parameters and the body share the function's outermost scope
+    astParser.scopeDepth = 1;
+    ast->arity = compiler->function->arity;
+    for (int i = 1; i <= ast->arity; i++) {
+        Local* param = &compiler->locals[i];
+        if (!declareLocal(param->name, param->isConst)) {
+            fail();
+            break;
+        }
+        astParser.locals[astParser.localCount - 1].depth = 1;
+    }
+
+    ast->body = blockBody(first);
+
+    FREE_ARRAY(int, astParser.pending, astParser.pendingCapacity);
+    astParser.pending = NULL;
+    astParser.pendingCapacity = 0;
+
+    ast->previous = astParser.previous;
+    ast->current = astParser.current;
+    return !astParser.failed;
+}
@@ -0,0 +1,82 @@
+#ifndef clox_ast_h
+#define clox_ast_h
+#include "common.h"
+#include "clox_compiler.h"
+
+// Syntax tree of a function body, built for the optimizing compiler.
+// Only the core of the language is covered: the parser gives up on
+// anything else (classes, closures, arrays, strings with interpolation)
+// and the function is compiled by the single-pass compiler instead
+typedef enum {
+    NODE_NUMBER,
+    NODE_STRING,
+    NODE_NIL,
+    NODE_TRUE,
+    NODE_FALSE,
+    NODE_LOCAL,             // a local of the function, variable is its index
+    NODE_NONLOCAL,          // an enclosing const, an upvalue or a global
+    NODE_GLOBAL,            // a nonlocal known to be a global, in a kept body
+    NODE_ASSIGN_LOCAL,
+    NODE_ASSIGN_NONLOCAL,
+    NODE_ASSIGN_GLOBAL,
+    NODE_UNARY,
+    NODE_BINARY,
+    NODE_AND,
+    NODE_OR,
+    NODE_TERNARY,
+    NODE_CALL,
+
+    NODE_EXPRESSION,
+    NODE_PRINT,
+    NODE_VAR,
+    NODE_BLOCK,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_FOR,               // initializer, condition, increment, body
+    NODE_RETURN,
+    NODE_BREAK,
+    NODE_CONTINUE
+} NodeType;
+
+typedef struct {
+    NodeType type;
+    // operator, literal or name, and the line it's reported at
+    Token token;
+    double number;
+    int variable;
+    // operands, condition and branches, -1 when absent
+    int children[4];
+    // arguments of a call, statements of a block
+    int first;
+    int count;
+} Node;
+
+typedef struct {
+    Node* nodes;
+    int count;
+    int capacity;
+
+    // child lists of calls and blocks, each one contiguous
+    int* lists;
+    int listCount;
+    int listCapacity;
+
+    // the function's locals, parameters first. Every declaration is a
+    // new local, shadowing is resolved while parsing
+    int localCount;
+    int arity;
+    int body;
+
+    // where the parser stopped, just past the closing brace
+    Token previous;
+    Token current;
+} Ast;
+
+void initAst(Ast* ast);
+void freeAst(Ast* ast);
+// Parses the body of the function compiler is compiling, from first (the
+// token after '{'). False if the body uses anything the tree can't hold,
+// or has an error: the single-pass compiler reports those
+bool parseFunctionBody(Ast* ast, Compiler* compiler, Token first);
+
+#endif
@@ -8,13 +8,55 @@
 #include "clox_debug.h"
 #include "clox_compiler.h"
 #include "clox_scanner.h"
+#include "clox_ir.h"
 
 Parser parser;
+int optimizationLevel = 0;
 
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 Chunk* compilingChunk;
 
+// consts of the script initialized with a constant, constant is an
+// index into the script's pool
+typedef struct {
+    Token name;
+    int constant;
+} ConstGlobal;
+
+typedef struct {
+    ConstGlobal* globals;
+    int count;
+    int capacity;
+} ConstGlobals;
+
+ConstGlobals constGlobals;
+
+// functions of the script calls can be inlined into, candidate is the
+// index the optimizing compiler kept the body's tree at
+typedef struct {
+    Token name;
+    int candidate;
+} InlineGlobal;
+
+typedef struct {
+    InlineGlobal* globals;
+    int count;
+    int capacity;
+} InlineGlobals;
+
+InlineGlobals inlineGlobals;
+
+// Names assigned anywhere in the source, or declared more than once.
+// Which function they hold at a call isn't known from the declaration
+typedef struct {
+    Token* names;
+    int count;
+    int capacity;
+} NameList;
+
+NameList unstableNames;
+
 static void grouping(bool canAssign);
 static void unary(bool canAssign);
 static void binary(bool canAssign);
@@ -102,6 +144,12 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->constantIndex = NULL;
+    compiler->constantIndexCapacity = 0;
+    compiler->constantStart = -1;
+    compiler->constantEnd = -1;
+    compiler->jumpTarget = 0;
+    compiler->callEnd = -1;
     compiler->function = newFunction();
     current = compiler;
 
@@ -114,6 +162,8 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     local->name.start = "";
     local->isCaptured = false;
     local->isConst = false;
+    local->constant = -1;
+    local->inlinable = -1;
 
     if (type != TYPE_FUNCTION && type != TYPE_LAMBDA) {
         local->name.start = "this";
@@ -200,9 +250,70 @@ static bool matchCurrent(TokenTypes type) {
     return true;
 }
 
+// Strings hash by content rather than address, a collection may move
+// them while the function is being compiled
+static uint32_t hashConstant(Value value) {
+    if (IS_STRING(value)) return AS_STRING(value)->hash;
+    if (IS_BOOL(value)) return AS_BOOL(value) ? 1 : 2;
+    if (IS_NIL(value)) return 3;
+
+    double num = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+    return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+}
+
+// Numbers are the same constant only with the same bits: 0 and -0
+// compare equal but can't share a slot
+static bool sameConstant(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a), y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return valuesEqual(a, b);
+}
+
+// Functions are never looked up, each one is a constant of its own
+static bool isSharedConstant(Value value) {
+    return !IS_OBJ(value) || (IS_STRING(value) && AS_STRING(value)->isInterned);
+}
+
+static int32_t* findConstantSlot(Value value) {
+    Value* constants = currentChunk()->constants.values;
+    uint32_t mask = current->constantIndexCapacity - 1;
+    uint32_t i = hashConstant(value) & mask;
+
+    for (;;) {
+        int32_t* slot = &current->constantIndex[i];
+        if (*slot == -1 || sameConstant(constants[*slot], value)) return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+// Keeps the index at most half full, rehashing from the constant pool
+static void growConstantIndex() {
+    FREE_ARRAY(int32_t, current->constantIndex, current->constantIndexCapacity);
+    current->constantIndexCapacity = GROW_CAPACITY(current->constantIndexCapacity);
+    current->constantIndex = ALLOCATE(int32_t, current->constantIndexCapacity);
+    memset(current->constantIndex, -1, sizeof(int32_t) * current->constantIndexCapacity);
+
+    ValueArray* constants = &currentChunk()->constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (!isSharedConstant(constants->values[i])) continue;
+        *findConstantSlot(constants->values[i]) = i;
+    }
+}
+
 uint32_t makeConstant(Value value) {
-    uint32_t constant = addConstant(currentChunk(), value);
-    return constant;
+    if (!isSharedConstant(value)) return addConstant(currentChunk(), value);
+
+    if (currentChunk()->constants.count * 2 >= current->constantIndexCapacity) {
+        growConstantIndex();
+    }
+
+    int32_t* slot = findConstantSlot(value);
+    if (*slot == -1) *slot = (int32_t)addConstant(currentChunk(), value);
+    return (uint32_t)*slot;
 }
 
 uint32_t identifierConstant(Token* name) {
@@ -239,6 +350,8 @@ static void addLocal(Token name, bool isConst) {
     local->depth = -1;
     local->isConst = isConst;
     local->isCaptured = false;
+    local->constant = -1;
+    local->inlinable = -1;
 }
 
 static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
@@ -261,7 +374,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+int resolveUpvalue(Compiler* compiler, Token* name) {
     if (compiler->enclosing == NULL) return -1;
 
     int local = resolveLocal(compiler->enclosing, name);
@@ -307,32 +420,99 @@ static void emitThreeBytes(uint8_t byte1, uint8_t byte2, uint8_t byte3) {
     emitByte(byte3);
 }
 
-static void emitFourBytes(uint8_t byte1, uint8_t byte2, uint8_t byte3, uint8_t byte4) {
-    emitByte(byte1);
-    emitByte(byte2);
-    emitByte(byte3);
-    emitByte(byte4);
+static void emitOperand(OpCode opcode, uint32_t operand) {
+    if (operand > WIDE_MAX) {
+        error("Operand is larger than 24 bits.");
+    }
+
+    writeOperand(currentChunk(), opcode, operand, parser.previous.line);
+}
+
+static void recordConstant(int start) {
+    current->constantStart = start;
+    current->constantEnd = currentChunk()->count;
 }
 
 static void emitConstant(Value value) {
+    int start = currentChunk()->count;
+    emitOperand(OP_CONSTANT, makeConstant(value));
+    recordConstant(start);
+}
 
-    if (currentChunk()->constants.count <= UINT8_MAX) {
-        uint8_t constant = makeConstant(value);
-        emitBytes(OP_CONSTANT, constant);
+// Reads back the constant loaded by the instruction at start
+static bool constantAt(int start, Value* value) {
+    Chunk* chunk = currentChunk();
+    uint8_t* code = &chunk->code[start];
 
-    } else {
-        uint32_t constantLong = makeConstant(value);
-        emitFourBytes(OP_CONSTANT_LONG, (uint8_t)((constantLong & 0x000000ff)),
-                                        (uint8_t)((constantLong & 0x0000ff00) >> 8),
-                                        (uint8_t)((constantLong & 0x00ff0000) >> 16));
+    switch (code[0]) {
+        case OP_NIL:    *value = NIL_VAL; return true;
+        case OP_TRUE:   *value = BOOL_VAL(true); return true;
+        case OP_FALSE:  *value = BOOL_VAL(false); return true;
+        case OP_CONSTANT:
+            *value = chunk->constants.values[code[1]];
+            return true;
+        case OP_WIDE:
+            if (code[3] != OP_CONSTANT) return false;
+            *value = chunk->constants.values[code[1] << 16 | code[2] << 8 | code[4]];
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The value of the expression just compiled, if it's known: the last
+// instruction loads a constant and no jump lands past its start
+static bool lastConstant(Value* value) {
+    if (current->constantEnd != currentChunk()->count) return false;
+    if (current->jumpTarget > current->constantStart) return false;
+    return constantAt(current->constantStart, value);
+}
 
+// Takes the last constant load back out, something replaces it
+static void dropConstant() {
+    truncateChunk(currentChunk(), current->constantStart);
+    current->constantEnd = -1;
+}
+
+static void emitFoldedConstant(Value value) {
+    int start = currentChunk()->count;
+
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
     }
+    recordConstant(start);
 }
 
-static void emitLongInstruction(OpCode opcode, int arg) {
-    emitFourBytes(opcode, (uint8_t)((arg & 0x000000ff)),
-                                         (uint8_t)((arg & 0x0000ff00) >> 8),
-                                         (uint8_t)((arg & 0x00ff0000) >> 16));
+static bool isFalseyConstant(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+typedef struct {
+    int count;
+    int constantStart;
+    int constantEnd;
+    int jumpTarget;
+    int callEnd;
+} CodeMark;
+
+static CodeMark markCode() {
+    CodeMark mark = {currentChunk()->count, current->constantStart,
+                     current->constantEnd, current->jumpTarget, current->callEnd};
+    return mark;
+}
+
+// Drops code that can never run, it's compiled anyway for its errors.
+// Jumps into it are gone with it
+static void discardCode(CodeMark mark) {
+    truncateChunk(currentChunk(), mark.count);
+    current->constantStart = mark.constantStart;
+    current->constantEnd = mark.constantEnd;
+    current->jumpTarget = mark.jumpTarget;
+    current->callEnd = mark.callEnd;
 }
 
 static int emitJump(uint8_t instruction) {
@@ -354,16 +534,29 @@ static void patchJump(int offset) {
     //inserting the actual jump value as operand of OP_JUMP_IF_FALSE
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    current->jumpTarget = currentChunk()->count;
 }
 
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+// Loop exits and breaks jump over the whole body. They leave room for
+// an OP_WIDE prefix, filled in when the body is past 16 bits reach
+static int emitWideJump(uint8_t instruction) {
+    emitBytes(OP_WIDE, 0);
+    emitByte(0);
+    return emitJump(instruction);
+}
+
+static void patchWideJump(int offset) {
+    int jump = currentChunk()->count - offset - 2;
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body is too large.");
+    currentChunk()->code[offset - 3] = (jump >> 24) & 0xff;
+    currentChunk()->code[offset - 2] = (jump >> 16) & 0xff;
+    currentChunk()->code[offset] = (jump >> 8) & 0xff;
+    currentChunk()->code[offset + 1] = jump & 0xff;
+    current->jumpTarget = currentChunk()->count;
+}
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+static void emitLoop(int loopStart) {
+    writeLoop(currentChunk(), loopStart, parser.previous.line);
 }
 
 static void emitReturn(FunctionType type) {
@@ -379,12 +572,14 @@ static void emitReturn(FunctionType type) {
 static ObjFunction* endCompiler(FunctionType type) {
     emitReturn(type);
     ObjFunction* function = current->function;
+    if (!parser.hadError) function->maxStack = chunkMaxStack(&function->chunk, function->arity + 1);
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), function->name != NULL? function->name->chars : "<script>");
     }
 #endif
+    FREE_ARRAY(int32_t, current->constantIndex, current->constantIndexCapacity);
     current = current->enclosing;
     return function;
 }
@@ -432,6 +627,20 @@ static void unary(bool canAssign) {
 
     parsePrecedence(PREC_UNARY);
 
+    Value operand;
+    if (lastConstant(&operand)) {
+        if (operatorType == TOKEN_BANG) {
+            dropConstant();
+            emitFoldedConstant(BOOL_VAL(isFalseyConstant(operand)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+            dropConstant();
+            emitFoldedConstant(NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
+
     switch(operatorType) {
         case TOKEN_BANG: emitByte(OP_NOT); break;
         case TOKEN_MINUS: emitByte(OP_NEGATE); break;
@@ -440,15 +649,76 @@ static void unary(bool canAssign) {
     }
 }
 
+// Evaluates a binary operator on two constants the way the VM would.
+// Operands the VM would reject, or convert, are left to it
+static bool foldBinary(TokenTypes operatorType, Value a, Value b, Value* result) {
+    if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+        bool equal = valuesEqual(a, b);
+        *result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+        return true;
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        // copied out first, allocating the result may move them
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+
+        *result = OBJ_VAL(takeString(chars, length));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch (operatorType) {
+        case TOKEN_PLUS:            *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:           *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:            *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:           *result = NUMBER_VAL(x / y); return true;
+        case TOKEN_GREATER:         *result = BOOL_VAL(x > y); return true;
+        case TOKEN_LESS:            *result = BOOL_VAL(x < y); return true;
+        // emitted as the negated opposite, NaN included
+        case TOKEN_GREATER_EQUAL:   *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS_EQUAL:      *result = BOOL_VAL(!(x > y)); return true;
+
+        default: return false;
+    }
+}
+
 static void binary(bool canAssign) {
 
  // op type
     TokenTypes operatorType = parser.previous.type;
 
+    Value left, right;
+    bool isLeftConstant = lastConstant(&left);
+    int leftStart = current->constantStart;
+    int leftEnd = current->constantEnd;
+
  // compile the right op
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    // both operands are adjacent loads: the operation is done here.
+    // left is read again, compiling right may have moved it
+    if (isLeftConstant && lastConstant(&right)
+        && current->constantStart == leftEnd && current->jumpTarget <= leftStart
+        && constantAt(leftStart, &left)) {
+
+        Value result;
+        if (foldBinary(operatorType, left, right, &result)) {
+            truncateChunk(currentChunk(), leftStart);
+            emitFoldedConstant(result);
+            return;
+        }
+    }
+
  // emit the op instruction
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:      emitBytes(OP_EQUAL, OP_NOT); break;
@@ -468,6 +738,23 @@ static void binary(bool canAssign) {
 
 static void ternary(bool canAssign) {
 
+    // a constant condition picks a branch now, the other one is dropped
+    Value condition;
+    if (lastConstant(&condition)) {
+        bool isTrue = !isFalseyConstant(condition);
+        dropConstant();
+
+        CodeMark mark = markCode();
+        parsePrecedence(PREC_TERNARY);
+        if (!isTrue) discardCode(mark);
+        consume(TOKEN_COLON, "Expect ':' after the then branch");
+
+        mark = markCode();
+        parsePrecedence(PREC_TERNARY);
+        if (isTrue) discardCode(mark);
+        return;
+    }
+
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
 
@@ -488,6 +775,8 @@ static void number(bool canAssign) {
 }
 
 static void literal(bool canAssign) {
+    int start = currentChunk()->count;
+
     switch (parser.previous.type) {
         case TOKEN_FALSE:   emitByte(OP_FALSE); break;
         case TOKEN_NIL:     emitByte(OP_NIL); break;
@@ -495,6 +784,7 @@ static void literal(bool canAssign) {
 
         default: return;
     }
+    recordConstant(start);
 }
 
 static void string(bool canAssign) {
@@ -565,30 +855,169 @@ static void call(bool canAssign) {
     // }
 
     emitBytes(OP_CALL, argCount);
+    current->callEnd = currentChunk()->count;
 }
 
 static void setVariable(OpCode opcodes[], int arg) {
+    emitOperand(opcodes[1], arg);
+}
+
+static void getVariable(OpCode opcodes[], int arg) {
+    emitOperand(opcodes[0], arg);
+}
 
-    if (arg <= UINT8_MAX) {
-        emitBytes(opcodes[1], (uint8_t)arg);
+// The value of a const initialized with a constant, looked up without
+// side effects: locals capture nothing and globals add no names
+bool constBinding(Token* name, Value* value) {
+    for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            Local* local = &compiler->locals[i];
+            if (!identifiersEqual(name, &local->name)) continue;
+            if (local->depth == -1 || local->constant == -1) return false;
 
-    } else emitFourBytes(opcodes[1], (uint8_t)((arg & 0x000000ff)),
-                                         (uint8_t)((arg & 0x0000ff00) >> 8),
-                                         (uint8_t)((arg & 0x00ff0000) >> 16));
+            *value = compiler->function->chunk.constants.values[local->constant];
+            return true;
+        }
+
+        if (compiler->enclosing == NULL) {
+            for (int i = constGlobals.count - 1; i >= 0; i--) {
+                if (!identifiersEqual(name, &constGlobals.globals[i].name)) continue;
+
+                int constant = constGlobals.globals[i].constant;
+                *value = compiler->function->chunk.constants.values[constant];
+                return true;
+            }
+        }
+    }
+
+    return false;
 }
 
-static void getVariable(OpCode opcodes[], int arg) {
+static void forgetConstGlobal(Token* name) {
+    for (int i = 0; i < constGlobals.count; i++) {
+        if (identifiersEqual(name, &constGlobals.globals[i].name)) {
+            constGlobals.globals[i] = constGlobals.globals[--constGlobals.count];
+            return;
+        }
+    }
+}
+
+static void addConstGlobal(Token name, int constant) {
+    forgetConstGlobal(&name);
 
-    if (arg <= UINT8_MAX) {
-        emitBytes(opcodes[0], (uint8_t)arg);
+    if (constGlobals.capacity < constGlobals.count + 1) {
+        int oldCapacity = constGlobals.capacity;
+        constGlobals.capacity = GROW_CAPACITY(oldCapacity);
+        constGlobals.globals = GROW_ARRAY(ConstGlobal, constGlobals.globals,
+                                          oldCapacity, constGlobals.capacity);
+    }
 
-    } else emitFourBytes(opcodes[0], (uint8_t)((arg & 0x000000ff)),
-                                         (uint8_t)((arg & 0x0000ff00) >> 8),
-                                         (uint8_t)((arg & 0x00ff0000) >> 16));
+    constGlobals.globals[constGlobals.count].name = name;
+    constGlobals.globals[constGlobals.count].constant = constant;
+    constGlobals.count++;
+}
 
+static bool containsName(NameList* list, Token* name) {
+    for (int i = 0; i < list->count; i++) {
+        if (identifiersEqual(name, &list->names[i])) return true;
+    }
+    return false;
+}
+
+static void addName(NameList* list, Token name) {
+    if (list->capacity < list->count + 1) {
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->names = GROW_ARRAY(Token, list->names, oldCapacity, list->capacity);
+    }
+    list->names[list->count++] = name;
+}
+
+static void freeNames(NameList* list) {
+    FREE_ARRAY(Token, list->names, list->capacity);
+    list->names = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+// A pass over the tokens of the whole source before it's compiled: a
+// call can only be inlined if nothing anywhere rebinds the name
+static void findUnstableNames(const char* source) {
+    NameList declared = {NULL, 0, 0};
+    unstableNames.count = 0;
+    initScanner(source);
+
+    Token previous = scanToken();
+    while (previous.type != TOKEN_EOF) {
+        Token token = scanToken();
+
+        if (previous.type == TOKEN_IDENTIFIER
+            && (token.type == TOKEN_EQUAL || token.type == TOKEN_PLUS_EQUAL
+                || token.type == TOKEN_MINUS_EQUAL)) {
+            addName(&unstableNames, previous);
+        } else if (token.type == TOKEN_IDENTIFIER
+                   && (previous.type == TOKEN_FN || previous.type == TOKEN_VAR
+                       || previous.type == TOKEN_CLASS)) {
+            if (containsName(&declared, &token)) addName(&unstableNames, token);
+            else addName(&declared, token);
+        }
+
+        previous = token;
+    }
+
+    freeNames(&declared);
+    initScanner(source);
+}
+
+static void addInlineGlobal(Token name, int candidate) {
+    if (inlineGlobals.capacity < inlineGlobals.count + 1) {
+        int oldCapacity = inlineGlobals.capacity;
+        inlineGlobals.capacity = GROW_CAPACITY(oldCapacity);
+        inlineGlobals.globals = GROW_ARRAY(InlineGlobal, inlineGlobals.globals,
+                                           oldCapacity, inlineGlobals.capacity);
+    }
+
+    inlineGlobals.globals[inlineGlobals.count].name = name;
+    inlineGlobals.globals[inlineGlobals.count].candidate = candidate;
+    inlineGlobals.count++;
+}
+
+// The inlining candidate a call to name reaches, -1 if it's not known.
+// Names resolved to globals already skip the enclosing functions
+int inlineCandidate(Token* name, bool isGlobal) {
+    if (containsName(&unstableNames, name)) return -1;
+
+    if (!isGlobal) {
+        for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+            for (int i = compiler->localCount - 1; i >= 0; i--) {
+                Local* local = &compiler->locals[i];
+                if (!identifiersEqual(name, &local->name)) continue;
+                return local->depth == -1 ? -1 : local->inlinable;
+            }
+        }
+    }
+
+    for (int i = inlineGlobals.count - 1; i >= 0; i--) {
+        if (identifiersEqual(name, &inlineGlobals.globals[i].name)) {
+            return inlineGlobals.globals[i].candidate;
+        }
+    }
+    return -1;
 }
 
 static void namedVariable(Token name, bool canAssign) {
+    // reading a const with a known value loads the value itself
+    TokenTypes next = parser.current.type;
+    if (next != TOKEN_LEFT_SQUARE_BRACE && next != TOKEN_EQUAL
+        && next != TOKEN_PLUS_EQUAL && next != TOKEN_MINUS_EQUAL) {
+
+        Value value;
+        if (constBinding(&name, &value)) {
+            emitFoldedConstant(value);
+            return;
+        }
+    }
+
     int arg = resolveLocal(current, &name);
     int _indexingCount = 0;
     bool compoundAssign = false;
@@ -605,16 +1034,12 @@ static void namedVariable(Token name, bool canAssign) {
         setOp = OP_SET_UPVALUE;
         getElemOp = OP_GET_ELEMENT_UPVALUE;
         setElemOp = OP_SET_ELEMENT_UPVALUE;
-    } else if ((arg = identifierConstant(&name)) <= UINT8_MAX) {
+    } else {
+        arg = identifierConstant(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
         getElemOp = OP_GET_ELEMENT_GLOBAL;
         setElemOp = OP_SET_ELEMENT_GLOBAL;
-    } else {
-        getOp = OP_GET_GLOBAL_LONG;
-        setOp = OP_SET_GLOBAL_LONG;
-        getElemOp = OP_GET_ELEMENT_GLOBAL_LONG;
-        setElemOp = OP_SET_ELEMENT_GLOBAL_LONG;
     }
 
     OpCode opcodes[4] = {getOp, setOp, getElemOp, setElemOp};
@@ -636,21 +1061,21 @@ static void namedVariable(Token name, bool canAssign) {
                 error("Cannot assign to const variable.");
             }
             parsePrecedence(PREC_EQUALITY);
-            emitBytes(setElemOp, arg);
+            emitOperand(setElemOp, arg);
 
         } else if (canAssign && compoundAssign) {
             emitBytes(OP_PUSH_FROM, 0);
-            emitBytes(getElemOp, arg);
+            emitOperand(getElemOp, arg);
             parsePrecedence(PREC_EQUALITY);
             compoundType == TOKEN_MINUS_EQUAL? emitByte(OP_SUBTRACT) : emitByte(OP_ADD);
-            emitBytes(setElemOp, arg);
+            emitOperand(setElemOp, arg);
 
-        } else emitBytes(getElemOp, arg);
+        } else emitOperand(getElemOp, arg);
     }
 
     else if (_indexingCount > 1) {
         emitBytes(OP_REVERSE_N, _indexingCount);
-        emitBytes(getElemOp, arg);
+        emitOperand(getElemOp, arg);
 
         // if we want to assign to an indirect variable we have to keep
         // on the stack the index/indexeable pair for OP_INDIRECT_STORE
@@ -739,17 +1164,9 @@ static void defineVariable(uint32_t global, bool isConst) {
         return;
     }
 
+    if (!isConst) forgetConstGlobal(&parser.previous);
 
-    if (global <= UINT8_MAX) {
-        isConst? emitBytes(OP_DEFINE_CONST_GLOBAL, (uint8_t)global) : emitBytes(OP_DEFINE_GLOBAL, (uint8_t)global);
-    } else {
-        if (isConst) emitFourBytes(OP_DEFINE_CONST_GLOBAL_LONG, (uint8_t)((global & 0x000000ff)),
-                                                                (uint8_t)((global & 0x0000ff00) >> 8),
-                                                                (uint8_t)((global & 0x00ff0000) >> 16));
-        else emitFourBytes(OP_DEFINE_GLOBAL_LONG, (uint8_t)((global & 0x000000ff)),
-                                                  (uint8_t)((global & 0x0000ff00) >> 8),
-                                                  (uint8_t)((global & 0x00ff0000) >> 16));
-    }
+    emitOperand(isConst ? OP_DEFINE_CONST_GLOBAL : OP_DEFINE_GLOBAL, global);
 
 }
 
@@ -783,10 +1200,7 @@ static void array(bool canAssign) {
 
     consume(TOKEN_RIGHT_SQUARE_BRACE, "Expect ']' after array initialization");
 
-    if (elementsCount < 256) emitBytes(OP_ARRAY, (uint8_t)elementsCount);
-    else emitFourBytes(OP_ARRAY_LONG, (uint8_t)((elementsCount & 0x000000ff)),
-                                      (uint8_t)((elementsCount & 0x0000ff00) >> 8),
-                                      (uint8_t)((elementsCount & 0x00ff0000) >> 16));
+    emitOperand(OP_ARRAY, elementsCount);
 }
 
 static void dict(bool canAssign) {
@@ -803,10 +1217,7 @@ static void dict(bool canAssign) {
 
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after dictionary initialization");
 
-    if (totalCount < 256) emitBytes(OP_MAP, (uint8_t)totalCount);
-    else emitFourBytes(OP_MAP_LONG, (uint8_t)((totalCount & 0x000000ff)),
-                                    (uint8_t)((totalCount & 0x0000ff00) >> 8),
-                                    (uint8_t)((totalCount & 0x00ff0000) >> 16));
+    emitOperand(OP_MAP, totalCount);
 }
 
 static void inRange(bool canAssign) {
@@ -850,10 +1261,255 @@ static void or_(bool canAssign) {
 }
 
 static void block();
+
+#define MATCH_MIN_ARMS 4
+#define MATCH_DENSE_SPAN 1024
+
+typedef struct {
+    Token token;
+    bool negated;
+} MatchPattern;
+
+// Skips the body of a match arm, from just past its '=>', by bracket
+// depth. Returns the token that ends it at depth 0: a comma before the
+// next arm, a closing bracket or ';' past the last one, or the match
+// keyword of a nested match, which takes the commas that follow it
+static Token skipArmBody() {
+    TokenTypes open[64];
+    int depth = 0;
+
+    for (;;) {
+        Token token = scanToken();
+        switch (token.type) {
+            case TOKEN_EOF:
+            case TOKEN_ERROR:
+                return token;
+            case TOKEN_LEFT_PAREN:
+            case TOKEN_LEFT_SQUARE_BRACE:
+            case TOKEN_LEFT_BRACE:
+            case TOKEN_STRING_INTERP_START:
+                if (depth == 64) {
+                    token.type = TOKEN_ERROR;
+                    return token;
+                }
+                open[depth++] = token.type;
+                continue;
+            default:
+                break;
+        }
+
+        if (depth == 0) {
+            switch (token.type) {
+                case TOKEN_COMMA:
+                case TOKEN_SEMICOLON:
+                case TOKEN_RIGHT_PAREN:
+                case TOKEN_RIGHT_SQUARE_BRACE:
+                case TOKEN_RIGHT_BRACE:
+                case TOKEN_MATCH:
+                    return token;
+                default:
+                    continue;
+            }
+        }
+
+        // the scanner ends an interpolation with a ';'
+        TokenTypes opener = open[depth - 1];
+        if ((token.type == TOKEN_RIGHT_PAREN && opener == TOKEN_LEFT_PAREN)
+            || (token.type == TOKEN_RIGHT_SQUARE_BRACE && opener == TOKEN_LEFT_SQUARE_BRACE)
+            || (token.type == TOKEN_RIGHT_BRACE && opener == TOKEN_LEFT_BRACE)
+            || (token.type == TOKEN_SEMICOLON && opener == TOKEN_STRING_INTERP_START)) {
+            depth--;
+        }
+    }
+}
+
+// Looks over the arms of a match from the current token, without
+// consuming them. Returns how many there are when every pattern is a
+// number or string literal, filling patterns, and 0 otherwise
+static int literalPatterns(MatchPattern* patterns) {
+    Scanner saved = saveScanner();
+    Token token = parser.current;
+    int count = 0;
+
+    for (;;) {
+        MatchPattern* pattern = &patterns[count];
+        pattern->negated = token.type == TOKEN_MINUS;
+        if (pattern->negated) token = scanToken();
+
+        if (token.type != TOKEN_NUMBER && (pattern->negated || token.type != TOKEN_STRING)) {
+            count = 0;
+            break;
+        }
+        pattern->token = token;
+
+        // the linear chain takes the arms past 256
+        if (scanToken().type != TOKEN_MATCHES_TO || ++count == 256) {
+            count = 0;
+            break;
+        }
+
+        Token end = skipArmBody();
+        if (end.type == TOKEN_EOF || end.type == TOKEN_ERROR) count = 0;
+        if (end.type != TOKEN_COMMA) break;
+        token = scanToken();
+    }
+
+    restoreScanner(saved);
+    return count;
+}
+
+static double patternNumber(MatchPattern* pattern) {
+    double number = strtod(pattern->token.start, NULL);
+    return pattern->negated ? -number : number;
+}
+
+// Dense when the patterns are integers spread over a small enough
+// range, an entry per integer from the smallest one up
+static bool denseRange(MatchPattern* patterns, int count, int32_t* min, int* size) {
+    double low = 0, high = 0;
+    for (int i = 0; i < count; i++) {
+        if (patterns[i].token.type != TOKEN_NUMBER) return false;
+
+        double number = patternNumber(&patterns[i]);
+        if (number < INT32_MIN || number > INT32_MAX || number != (int32_t)number) return false;
+
+        if (i == 0 || number < low) low = number;
+        if (i == 0 || number > high) high = number;
+    }
+
+    double span = high - low + 1;
+    if (span > MATCH_DENSE_SPAN || span > count * 4) return false;
+
+    *min = (int32_t)low;
+    *size = (int)span;
+    return true;
+}
+
+static void patchMatchTarget(int entry, int tableEnd) {
+    int target = currentChunk()->count - tableEnd;
+    if (target >= MATCH_EMPTY) {
+        error("Jump is larger than 16 bits.");
+    }
+
+    currentChunk()->code[entry] = (target >> 8) & 0xff;
+    currentChunk()->code[entry + 1] = target & 0xff;
+    current->jumpTarget = currentChunk()->count;
+}
+
+// Arms with literal patterns: OP_MATCH_TABLE, then the arm bodies, each
+// entry patched to its body as that's compiled. The first arm with a
+// pattern takes its entry, a later one repeating it is never reached
+static void matchTable(MatchPattern* patterns, int count) {
+    int32_t min = 0;
+    int size;
+    uint8_t kind = denseRange(patterns, count, &min, &size) ? MATCH_DENSE : MATCH_HASHED;
+
+    // each arm's entry, -1 for an arm that repeats a pattern
+    int entries[256];
+    uint16_t constants[512];
+    if (kind == MATCH_HASHED) {
+        size = 8;
+        while (size < count * 2) size *= 2;
+        for (int i = 0; i < size; i++) constants[i] = MATCH_EMPTY;
+
+        for (int i = 0; i < count; i++) {
+            Token* token = &patterns[i].token;
+            Value value = token->type == TOKEN_NUMBER
+                          ? NUMBER_VAL(patternNumber(&patterns[i]))
+                          : OBJ_VAL(copyString(token->start + 1, token->length - 2));
+            uint16_t constant = (uint16_t)makeConstant(value);
+            Value* values = currentChunk()->constants.values;
+
+            entries[i] = -1;
+            uint32_t mask = size - 1;
+            for (uint32_t j = hashMatchKey(value) & mask; ; j = (j + 1) & mask) {
+                if (constants[j] == MATCH_EMPTY) {
+                    constants[j] = constant;
+                    entries[i] = j;
+                    break;
+                }
+                if (valuesEqual(values[constants[j]], value)) break;
+            }
+        }
+    } else {
+        bool taken[MATCH_DENSE_SPAN] = {false};
+        for (int i = 0; i < count; i++) {
+            int index = (int)(patternNumber(&patterns[i]) - min);
+            entries[i] = taken[index] ? -1 : index;
+            taken[index] = true;
+        }
+    }
+
+    emitBytes(OP_MATCH_TABLE, kind);
+    emitBytes((size >> 8) & 0xff, size & 0xff);
+    int defaultEntry = currentChunk()->count;
+    emitBytes(0xff, 0xff);
+    if (kind == MATCH_DENSE) {
+        uint32_t bits = (uint32_t)min;
+        emitBytes((bits >> 24) & 0xff, (bits >> 16) & 0xff);
+        emitBytes((bits >> 8) & 0xff, bits & 0xff);
+    }
+
+    int entrySize = kind == MATCH_DENSE ? 2 : 4;
+    int table = currentChunk()->count;
+    for (int i = 0; i < size; i++) {
+        if (kind == MATCH_HASHED) emitBytes((constants[i] >> 8) & 0xff, constants[i] & 0xff);
+        emitBytes(0xff, 0xff);
+    }
+    int tableEnd = currentChunk()->count;
+
+    int exitJumps[256];
+    for (int i = 0; i < count; i++) {
+        if (i > 0) consume(TOKEN_COMMA, "Expect ',' between match cases.");
+        matchCurrent(TOKEN_MINUS);
+        advance();
+        consume(TOKEN_MATCHES_TO, "Expected '=>' after match case");
+
+        if (entries[i] != -1) {
+            patchMatchTarget(table + entries[i] * entrySize + entrySize - 2, tableEnd);
+        }
+
+        if (matchCurrent(TOKEN_LEFT_BRACE)) {
+            beginScope();
+            block();
+            endScope();
+
+            consume(TOKEN_COLON, "Expect ':' after match block");
+        }
+        matchCurrent(TOKEN_COLON);
+        expression();
+
+        exitJumps[i] = emitJump(OP_JUMP);
+    }
+
+    // nothing matched: false over the value, as the linear chain leaves it
+    patchMatchTarget(defaultEntry, tableEnd);
+    emitByte(OP_FALSE);
+    int endJump = emitJump(OP_JUMP);
+
+    for (int i = 0; i < count; i++) {
+        patchJump(exitJumps[i]);
+    }
+    emitThreeBytes(OP_SWAP, 0, 1);
+    emitByte(OP_POP);
+
+    patchJump(endJump);
+}
+
 static void match(bool canAssign) {
     expression();
 
     matchCurrent(TOKEN_RIGHT_BRACE);
+
+    // hashed entries refer to their patterns by a 16 bit constant index
+    MatchPattern patterns[256];
+    int count = literalPatterns(patterns);
+    if (count >= MATCH_MIN_ARMS && currentChunk()->constants.count + count < MATCH_EMPTY) {
+        matchTable(patterns, count);
+        matchCurrent(TOKEN_RIGHT_BRACE);
+        return;
+    }
+
     int branchJumps[256];
     int exitJumps[256];
     int casesCount = 0;
@@ -897,7 +1553,7 @@ static void match(bool canAssign) {
     matchCurrent(TOKEN_RIGHT_BRACE);
 }
 
-static void function(FunctionType type);
+static int function(FunctionType type);
 static void lambda(bool canAssign) {
     function(TYPE_LAMBDA);
 }
@@ -908,27 +1564,15 @@ static void dot(bool canAssign) {
 
     if (canAssign && matchCurrent(TOKEN_EQUAL)) {
         expression();
-        if (name <= UINT8_MAX) {
-            emitBytes(OP_SET_PROPERTY, name);
-        } else {
-            emitLongInstruction(OP_SET_PROPERTY_LONG, name);
-        }
+        emitOperand(OP_SET_PROPERTY, name);
     }
     else if (matchCurrent(TOKEN_LEFT_PAREN)) {
         uint8_t argc = argumentList();
-        if (name <= UINT8_MAX) {
-            emitThreeBytes(OP_INVOKE, name, argc);
-        } else {
-            emitLongInstruction(OP_INVOKE_LONG, name);
-            emitByte(argc);
-        }
+        emitOperand(OP_INVOKE, name);
+        emitByte(argc);
     }
     else {
-        if (name <= UINT8_MAX) {
-            emitBytes(OP_GET_PROPERTY, name);
-        } else {
-            emitLongInstruction(OP_GET_PROPERTY_LONG, name);
-        }
+        emitOperand(OP_GET_PROPERTY, name);
     }
 }
 
@@ -952,11 +1596,7 @@ static void super_(bool canAssign) {
 
     namedVariable(makeSyntheticToken("this"), false);
     namedVariable(makeSyntheticToken("super"), false);
-    if (arg <= UINT8_MAX) {
-        emitBytes(OP_GET_SUPER, arg);
-    } else {
-        emitLongInstruction(OP_GET_SUPER_LONG, arg);
-    }
+    emitOperand(OP_GET_SUPER, arg);
 }
 
 
@@ -1001,6 +1641,7 @@ static void loopBlock(int loopStart, BreakEntries* breakEntries);
 
 static void varDeclaration(bool isConst) {
     uint32_t global = parseVariable("Expect a variable name.", isConst);
+    Token name = parser.previous;
 
     if (matchCurrent(TOKEN_EQUAL)) {
         expression();
@@ -1008,6 +1649,16 @@ static void varDeclaration(bool isConst) {
         emitByte(OP_NIL);
     }
 
+    Value value;
+    if (isConst && lastConstant(&value)) {
+        uint32_t constant = makeConstant(value);
+        if (current->scopeDepth > 0) {
+            current->locals[current->localCount - 1].constant = constant;
+        } else if (current->type == TYPE_SCRIPT) {
+            addConstGlobal(name, constant);
+        }
+    }
+
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
     defineVariable(global, isConst);
@@ -1023,11 +1674,7 @@ static void method() {
         type = TYPE_INITIALIZER;
     }
     function(type);
-    if (constant <= UINT8_MAX) {
-        emitBytes(OP_METHOD, constant);
-    } else {
-        emitLongInstruction(OP_METHOD_LONG, constant);
-    }
+    emitOperand(OP_METHOD, constant);
 }
 
 static void field(bool isConst) {
@@ -1037,12 +1684,8 @@ static void field(bool isConst) {
     printf("Name: %s\n", name->chars);
     consume(TOKEN_SEMICOLON, "Expect ';' after field declaration");
     uint32_t arg = makeConstant(OBJ_VAL(name));
-    if (arg <= UINT8_MAX) {
-        emitThreeBytes(OP_DEFINE_PROPERTY, arg, (uint8_t)isConst);
-    } else {
-        emitLongInstruction(OP_DEFINE_PROPERTY_LONG, arg);
-        emitByte(isConst);
-    }
+    emitOperand(OP_DEFINE_PROPERTY, arg);
+    emitByte(isConst);
 }
 
 static void classDeclaration() {
@@ -1051,11 +1694,7 @@ static void classDeclaration() {
     Token className = parser.previous;
     declareVariable(false);
 
-    if (nameConstant <= UINT8_MAX) {
-        emitBytes(OP_CLASS, nameConstant);
-    } else {
-        emitLongInstruction(OP_CLASS_LONG, nameConstant);
-    }
+    emitOperand(OP_CLASS, nameConstant);
 
     defineVariable(nameConstant, false);
 
@@ -1105,8 +1744,10 @@ static void classDeclaration() {
 }
 
 
-static void function(FunctionType type) {
+// Returns the index the body was kept at for inlining, -1 if it wasn't
+static int function(FunctionType type) {
     Compiler compiler;
+    int inlinable = -1;
     initCompiler(&compiler, type);
     beginScope();
 
@@ -1132,16 +1773,15 @@ static void function(FunctionType type) {
 
     // body
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body");
-    block();
+    bool isOptimizable = type == TYPE_FUNCTION || type == TYPE_LAMBDA || type == TYPE_METHOD;
+    if (optimizationLevel == 0 || !isOptimizable || !compileOptimizedBody(&inlinable)) {
+        block();
+    }
 
     // creating function object
     ObjFunction* function = endCompiler(type);
     uint32_t func = makeConstant(OBJ_VAL(function));
-    if (func <= UINT8_MAX) {
-        emitBytes(OP_CLOSURE, func);
-    } else {
-        emitLongInstruction(OP_CLOSURE_LONG, func);
-    }
+    emitOperand(OP_CLOSURE, func);
 
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
@@ -1156,13 +1796,20 @@ static void function(FunctionType type) {
         */
     }
 
+    return inlinable;
 }
 
 static void funDeclaration() {
     // TOKEN_CONST makes sense only for variables, so we set the flag isConst to false
     uint32_t global = parseVariable("Expect function name.", false);
+    Token name = parser.previous;
     markInitialized();
-    function(TYPE_FUNCTION);
+    int inlinable = function(TYPE_FUNCTION);
+
+    if (inlinable != -1 && !containsName(&unstableNames, &name)) {
+        if (current->scopeDepth > 0) current->locals[current->localCount - 1].inlinable = inlinable;
+        else addInlineGlobal(name, inlinable);
+    }
     defineVariable(global, false);
 }
 
@@ -1186,6 +1833,41 @@ static void ifStatement(bool insideLoop, int loopStart, BreakEntries* breakEntri
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    // a constant condition keeps one branch, the other one is compiled
+    // and dropped along with any break it registered
+    Value condition;
+    if (lastConstant(&condition)) {
+        bool isTrue = !isFalseyConstant(condition);
+        dropConstant();
+
+        int breakCount = breakEntries != NULL ? breakEntries->breakCount : 0;
+        CodeMark mark = markCode();
+        if (insideLoop) {
+            loopStatement(loopStart, breakEntries);
+        } else {
+            statement();
+        }
+        if (!isTrue) {
+            discardCode(mark);
+            if (breakEntries != NULL) breakEntries->breakCount = breakCount;
+        }
+
+        if (matchCurrent(TOKEN_ELSE)) {
+            breakCount = breakEntries != NULL ? breakEntries->breakCount : 0;
+            mark = markCode();
+            if (insideLoop) {
+                loopStatement(loopStart, breakEntries);
+            } else {
+                statement();
+            }
+            if (isTrue) {
+                discardCode(mark);
+                if (breakEntries != NULL) breakEntries->breakCount = breakCount;
+            }
+        }
+        return;
+    }
+
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
 
     emitByte(OP_POP);
@@ -1223,7 +1905,7 @@ static void whileStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    int exitJump = emitWideJump(OP_JUMP_IF_FALSE);
 
     emitByte(OP_POP);
 
@@ -1232,11 +1914,11 @@ static void whileStatement() {
 
     emitLoop(loopStart);
 
-    patchJump(exitJump);
+    patchWideJump(exitJump);
     emitByte(OP_POP);
 
     for (int i = 0; i < breakEntries.breakCount; i++) {
-        patchJump(breakEntries.breakJumps[i]);
+        patchWideJump(breakEntries.breakJumps[i]);
     }
 }
 
@@ -1286,7 +1968,7 @@ static void forEachStatement(BreakEntries* breakEntries) {
     emitBytes(OP_GET_LOCAL, _arg);
     emitByte(OP_GREATER);
 
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
+    exitJump = emitWideJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
 
     loopStatement(loopStart, breakEntries);
@@ -1301,12 +1983,12 @@ static void forEachStatement(BreakEntries* breakEntries) {
     emitLoop(loopStart);
 
     if (exitJump != -1) {
-        patchJump(exitJump);
+        patchWideJump(exitJump);
         emitByte(OP_POP);
     }
 
     for (int i = 0; i < breakEntries->breakCount; i++) {
-        patchJump(breakEntries->breakJumps[i]);
+        patchWideJump(breakEntries->breakJumps[i]);
     }
 
     current->nestedCount--;
@@ -1356,7 +2038,7 @@ static void forStatement() {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
+        exitJump = emitWideJump(OP_JUMP_IF_FALSE);
         emitByte(OP_POP);
     }
 
@@ -1382,12 +2064,12 @@ static void forStatement() {
 
 
     if (exitJump != -1) {
-        patchJump(exitJump);
+        patchWideJump(exitJump);
         emitByte(OP_POP);
     }
 
     for (int i = 0; i < breakEntries.breakCount; i++) {
-        patchJump(breakEntries.breakJumps[i]);
+        patchWideJump(breakEntries.breakJumps[i]);
     }
 
     endScope();
@@ -1406,6 +2088,13 @@ static void returnStatement() {
     } else {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value");
+
+        // the value is the call just made, unless a jump lands past it
+        // with another: the caller's frame can be reused for it
+        if (current->callEnd == currentChunk()->count && current->jumpTarget < current->callEnd
+            && current->type != TYPE_SCRIPT && current->type != TYPE_INITIALIZER) {
+            currentChunk()->code[current->callEnd - 2] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -1453,7 +2142,7 @@ static void loopStatement(int loopStart, BreakEntries* breakEntries) {
     } else if (matchCurrent(TOKEN_BREAK)) {
         consume(TOKEN_SEMICOLON, "Expect ';' after statement.");
         if (current->nestedLevel == 0) popLocalsAbove(breakEntries->depth);
-        breakEntries->breakJumps[breakEntries->breakCount] = emitJump(OP_JUMP);
+        breakEntries->breakJumps[breakEntries->breakCount] = emitWideJump(OP_JUMP);
         breakEntries->breakCount++;
     } else if (matchCurrent(TOKEN_LEFT_BRACE)) {
         beginScope();
@@ -1558,14 +2247,29 @@ static void expression() {
 // }
 
 
+// Innermost compiler first. Only the compilers reference the functions
+// they're writing, so the collector takes them as roots
+Compiler* compilerChain() {
+    return current;
+}
+
+void markCompilerRoots() {
+    for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+        markObj((Obj*)compiler->function);
+    }
+}
+
 ObjFunction* compile(const char* source) {
-    initScanner(source);
+    // inlining is all the scan is for
+    if (optimizationLevel > 0) findUnstableNames(source);
+    else initScanner(source);
     Compiler compiler;
     initCompiler(&compiler, TYPE_SCRIPT);
     compilingChunk = currentChunk();
 
     parser.hadError = false;
     parser.panicMode = false;
+    constGlobals.count = 0;
 
     advance();
 
@@ -1573,6 +2277,16 @@ ObjFunction* compile(const char* source) {
         declaration();
     }
 
+    FREE_ARRAY(ConstGlobal, constGlobals.globals, constGlobals.capacity);
+    constGlobals.globals = NULL;
+    constGlobals.capacity = 0;
+    FREE_ARRAY(InlineGlobal, inlineGlobals.globals, inlineGlobals.capacity);
+    inlineGlobals.globals = NULL;
+    inlineGlobals.count = 0;
+    inlineGlobals.capacity = 0;
+    freeNames(&unstableNames);
+    freeInlinables();
+
     ObjFunction* function = endCompiler(current->type);
     return parser.hadError ? NULL : function;
 }
@@ -39,6 +39,12 @@ typedef struct {
     int depth;
     bool isCaptured;
     bool isConst;
+    // pool index of a const's value when its initializer was a
+    // constant, reads then load the value directly. -1 otherwise
+    int constant;
+    // index the optimizing compiler kept the body of the function
+    // declared here at, for calls to inline it. -1 otherwise
+    int inlinable;
 } Local;
 
 typedef struct {
@@ -67,6 +73,20 @@ typedef struct Compiler {
 
     int nestedCount;
     int nestedLevel;
+
+    // positions in the function's constant pool, hashed by value, so
+    // repeated names and literals share one slot. -1 marks an empty one
+    int32_t* constantIndex;
+    int constantIndexCapacity;
+
+    // where the last constant load starts and ends, and the furthest
+    // offset a jump was patched to land on. A load nothing jumps past
+    // is the value of the expression ending with it, so it can be folded
+    int constantStart;
+    int constantEnd;
+    int jumpTarget;
+    // just past the last OP_CALL, a return of it becomes a tail call
+    int callEnd;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -82,7 +102,22 @@ typedef struct {
 } BreakEntries;
 
 
+// 0 compiles every function in one pass. Above, function bodies go
+// through the tree and the optimizing IR when they can (clox_ir.c)
+extern int optimizationLevel;
+extern Parser parser;
+extern Compiler* current;
+
 ObjFunction* compile(const char* source);
 void markCompilerRoots();
+Compiler* compilerChain();
+
+// shared with the optimizing compiler
+Chunk* currentChunk();
+uint32_t makeConstant(Value value);
+uint32_t identifierConstant(Token* name);
+int resolveUpvalue(Compiler* compiler, Token* name);
+bool constBinding(Token* name, Value* value);
+int inlineCandidate(Token* name, bool isGlobal);
 
 #endif
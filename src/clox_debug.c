@@ -12,42 +12,75 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     }
 }
 
+// high bits of the next operand, left by OP_WIDE
+static uint32_t wideOperand = 0;
+
+static uint32_t readOperand(Chunk* chunk, int offset) {
+    uint32_t operand = wideOperand | chunk->code[offset];
+    wideOperand = 0;
+    return operand;
+}
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
 }
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t slot = chunk->code[offset + 1];
+    uint32_t slot = readOperand(chunk, offset + 1);
     printf("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset+1];
+    uint32_t constant = readOperand(chunk, offset + 1);
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("' \n");
     return offset + 2;
 }
 
-static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
-    uint32_t constant = (chunk->code[offset + 1]) |
-                        (chunk->code[offset + 2] << 8) |
-                        (chunk->code[offset + 3] << 16);
-
-    printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
-    printf("' \n");
-    return offset + 4;
-}
-
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
-    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-    jump |= chunk->code[offset + 2];
+    uint32_t jump = wideOperand << 8 | chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+    wideOperand = 0;
     printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
+static int matchTableInstruction(Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    uint8_t kind = code[1];
+    int size = code[2] << 8 | code[3];
+    int defaultOffset = code[4] << 8 | code[5];
+    int32_t min = 0;
+    int header = 6;
+    if (kind == MATCH_DENSE) {
+        min = (int32_t)((uint32_t)code[6] << 24 | code[7] << 16 | code[8] << 8 | code[9]);
+        header = 10;
+    }
+
+    int entrySize = kind == MATCH_DENSE ? 2 : 4;
+    int end = offset + header + size * entrySize;
+    printf("%-16s %4d %s, default -> %d\n", "OP_MATCH_TABLE", size,
+           kind == MATCH_DENSE ? "dense" : "hashed", end + defaultOffset);
+
+    for (int i = 0; i < size; i++) {
+        uint8_t* entry = code + header + i * entrySize;
+        if (kind == MATCH_DENSE) {
+            int target = entry[0] << 8 | entry[1];
+            if (target == MATCH_EMPTY) continue;
+            printf("%04d      |                     %d -> %d\n",
+                   offset, min + i, end + target);
+        } else {
+            int constant = entry[0] << 8 | entry[1];
+            if (constant == MATCH_EMPTY) continue;
+            printf("%04d      |                     '", offset);
+            printValue(chunk->constants.values[constant]);
+            printf("' -> %d\n", end + (entry[2] << 8 | entry[3]));
+        }
+    }
+    return end;
+}
+
 int getLine(Chunk* chunk, int index) {
 
     int count = 0;
@@ -77,8 +110,6 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     switch (instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
-        case OP_CONSTANT_LONG:
-            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
         case OP_NOT:
@@ -99,32 +130,22 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
             return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-        case OP_GET_GLOBAL_LONG:
-            return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
         case OP_DEFINE_CONST_GLOBAL:
             return constantInstruction("OP_DEFINE_CONST_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
             return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_DEFINE_CONST_GLOBAL_LONG:
-            return constantLongInstruction("OP_DEFINE_CONST_GLOBAL", chunk, offset);
-        case OP_DEFINE_GLOBAL_LONG:
-            return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
         case OP_ARRAY:
             return byteInstruction("OP_ARRAY", chunk, offset);
-        case OP_ARRAY_LONG:
-            return constantLongInstruction("OP_ARRAY_LONG", chunk, offset);
         case OP_MAP:
             return byteInstruction("OP_MAP", chunk, offset);
-        case OP_MAP_LONG:
-            return constantLongInstruction("OP_MAP_LONG", chunk, offset);
         case OP_GET_ELEMENT:
             return byteInstruction("OP_GET_ELEMENT", chunk, offset);
         case OP_SET_ELEMENT:
             return byteInstruction("OP_SET_ELEMENT", chunk, offset);
         case OP_GET_ELEMENT_GLOBAL:
-            return byteInstruction("OP_GET_ELEMENT_GLOBAL", chunk, offset);
+            return constantInstruction("OP_GET_ELEMENT_GLOBAL", chunk, offset);
         case OP_SET_ELEMENT_GLOBAL:
-            return byteInstruction("OP_SET_ELEMENT_GLOBAL", chunk, offset);
+            return constantInstruction("OP_SET_ELEMENT_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
@@ -137,7 +158,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_CLOSURE: {
             offset++;
-            uint8_t constant = chunk->code[offset++];
+            uint32_t constant = readOperand(chunk, offset++);
             printf("%-16s %4d ", "OP_CLOSURE", constant);
             printValue(chunk->constants.values[constant]);
             printf("\n");
@@ -151,28 +172,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             }
             return offset;
         }
-        case OP_CLOSURE_LONG: {
-            offset++;
-            uint32_t constant = (chunk->code[offset + 1]) |
-                                (chunk->code[offset + 2] << 8) |
-                                (chunk->code[offset + 3] << 16);
-
-            printf("%-16s %4d ", "OP_CLOSURE_LONG", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n",
-                        offset - 2, isLocal ? "local" : "upvalue", index);
-            }
-            return offset;
-        }
         case OP_FOR_EACH: {
             return simpleInstruction("OP_FOR_EACH", offset);
         }
+        case OP_MATCH_TABLE:
+            return matchTableInstruction(chunk, offset);
         case OP_SWAP: {
             uint8_t slot1 = chunk->code[offset + 1];
             uint8_t slot2 = chunk->code[offset + 2];
@@ -183,12 +187,12 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_ARRAY_CALL", offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
-        case OP_SET_GLOBAL_LONG:
-            return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -205,6 +209,20 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_DIVIDE", offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_NEGATE_NUM:
+            return simpleInstruction("OP_NEGATE_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_RETURN:
@@ -246,9 +264,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_PROPERTY:
             return constantInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_DEFINE_PROPERTY:
-            return simpleInstruction("OP_DEFINE_PROPERTY", offset);
+            // followed by whether the field is const
+            return constantInstruction("OP_DEFINE_PROPERTY", chunk, offset) + 1;
         case OP_INVOKE: {
-            uint8_t constant = chunk->code[offset + 1];
+            uint32_t constant = readOperand(chunk, offset + 1);
             uint8_t argCount = chunk->code[offset + 2];
             printf("%-16s (%d args) %4d '", "OP_INVOKE", argCount, constant);
             printValue(chunk->constants.values[constant]);
@@ -259,6 +278,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_WIDE:
+            wideOperand = (uint32_t)(chunk->code[offset + 1] << 16 | chunk->code[offset + 2] << 8);
+            printf("%-16s %4d\n", "OP_WIDE", wideOperand >> 8);
+            return offset + 3;
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,1757 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "clox_ir.h"
+#include "memory.h"
+#include "object.h"
+
+// past this many values living in slots, liveness would cost more than
+// the function is worth: it's left to the single-pass compiler
+#define MAX_SLOT_VALUES 4096
+
+// bytecode a function can compile to and still be inlined, about what
+// the call and return it replaces cost
+#define INLINE_MAX_CODE 48
+// inlined bodies calling functions inlined in turn
+#define INLINE_MAX_DEPTH 4
+
+void initIrList(IrList* list) {
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+void freeIrList(IrList* list) {
+    FREE_ARRAY(int, list->items, list->capacity);
+    initIrList(list);
+}
+
+void writeIrList(IrList* list, int item) {
+    if (list->capacity < list->count + 1) {
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->items = GROW_ARRAY(int, list->items, oldCapacity, list->capacity);
+    }
+    list->items[list->count++] = item;
+}
+
+void initIr(IrFunction* ir) {
+    ir->values = NULL;
+    ir->count = 0;
+    ir->capacity = 0;
+    ir->operands = NULL;
+    ir->operandCount = 0;
+    ir->operandCapacity = 0;
+    ir->blocks = NULL;
+    ir->blockCount = 0;
+    ir->blockCapacity = 0;
+    initIrList(&ir->constants);
+    initIrList(&ir->order);
+    ir->localCount = 0;
+    ir->arity = 0;
+}
+
+void freeIr(IrFunction* ir) {
+    for (int i = 0; i < ir->blockCount; i++) {
+        IrBlock* block = &ir->blocks[i];
+        freeIrList(&block->phis);
+        freeIrList(&block->values);
+        freeIrList(&block->preds);
+        FREE_ARRAY(int, block->defs, ir->localCount);
+    }
+
+    FREE_ARRAY(IrValue, ir->values, ir->capacity);
+    FREE_ARRAY(int, ir->operands, ir->operandCapacity);
+    FREE_ARRAY(IrBlock, ir->blocks, ir->blockCapacity);
+    freeIrList(&ir->constants);
+    freeIrList(&ir->order);
+    initIr(ir);
+}
+
+int resolveValue(IrFunction* ir, int value) {
+    int resolved = value;
+    while (ir->values[resolved].replacement != -1) {
+        resolved = ir->values[resolved].replacement;
+    }
+
+    // shortens the chain for the next lookup
+    while (value != resolved) {
+        int next = ir->values[value].replacement;
+        ir->values[value].replacement = resolved;
+        value = next;
+    }
+    return resolved;
+}
+
+int irOperand(IrFunction* ir, int value, int index) {
+    return resolveValue(ir, ir->operands[ir->values[value].first + index]);
+}
+
+void replaceValue(IrFunction* ir, int value, int replacement) {
+    if (value == replacement) return;
+    ir->values[value].replacement = replacement;
+    ir->values[value].op = IR_REMOVED;
+}
+
+static int addValue(IrFunction* ir, IrOp op, int arg, int block, int line) {
+    if (ir->capacity < ir->count + 1) {
+        int oldCapacity = ir->capacity;
+        ir->capacity = GROW_CAPACITY(oldCapacity);
+        ir->values = GROW_ARRAY(IrValue, ir->values, oldCapacity, ir->capacity);
+    }
+
+    IrValue* value = &ir->values[ir->count];
+    value->op = op;
+    value->arg = arg;
+    value->block = block;
+    value->first = 0;
+    value->count = 0;
+    value->line = line;
+    value->replacement = -1;
+    value->numeric = false;
+    return ir->count++;
+}
+
+void setOperands(IrFunction* ir, int value, int* operands, int count) {
+    ir->values[value].first = ir->operandCount;
+    ir->values[value].count = count;
+    if (count == 0) return;
+
+    if (ir->operandCapacity < ir->operandCount + count) {
+        int oldCapacity = ir->operandCapacity;
+        while (ir->operandCapacity < ir->operandCount + count) {
+            ir->operandCapacity = GROW_CAPACITY(ir->operandCapacity);
+        }
+        ir->operands = GROW_ARRAY(int, ir->operands, oldCapacity, ir->operandCapacity);
+    }
+
+    memcpy(ir->operands + ir->operandCount, operands, sizeof(int) * count);
+    ir->operandCount += count;
+}
+
+int irConstant(IrFunction* ir, IrOp op, int arg) {
+    for (int i = 0; i < ir->constants.count; i++) {
+        IrValue* constant = &ir->values[ir->constants.items[i]];
+        if (constant->op == op && constant->arg == arg) return ir->constants.items[i];
+    }
+
+    int value = addValue(ir, op, arg, -1, 0);
+    writeIrList(&ir->constants, value);
+    return value;
+}
+
+bool isConstantValue(IrFunction* ir, int value) {
+    IrOp op = ir->values[value].op;
+    return op == IR_CONSTANT || op == IR_NIL || op == IR_TRUE || op == IR_FALSE;
+}
+
+bool producesValue(IrOp op) {
+    return op != IR_PRINT && op != IR_SET_GLOBAL && op != IR_SET_UPVALUE && op != IR_REMOVED;
+}
+
+int addBlock(IrFunction* ir) {
+    if (ir->blockCapacity < ir->blockCount + 1) {
+        int oldCapacity = ir->blockCapacity;
+        ir->blockCapacity = GROW_CAPACITY(oldCapacity);
+        ir->blocks = GROW_ARRAY(IrBlock, ir->blocks, oldCapacity, ir->blockCapacity);
+    }
+
+    IrBlock* block = &ir->blocks[ir->blockCount];
+    initIrList(&block->phis);
+    initIrList(&block->values);
+    initIrList(&block->preds);
+    block->exit = EXIT_NONE;
+    block->exitValue = -1;
+    block->targets[0] = -1;
+    block->targets[1] = -1;
+    block->exitLine = 0;
+    block->defs = ALLOCATE(int, ir->localCount);
+    for (int i = 0; i < ir->localCount; i++) block->defs[i] = -1;
+    block->sealed = false;
+    block->removed = false;
+    block->order = -1;
+    block->idom = -1;
+    return ir->blockCount++;
+}
+
+// Drops the index-th predecessor, and its operand of every phi
+void removePred(IrFunction* ir, int block, int index) {
+    IrBlock* b = &ir->blocks[block];
+
+    for (int i = 0; i < b->phis.count; i++) {
+        IrValue* phi = &ir->values[b->phis.items[i]];
+        if (phi->op != IR_PHI) continue;
+
+        int* operands = ir->operands + phi->first;
+        memmove(operands + index, operands + index + 1, sizeof(int) * (phi->count - index - 1));
+        phi->count--;
+    }
+
+    memmove(b->preds.items + index, b->preds.items + index + 1,
+            sizeof(int) * (b->preds.count - index - 1));
+    b->preds.count--;
+}
+
+static int successorCount(IrBlock* block) {
+    switch (block->exit) {
+        case EXIT_JUMP:     return 1;
+        case EXIT_BRANCH:   return 2;
+        default:            return 0;
+    }
+}
+
+// Reverse postorder and dominators (Cooper, Harvey and Kennedy). A branch
+// is walked false side first so the true side comes right after it
+void computeOrder(IrFunction* ir) {
+    for (int i = 0; i < ir->blockCount; i++) {
+        ir->blocks[i].order = -1;
+        ir->blocks[i].idom = -1;
+    }
+
+    int* stack = ALLOCATE(int, ir->blockCount);
+    int* next = ALLOCATE(int, ir->blockCount);
+    bool* visited = ALLOCATE(bool, ir->blockCount);
+    int* postorder = ALLOCATE(int, ir->blockCount);
+    for (int i = 0; i < ir->blockCount; i++) visited[i] = false;
+
+    int depth = 0;
+    int postCount = 0;
+    stack[depth] = 0;
+    next[depth++] = 0;
+    visited[0] = true;
+
+    while (depth > 0) {
+        IrBlock* block = &ir->blocks[stack[depth - 1]];
+        int count = successorCount(block);
+        int index = next[depth - 1]++;
+
+        if (index < count) {
+            int successor = count == 2 ? block->targets[1 - index] : block->targets[0];
+            if (!visited[successor]) {
+                visited[successor] = true;
+                stack[depth] = successor;
+                next[depth++] = 0;
+            }
+        } else {
+            postorder[postCount++] = stack[--depth];
+        }
+    }
+
+    ir->order.count = 0;
+    for (int i = postCount - 1; i >= 0; i--) {
+        ir->blocks[postorder[i]].order = ir->order.count;
+        writeIrList(&ir->order, postorder[i]);
+    }
+
+    ir->blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (int i = 1; i < ir->order.count; i++) {
+            IrBlock* block = &ir->blocks[ir->order.items[i]];
+            int idom = -1;
+
+            for (int j = 0; j < block->preds.count; j++) {
+                int pred = block->preds.items[j];
+                if (ir->blocks[pred].idom == -1) continue;
+                if (idom == -1) {
+                    idom = pred;
+                    continue;
+                }
+
+                int a = pred;
+                int b = idom;
+                while (a != b) {
+                    while (ir->blocks[a].order > ir->blocks[b].order) a = ir->blocks[a].idom;
+                    while (ir->blocks[b].order > ir->blocks[a].order) b = ir->blocks[b].idom;
+                }
+                idom = a;
+            }
+
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+
+    FREE_ARRAY(int, stack, ir->blockCount);
+    FREE_ARRAY(int, next, ir->blockCount);
+    FREE_ARRAY(bool, visited, ir->blockCount);
+    FREE_ARRAY(int, postorder, ir->blockCount);
+}
+
+bool dominates(IrFunction* ir, int a, int b) {
+    while (b != a) {
+        if (b == 0 || ir->blocks[b].idom == -1) return false;
+        b = ir->blocks[b].idom;
+    }
+    return true;
+}
+
+// From the tree to SSA. Locals are turned into values as they're read,
+// looking back through the predecessors (Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form"). A block is
+// sealed once all its predecessors are known, phis asked of it before
+// that are completed then
+typedef struct {
+    IrFunction* ir;
+    Ast* ast;
+    int block;
+    // continue then break target of each enclosing loop
+    IrList loops;
+
+    // while a body is inlined: where its locals start, the call's line,
+    // the block its returns jump to and the values they return, in the
+    // order they reach it
+    int variableBase;
+    int callLine;
+    int returnBlock;
+    IrList* returnValues;
+    int inlineDepth;
+    // the call being lowered is the value of a return of the function
+    bool tailCall;
+} IrBuilder;
+
+static IrBuilder builder;
+
+// Bodies of small functions, kept as trees until the script is compiled
+typedef struct {
+    Ast* asts;
+    int count;
+    int capacity;
+} Inlinables;
+
+static Inlinables inlinables;
+
+static int lowerExpression(int node);
+static void lowerStatement(int node);
+static int readVariable(int variable, int block);
+
+static Node* astNode(int node) {
+    return &builder.ast->nodes[node];
+}
+
+// code inlined at a call is reported at the call
+static int lineOf(int line) {
+    return builder.callLine != 0 ? builder.callLine : line;
+}
+
+static int instruction(IrOp op, int arg, int line, int a, int b) {
+    IrFunction* ir = builder.ir;
+    line = lineOf(line);
+    int value = addValue(ir, op, arg, builder.block, line);
+    int operands[2] = {a, b};
+    setOperands(ir, value, operands, a == -1 ? 0 : (b == -1 ? 1 : 2));
+    writeIrList(&ir->blocks[builder.block].values, value);
+    return value;
+}
+
+static void addEdge(int from, int to) {
+    writeIrList(&builder.ir->blocks[to].preds, from);
+}
+
+static void jumpTo(int target) {
+    IrBlock* block = &builder.ir->blocks[builder.block];
+    if (block->exit != EXIT_NONE) return;
+
+    block->exit = EXIT_JUMP;
+    block->targets[0] = target;
+    addEdge(builder.block, target);
+}
+
+static void branchTo(int condition, int ifTrue, int ifFalse, int line) {
+    IrBlock* block = &builder.ir->blocks[builder.block];
+    block->exit = EXIT_BRANCH;
+    block->exitValue = condition;
+    block->targets[0] = ifTrue;
+    block->targets[1] = ifFalse;
+    block->exitLine = lineOf(line);
+    addEdge(builder.block, ifTrue);
+    addEdge(builder.block, ifFalse);
+}
+
+static int newPhi(int block, int variable) {
+    int phi = addValue(builder.ir, IR_PHI, variable, block, 0);
+    writeIrList(&builder.ir->blocks[block].phis, phi);
+    return phi;
+}
+
+static void writeVariable(int variable, int block, int value) {
+    builder.ir->blocks[block].defs[variable] = value;
+}
+
+// A phi whose operands are all one value, or itself, is that value
+static int tryRemoveTrivialPhi(int phi) {
+    IrFunction* ir = builder.ir;
+    int same = -1;
+
+    for (int i = 0; i < ir->values[phi].count; i++) {
+        int operand = irOperand(ir, phi, i);
+        if (operand == same || operand == phi) continue;
+        if (same != -1) return phi;
+        same = operand;
+    }
+
+    // only unreachable code reads a local nothing assigned
+    if (same == -1) same = irConstant(ir, IR_NIL, 0);
+    replaceValue(ir, phi, same);
+    return same;
+}
+
+static int addPhiOperands(int variable, int phi) {
+    IrFunction* ir = builder.ir;
+    int block = ir->values[phi].block;
+    int count = ir->blocks[block].preds.count;
+
+    int* operands = ALLOCATE(int, count);
+    for (int i = 0; i < count; i++) {
+        operands[i] = readVariable(variable, ir->blocks[block].preds.items[i]);
+    }
+    setOperands(ir, phi, operands, count);
+    FREE_ARRAY(int, operands, count);
+
+    return tryRemoveTrivialPhi(phi);
+}
+
+static int readVariable(int variable, int block) {
+    IrFunction* ir = builder.ir;
+    if (ir->blocks[block].defs[variable] != -1) {
+        return resolveValue(ir, ir->blocks[block].defs[variable]);
+    }
+
+    int value;
+    IrBlock* b = &ir->blocks[block];
+    if (!b->sealed) {
+        value = newPhi(block, variable);
+    } else if (b->preds.count == 0) {
+        value = irConstant(ir, IR_NIL, 0);
+    } else if (b->preds.count == 1) {
+        value = readVariable(variable, b->preds.items[0]);
+    } else {
+        int phi = newPhi(block, variable);
+        // breaks cycles through loops
+        writeVariable(variable, block, phi);
+        value = addPhiOperands(variable, phi);
+    }
+
+    writeVariable(variable, block, value);
+    return value;
+}
+
+static void sealBlock(int block) {
+    IrFunction* ir = builder.ir;
+
+    // completing a phi can ask this block for more of them
+    for (int i = 0; i < ir->blocks[block].phis.count; i++) {
+        int phi = ir->blocks[block].phis.items[i];
+        if (ir->values[phi].op == IR_PHI && ir->values[phi].count == 0) {
+            addPhiOperands(ir->values[phi].arg, phi);
+        }
+    }
+    ir->blocks[block].sealed = true;
+}
+
+static int newSealedBlock() {
+    int block = addBlock(builder.ir);
+    sealBlock(block);
+    return block;
+}
+
+// Code after a return, break or continue goes to a block nothing reaches
+static void startUnreachable() {
+    builder.block = newSealedBlock();
+}
+
+static int constantValue(Value value) {
+    if (IS_NIL(value)) return irConstant(builder.ir, IR_NIL, 0);
+    if (IS_BOOL(value)) return irConstant(builder.ir, AS_BOOL(value) ? IR_TRUE : IR_FALSE, 0);
+    return irConstant(builder.ir, IR_CONSTANT, makeConstant(value));
+}
+
+// The value of and, or, ?: is a phi of what each side produced
+static int joinValues(int join, int* values) {
+    int phi = newPhi(join, -1);
+    setOperands(builder.ir, phi, values, 2);
+    return tryRemoveTrivialPhi(phi);
+}
+
+static void lowerCondition(int node, int ifTrue, int ifFalse) {
+    Node* n = astNode(node);
+
+    if (n->type == NODE_AND || n->type == NODE_OR) {
+        int left = n->children[0];
+        int right = n->children[1];
+        int middle = addBlock(builder.ir);
+
+        if (n->type == NODE_AND) lowerCondition(left, middle, ifFalse);
+        else lowerCondition(left, ifTrue, middle);
+
+        sealBlock(middle);
+        builder.block = middle;
+        lowerCondition(right, ifTrue, ifFalse);
+        return;
+    }
+
+    if (n->type == NODE_UNARY && n->token.type == TOKEN_BANG) {
+        lowerCondition(n->children[0], ifFalse, ifTrue);
+        return;
+    }
+
+    int condition = lowerExpression(node);
+    branchTo(condition, ifTrue, ifFalse, astNode(node)->token.line);
+}
+
+static int lowerLogical(Node* n) {
+    int line = n->token.line;
+    bool isAnd = n->type == NODE_AND;
+    int right = n->children[1];
+
+    int left = lowerExpression(n->children[0]);
+    int other = addBlock(builder.ir);
+    int skip = addBlock(builder.ir);
+    int join = addBlock(builder.ir);
+
+    if (isAnd) branchTo(left, other, skip, line);
+    else branchTo(left, skip, other, line);
+    sealBlock(other);
+    sealBlock(skip);
+
+    builder.block = other;
+    int values[2];
+    values[0] = lowerExpression(right);
+    jumpTo(join);
+
+    builder.block = skip;
+    values[1] = left;
+    jumpTo(join);
+
+    sealBlock(join);
+    builder.block = join;
+    return joinValues(join, values);
+}
+
+static int lowerTernary(Node* n) {
+    int elseBranch = n->children[2];
+    int thenBranch = n->children[1];
+
+    int thenBlock = addBlock(builder.ir);
+    int elseBlock = addBlock(builder.ir);
+    int join = addBlock(builder.ir);
+
+    lowerCondition(n->children[0], thenBlock, elseBlock);
+    sealBlock(thenBlock);
+    sealBlock(elseBlock);
+
+    int values[2];
+    builder.block = thenBlock;
+    values[0] = lowerExpression(thenBranch);
+    jumpTo(join);
+
+    builder.block = elseBlock;
+    values[1] = lowerExpression(elseBranch);
+    jumpTo(join);
+
+    sealBlock(join);
+    builder.block = join;
+    return joinValues(join, values);
+}
+
+static int lowerNonlocal(Token name, int line) {
+    Value value;
+    if (constBinding(&name, &value)) return constantValue(value);
+
+    int arg = resolveUpvalue(current, &name);
+    if (arg != -1) return instruction(IR_GET_UPVALUE, arg, line, -1, -1);
+
+    return instruction(IR_GET_GLOBAL, identifierConstant(&name), line, -1, -1);
+}
+
+static int lowerBinary(Node* n) {
+    int line = n->token.line;
+    TokenTypes operatorType = n->token.type;
+    int right = n->children[1];
+
+    int a = lowerExpression(n->children[0]);
+    int b = lowerExpression(right);
+
+    // the same instructions the single-pass compiler emits
+    switch (operatorType) {
+        case TOKEN_PLUS:            return instruction(IR_ADD, 0, line, a, b);
+        case TOKEN_MINUS:           return instruction(IR_SUBTRACT, 0, line, a, b);
+        case TOKEN_STAR:            return instruction(IR_MULTIPLY, 0, line, a, b);
+        case TOKEN_SLASH:           return instruction(IR_DIVIDE, 0, line, a, b);
+        case TOKEN_EQUAL_EQUAL:     return instruction(IR_EQUAL, 0, line, a, b);
+        case TOKEN_GREATER:         return instruction(IR_GREATER, 0, line, a, b);
+        case TOKEN_LESS:            return instruction(IR_LESS, 0, line, a, b);
+        case TOKEN_BANG_EQUAL:
+            return instruction(IR_NOT, 0, line, instruction(IR_EQUAL, 0, line, a, b), -1);
+        case TOKEN_GREATER_EQUAL:
+            return instruction(IR_NOT, 0, line, instruction(IR_LESS, 0, line, a, b), -1);
+        case TOKEN_LESS_EQUAL:
+            return instruction(IR_NOT, 0, line, instruction(IR_GREATER, 0, line, a, b), -1);
+
+        default: return irConstant(builder.ir, IR_NIL, 0);
+    }
+}
+
+// Gives the inlined body locals of its own, past the caller's
+static int addLocals(IrFunction* ir, int count) {
+    int base = ir->localCount;
+
+    for (int i = 0; i < ir->blockCount; i++) {
+        IrBlock* block = &ir->blocks[i];
+        block->defs = GROW_ARRAY(int, block->defs, base, base + count);
+        for (int j = base; j < base + count; j++) block->defs[j] = -1;
+    }
+
+    ir->localCount += count;
+    return base;
+}
+
+// The callee's tree is lowered in place of the call, its arguments
+// bound to its parameters. Returns jump to a block of their own where
+// a phi takes the returned value. Inlined in a return, they return from
+// the function themselves, and calls they return stay tail calls
+static int lowerInlined(int candidate, Token* name, int* arguments, int line, bool tailCall) {
+    IrFunction* ir = builder.ir;
+    Ast* callee = &inlinables.asts[candidate];
+    IrBuilder saved = builder;
+
+    builder.ast = callee;
+    builder.variableBase = addLocals(ir, callee->localCount);
+    builder.callLine = lineOf(line);
+    builder.returnBlock = tailCall ? -1 : addBlock(ir);
+    builder.inlineDepth++;
+
+    IrList values;
+    initIrList(&values);
+    builder.returnValues = &values;
+
+    for (int i = 0; i < callee->arity; i++) {
+        writeVariable(builder.variableBase + i, builder.block, arguments[i]);
+    }
+    lowerStatement(callee->body);
+
+    // falling off the end returns nil
+    int exit;
+    if (tailCall) {
+        IrBlock* block = &ir->blocks[builder.block];
+        if (block->exit == EXIT_NONE) {
+            block->exit = EXIT_RETURN;
+            block->exitValue = irConstant(ir, IR_NIL, 0);
+            block->exitLine = builder.callLine;
+        }
+        startUnreachable();
+        exit = builder.block;
+    } else {
+        writeIrList(&values, irConstant(ir, IR_NIL, 0));
+        jumpTo(builder.returnBlock);
+        exit = builder.returnBlock;
+        sealBlock(exit);
+    }
+
+    saved.block = exit;
+    saved.loops = builder.loops;
+    builder = saved;
+
+#ifdef DEBUG_PRINT_CODE
+    printf("inlined %.*s() at line %d\n", name->length, name->start, lineOf(line));
+#endif
+    // after a tail call inlined, what's left is never reached
+    if (tailCall) {
+        freeIrList(&values);
+        return irConstant(ir, IR_NIL, 0);
+    }
+
+    int phi = newPhi(exit, -1);
+    setOperands(ir, phi, values.items, values.count);
+    freeIrList(&values);
+    return tryRemoveTrivialPhi(phi);
+}
+
+static int lowerCall(Node* n) {
+    IrFunction* ir = builder.ir;
+    int line = n->token.line;
+    int count = n->count + 1;
+    int first = n->first;
+
+    bool tailCall = builder.tailCall;
+    builder.tailCall = false;
+
+    Node* callee = astNode(n->children[0]);
+    int candidate = -1;
+    if ((callee->type == NODE_NONLOCAL || callee->type == NODE_GLOBAL)
+        && builder.inlineDepth < INLINE_MAX_DEPTH) {
+        candidate = inlineCandidate(&callee->token, callee->type == NODE_GLOBAL);
+    }
+    // a call with the wrong arguments stays one, for its error
+    if (candidate != -1 && inlinables.asts[candidate].arity != count - 1) candidate = -1;
+
+    int* operands = ALLOCATE(int, count);
+    if (candidate == -1) operands[0] = lowerExpression(n->children[0]);
+    for (int i = 1; i < count; i++) {
+        operands[i] = lowerExpression(builder.ast->lists[first + i - 1]);
+    }
+    if (candidate != -1) {
+        int result = lowerInlined(candidate, &callee->token, operands + 1, line, tailCall);
+        FREE_ARRAY(int, operands, count);
+        return result;
+    }
+
+    int value = addValue(ir, IR_CALL, count - 1, builder.block, lineOf(line));
+    setOperands(ir, value, operands, count);
+    writeIrList(&ir->blocks[builder.block].values, value);
+    FREE_ARRAY(int, operands, count);
+    return value;
+}
+
+static int lowerExpression(int node) {
+    Node* n = astNode(node);
+    int line = n->token.line;
+
+    switch (n->type) {
+        case NODE_NUMBER:   return constantValue(NUMBER_VAL(n->number));
+        case NODE_STRING:
+            return constantValue(OBJ_VAL(copyString(n->token.start + 1, n->token.length - 2)));
+        case NODE_NIL:      return irConstant(builder.ir, IR_NIL, 0);
+        case NODE_TRUE:     return irConstant(builder.ir, IR_TRUE, 0);
+        case NODE_FALSE:    return irConstant(builder.ir, IR_FALSE, 0);
+        case NODE_LOCAL:    return readVariable(builder.variableBase + n->variable, builder.block);
+        case NODE_NONLOCAL: return lowerNonlocal(n->token, line);
+        case NODE_GLOBAL:
+            return instruction(IR_GET_GLOBAL, identifierConstant(&n->token), line, -1, -1);
+
+        case NODE_ASSIGN_LOCAL: {
+            int variable = builder.variableBase + n->variable;
+            int value = lowerExpression(n->children[0]);
+            writeVariable(variable, builder.block, value);
+            return value;
+        }
+        case NODE_ASSIGN_NONLOCAL: {
+            Token name = n->token;
+            int value = lowerExpression(n->children[0]);
+
+            int arg = resolveUpvalue(current, &name);
+            if (arg != -1) {
+                instruction(IR_SET_UPVALUE, arg, line, value, -1);
+            } else {
+                instruction(IR_SET_GLOBAL, identifierConstant(&name), line, value, -1);
+            }
+            return value;
+        }
+        case NODE_ASSIGN_GLOBAL: {
+            Token name = n->token;
+            int value = lowerExpression(n->children[0]);
+            instruction(IR_SET_GLOBAL, identifierConstant(&name), line, value, -1);
+            return value;
+        }
+
+        case NODE_UNARY: {
+            IrOp op = n->token.type == TOKEN_MINUS ? IR_NEGATE : IR_NOT;
+            int operand = lowerExpression(n->children[0]);
+            return instruction(op, 0, line, operand, -1);
+        }
+        case NODE_BINARY:   return lowerBinary(n);
+        case NODE_AND:
+        case NODE_OR:       return lowerLogical(n);
+        case NODE_TERNARY:  return lowerTernary(n);
+        case NODE_CALL:     return lowerCall(n);
+
+        default: return irConstant(builder.ir, IR_NIL, 0);
+    }
+}
+
+static void lowerIf(Node* n) {
+    int thenBranch = n->children[1];
+    int elseBranch = n->children[2];
+
+    int thenBlock = addBlock(builder.ir);
+    int elseBlock = addBlock(builder.ir);
+    int join = addBlock(builder.ir);
+
+    lowerCondition(n->children[0], thenBlock, elseBlock);
+    sealBlock(thenBlock);
+    sealBlock(elseBlock);
+
+    builder.block = thenBlock;
+    lowerStatement(thenBranch);
+    jumpTo(join);
+
+    builder.block = elseBlock;
+    if (elseBranch != -1) lowerStatement(elseBranch);
+    jumpTo(join);
+
+    sealBlock(join);
+    builder.block = join;
+}
+
+// while and for. The condition's false side gets a block of its own,
+// breaks go past it, so leaving the loop normally costs no extra jump
+static void lowerLoop(int condition, int increment, int body) {
+    int header = addBlock(builder.ir);
+    jumpTo(header);
+    builder.block = header;
+
+    int bodyBlock = addBlock(builder.ir);
+    int exit = addBlock(builder.ir);
+    int after = addBlock(builder.ir);
+    int continueTarget = increment != -1 ? addBlock(builder.ir) : header;
+
+    if (condition != -1) lowerCondition(condition, bodyBlock, exit);
+    else jumpTo(bodyBlock);
+    sealBlock(bodyBlock);
+    sealBlock(exit);
+
+    writeIrList(&builder.loops, continueTarget);
+    writeIrList(&builder.loops, after);
+
+    builder.block = bodyBlock;
+    lowerStatement(body);
+    jumpTo(continueTarget);
+    builder.loops.count -= 2;
+
+    if (increment != -1) {
+        sealBlock(continueTarget);
+        builder.block = continueTarget;
+        lowerExpression(increment);
+        jumpTo(header);
+    }
+    sealBlock(header);
+
+    builder.block = exit;
+    jumpTo(after);
+    sealBlock(after);
+    builder.block = after;
+}
+
+static void lowerStatement(int node) {
+    if (node == -1) return;
+    Node* n = astNode(node);
+    int line = n->token.line;
+
+    switch (n->type) {
+        case NODE_EXPRESSION:
+            lowerExpression(n->children[0]);
+            break;
+        case NODE_PRINT: {
+            int value = lowerExpression(n->children[0]);
+            instruction(IR_PRINT, 0, line, value, -1);
+            break;
+        }
+        case NODE_VAR: {
+            int variable = builder.variableBase + n->variable;
+            int value = n->children[0] != -1 ? lowerExpression(n->children[0])
+                                             : irConstant(builder.ir, IR_NIL, 0);
+            writeVariable(variable, builder.block, value);
+            break;
+        }
+        case NODE_BLOCK: {
+            int first = n->first;
+            int count = n->count;
+            for (int i = 0; i < count; i++) {
+                lowerStatement(builder.ast->lists[first + i]);
+            }
+            break;
+        }
+        case NODE_IF:
+            lowerIf(n);
+            break;
+        case NODE_WHILE:
+            lowerLoop(n->children[0], -1, n->children[1]);
+            break;
+        case NODE_FOR: {
+            int condition = n->children[1];
+            int increment = n->children[2];
+            int body = n->children[3];
+            lowerStatement(n->children[0]);
+            lowerLoop(condition, increment, body);
+            break;
+        }
+        case NODE_RETURN: {
+            builder.tailCall = builder.returnBlock == -1 && n->children[0] != -1
+                               && astNode(n->children[0])->type == NODE_CALL;
+            int value = n->children[0] != -1 ? lowerExpression(n->children[0])
+                                             : irConstant(builder.ir, IR_NIL, 0);
+            if (builder.returnBlock != -1) {
+                writeIrList(builder.returnValues, value);
+                jumpTo(builder.returnBlock);
+                startUnreachable();
+                break;
+            }
+
+            IrBlock* block = &builder.ir->blocks[builder.block];
+            block->exit = EXIT_RETURN;
+            block->exitValue = value;
+            block->exitLine = lineOf(line);
+            startUnreachable();
+            break;
+        }
+        case NODE_BREAK:
+            jumpTo(builder.loops.items[builder.loops.count - 1]);
+            startUnreachable();
+            break;
+        case NODE_CONTINUE:
+            jumpTo(builder.loops.items[builder.loops.count - 2]);
+            startUnreachable();
+            break;
+
+        default: break;
+    }
+}
+
+static void lowerAst(IrFunction* ir, Ast* ast) {
+    builder.ir = ir;
+    builder.ast = ast;
+    initIrList(&builder.loops);
+    builder.variableBase = 0;
+    builder.callLine = 0;
+    builder.returnBlock = -1;
+    builder.returnValues = NULL;
+    builder.inlineDepth = 0;
+    builder.tailCall = false;
+    ir->localCount = ast->localCount;
+    ir->arity = ast->arity;
+
+    builder.block = newSealedBlock();
+    for (int i = 0; i < ast->arity; i++) {
+        writeVariable(i, builder.block, irConstant(ir, IR_PARAMETER, i + 1));
+    }
+
+    lowerStatement(ast->body);
+
+    IrBlock* block = &ir->blocks[builder.block];
+    if (block->exit == EXIT_NONE) {
+        block->exit = EXIT_RETURN;
+        block->exitValue = irConstant(ir, IR_NIL, 0);
+        block->exitLine = ast->previous.line;
+    }
+    freeIrList(&builder.loops);
+}
+
+// Back to bytecode. Values used once, right where they were computed,
+// stay on the stack as operands of their user ("stackified"), the rest
+// live in local slots. Slots are given from liveness: values never live
+// at the same time share one, and a phi gets the slot of its operands
+// whenever they don't overlap, so a loop counter is updated in place
+typedef struct {
+    IrFunction* ir;
+    Chunk* chunk;
+    int line;
+
+    int* useCount;
+    bool* stackified;
+    int* slotIndex;         // per value, its index among the slot values, or -1
+    IrList slotValues;
+    IrList* roots;          // per block, the values emitted as statements
+
+    int words;
+    uint64_t* liveIn;
+    uint64_t* liveOut;
+    uint64_t* interference;
+
+    int* group;             // union-find over the slot values
+    int* groupNext;         // members of each group, linked
+    int* slot;              // per slot value
+
+    int* blockStart;
+    IrList fixups;          // operand offset then target block, pairs
+    IrList stubs;           // operand offset then target block, pairs
+} Emitter;
+
+static Emitter emitter;
+
+static bool testBit(uint64_t* set, int bit) {
+    return (set[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void setBit(uint64_t* set, int bit) {
+    set[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static void clearBit(uint64_t* set, int bit) {
+    set[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+static uint64_t* setOf(uint64_t* sets, int index) {
+    return sets + (size_t)index * emitter.words;
+}
+
+// A block reached only through the false side of a branch pops the
+// condition itself, everywhere else the branch does it on a stub
+static bool popsOnEntry(IrFunction* ir, int block) {
+    IrBlock* b = &ir->blocks[block];
+    if (b->preds.count != 1) return false;
+
+    IrBlock* pred = &ir->blocks[b->preds.items[0]];
+    return pred->exit == EXIT_BRANCH && pred->targets[1] == block
+           && pred->targets[0] != block && pred->order < b->order;
+}
+
+// Phi copies are placed at the end of the predecessor, which can't be
+// done on an edge out of a branch: those get a block of their own
+static void splitCriticalEdges(IrFunction* ir) {
+    int blockCount = ir->blockCount;
+
+    for (int block = 0; block < blockCount; block++) {
+        if (ir->blocks[block].removed || ir->blocks[block].phis.count == 0) continue;
+
+        for (int i = 0; i < ir->blocks[block].preds.count; i++) {
+            int pred = ir->blocks[block].preds.items[i];
+            if (ir->blocks[pred].exit != EXIT_BRANCH) continue;
+
+            int split = addBlock(ir);
+            IrBlock* s = &ir->blocks[split];
+            s->sealed = true;
+            s->exit = EXIT_JUMP;
+            s->targets[0] = block;
+            writeIrList(&s->preds, pred);
+
+            IrBlock* p = &ir->blocks[pred];
+            p->targets[p->targets[0] == block ? 0 : 1] = split;
+            ir->blocks[block].preds.items[i] = split;
+        }
+    }
+}
+
+static void countUse(int value) {
+    emitter.useCount[resolveValue(emitter.ir, value)]++;
+}
+
+static void countUses(IrFunction* ir) {
+    for (int i = 0; i < ir->order.count; i++) {
+        IrBlock* block = &ir->blocks[ir->order.items[i]];
+
+        for (int j = 0; j < block->phis.count; j++) {
+            int phi = block->phis.items[j];
+            if (ir->values[phi].op == IR_REMOVED) continue;
+            for (int k = 0; k < ir->values[phi].count; k++) countUse(irOperand(ir, phi, k));
+        }
+        for (int j = 0; j < block->values.count; j++) {
+            int value = block->values.items[j];
+            if (ir->values[value].op == IR_REMOVED) continue;
+            for (int k = 0; k < ir->values[value].count; k++) countUse(irOperand(ir, value, k));
+        }
+        if (block->exitValue != -1) countUse(block->exitValue);
+    }
+}
+
+static int treeStart(IrList* values, int value, int position);
+
+// Takes operand into its user's tree if it's the instruction just
+// before the tree built so far, and nothing else uses it
+static int absorb(IrList* values, int operand, int position) {
+    IrFunction* ir = emitter.ir;
+    if (position < 0 || values->items[position] != operand) return position;
+    if (emitter.useCount[operand] != 1 || !producesValue(ir->values[operand].op)) return position;
+
+    emitter.stackified[operand] = true;
+    return treeStart(values, operand, position - 1);
+}
+
+static int treeStart(IrList* values, int value, int position) {
+    for (int i = emitter.ir->values[value].count - 1; i >= 0; i--) {
+        position = absorb(values, irOperand(emitter.ir, value, i), position);
+    }
+    return position;
+}
+
+static void stackify(IrFunction* ir, int block) {
+    IrBlock* b = &ir->blocks[block];
+    IrList* roots = &emitter.roots[block];
+
+    // removed values are dropped first, adjacency is what matters
+    int count = 0;
+    for (int i = 0; i < b->values.count; i++) {
+        if (ir->values[b->values.items[i]].op != IR_REMOVED) {
+            b->values.items[count++] = b->values.items[i];
+        }
+    }
+    b->values.count = count;
+
+    int position = count - 1;
+    if (b->exitValue != -1) {
+        position = absorb(&b->values, resolveValue(ir, b->exitValue), position);
+    }
+
+    while (position >= 0) {
+        int root = b->values.items[position];
+        writeIrList(roots, root);
+        position = treeStart(&b->values, root, position - 1);
+    }
+
+    // found last to first
+    for (int i = 0, j = roots->count - 1; i < j; i++, j--) {
+        int swap = roots->items[i];
+        roots->items[i] = roots->items[j];
+        roots->items[j] = swap;
+    }
+}
+
+static void addSlotValue(int value) {
+    if (emitter.slotIndex[value] != -1) return;
+    emitter.slotIndex[value] = emitter.slotValues.count;
+    writeIrList(&emitter.slotValues, value);
+}
+
+// The slot values a tree reads
+static void treeUses(int value, uint64_t* live) {
+    IrFunction* ir = emitter.ir;
+
+    for (int i = 0; i < ir->values[value].count; i++) {
+        int operand = irOperand(ir, value, i);
+        if (emitter.stackified[operand]) {
+            treeUses(operand, live);
+        } else if (emitter.slotIndex[operand] != -1) {
+            setBit(live, emitter.slotIndex[operand]);
+        }
+    }
+}
+
+static void exitUses(int block, uint64_t* live) {
+    IrFunction* ir = emitter.ir;
+    IrBlock* b = &ir->blocks[block];
+    if (b->exitValue == -1) return;
+
+    int value = resolveValue(ir, b->exitValue);
+    if (emitter.stackified[value]) treeUses(value, live);
+    else if (emitter.slotIndex[value] != -1) setBit(live, emitter.slotIndex[value]);
+}
+
+static int predIndex(IrBlock* block, int pred) {
+    for (int i = 0; i < block->preds.count; i++) {
+        if (block->preds.items[i] == pred) return i;
+    }
+    return -1;
+}
+
+static void computeLiveOut(int block, uint64_t* out) {
+    IrFunction* ir = emitter.ir;
+    IrBlock* b = &ir->blocks[block];
+    memset(out, 0, sizeof(uint64_t) * emitter.words);
+
+    for (int i = 0; i < successorCount(b); i++) {
+        int successor = b->targets[i];
+        IrBlock* s = &ir->blocks[successor];
+        uint64_t* in = setOf(emitter.liveIn, successor);
+        for (int w = 0; w < emitter.words; w++) out[w] |= in[w];
+
+        // phi operands are read at the end of their predecessor
+        int index = predIndex(s, block);
+        for (int j = 0; j < s->phis.count; j++) {
+            int phi = s->phis.items[j];
+            if (ir->values[phi].op == IR_REMOVED) continue;
+
+            int operand = irOperand(ir, phi, index);
+            if (emitter.slotIndex[operand] != -1) setBit(out, emitter.slotIndex[operand]);
+        }
+    }
+}
+
+static void computeLiveness(IrFunction* ir) {
+    uint64_t* live = ALLOCATE(uint64_t, emitter.words);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (int i = ir->order.count - 1; i >= 0; i--) {
+            int block = ir->order.items[i];
+            IrBlock* b = &ir->blocks[block];
+            computeLiveOut(block, setOf(emitter.liveOut, block));
+            memcpy(live, setOf(emitter.liveOut, block), sizeof(uint64_t) * emitter.words);
+
+            exitUses(block, live);
+            IrList* roots = &emitter.roots[block];
+            for (int j = roots->count - 1; j >= 0; j--) {
+                int root = roots->items[j];
+                if (emitter.slotIndex[root] != -1) clearBit(live, emitter.slotIndex[root]);
+                treeUses(root, live);
+            }
+
+            // a block's phis are defined on its incoming edges
+            for (int j = 0; j < b->phis.count; j++) {
+                int phi = b->phis.items[j];
+                if (emitter.slotIndex[phi] != -1) clearBit(live, emitter.slotIndex[phi]);
+            }
+
+            uint64_t* in = setOf(emitter.liveIn, block);
+            if (memcmp(in, live, sizeof(uint64_t) * emitter.words) != 0) {
+                memcpy(in, live, sizeof(uint64_t) * emitter.words);
+                changed = true;
+            }
+        }
+    }
+
+    FREE_ARRAY(uint64_t, live, emitter.words);
+}
+
+static void interfere(int a, int b) {
+    if (a == b) return;
+    setBit(setOf(emitter.interference, a), b);
+    setBit(setOf(emitter.interference, b), a);
+}
+
+static void interfereWithLive(int index, uint64_t* live) {
+    for (int w = 0; w < emitter.words; w++) {
+        uint64_t bits = live[w];
+        while (bits != 0) {
+            int bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            interfere(index, w * 64 + bit);
+        }
+    }
+}
+
+static void computeInterference(IrFunction* ir) {
+    uint64_t* live = ALLOCATE(uint64_t, emitter.words);
+
+    for (int i = 0; i < ir->order.count; i++) {
+        int block = ir->order.items[i];
+        IrBlock* b = &ir->blocks[block];
+        memcpy(live, setOf(emitter.liveOut, block), sizeof(uint64_t) * emitter.words);
+
+        exitUses(block, live);
+        IrList* roots = &emitter.roots[block];
+        for (int j = roots->count - 1; j >= 0; j--) {
+            int root = roots->items[j];
+            int index = emitter.slotIndex[root];
+            if (index != -1) {
+                clearBit(live, index);
+                interfereWithLive(index, live);
+            }
+            treeUses(root, live);
+        }
+
+        // phis are written together, on the way in
+        for (int j = 0; j < b->phis.count; j++) {
+            int index = emitter.slotIndex[b->phis.items[j]];
+            if (index != -1) setBit(live, index);
+        }
+        for (int j = 0; j < b->phis.count; j++) {
+            int index = emitter.slotIndex[b->phis.items[j]];
+            if (index != -1) interfereWithLive(index, live);
+        }
+
+        // parameters are all set when the function starts
+        if (block == 0) {
+            for (int j = 0; j < ir->constants.count; j++) {
+                int index = emitter.slotIndex[ir->constants.items[j]];
+                if (index != -1) setBit(live, index);
+            }
+            for (int j = 0; j < ir->constants.count; j++) {
+                int index = emitter.slotIndex[ir->constants.items[j]];
+                if (index != -1) interfereWithLive(index, live);
+            }
+        }
+    }
+
+    FREE_ARRAY(uint64_t, live, emitter.words);
+}
+
+static int findGroup(int index) {
+    while (emitter.group[index] != index) {
+        emitter.group[index] = emitter.group[emitter.group[index]];
+        index = emitter.group[index];
+    }
+    return index;
+}
+
+static bool isParameter(int index) {
+    return emitter.ir->values[emitter.slotValues.items[index]].op == IR_PARAMETER;
+}
+
+static bool groupHasParameter(int group) {
+    for (int m = group; m != -1; m = emitter.groupNext[m]) {
+        if (isParameter(m)) return true;
+    }
+    return false;
+}
+
+static bool groupsInterfere(int a, int b) {
+    for (int m = a; m != -1; m = emitter.groupNext[m]) {
+        uint64_t* row = setOf(emitter.interference, m);
+        for (int n = b; n != -1; n = emitter.groupNext[n]) {
+            if (testBit(row, n)) return true;
+        }
+    }
+    return false;
+}
+
+// Puts a phi and its operands in one slot when none of them overlap
+static void coalesce(IrFunction* ir) {
+    for (int i = 0; i < emitter.slotValues.count; i++) {
+        emitter.group[i] = i;
+        emitter.groupNext[i] = -1;
+    }
+
+    for (int i = 0; i < emitter.slotValues.count; i++) {
+        int phi = emitter.slotValues.items[i];
+        if (ir->values[phi].op != IR_PHI) continue;
+
+        for (int j = 0; j < ir->values[phi].count; j++) {
+            int operand = irOperand(ir, phi, j);
+            if (emitter.slotIndex[operand] == -1) continue;
+
+            int a = findGroup(i);
+            int b = findGroup(emitter.slotIndex[operand]);
+            if (a == b || groupsInterfere(a, b)) continue;
+            if (groupHasParameter(a) && groupHasParameter(b)) continue;
+
+            // b's members are appended to a's list
+            int last = a;
+            while (emitter.groupNext[last] != -1) last = emitter.groupNext[last];
+            emitter.groupNext[last] = b;
+            emitter.group[b] = a;
+        }
+    }
+}
+
+// Lowest slot no interfering group holds. Parameters keep theirs.
+// Returns the highest slot used, past UINT8_MAX the function can't be
+// addressed with OP_GET_LOCAL
+static int assignSlots(IrFunction* ir) {
+    int count = emitter.slotValues.count;
+    int* groupSlot = ALLOCATE(int, count);
+    for (int i = 0; i < count; i++) groupSlot[i] = -1;
+
+    for (int i = 0; i < count; i++) {
+        if (isParameter(i)) {
+            groupSlot[findGroup(i)] = ir->values[emitter.slotValues.items[i]].arg;
+        }
+    }
+
+    int highest = ir->arity;
+    bool* taken = ALLOCATE(bool, UINT8_COUNT + 1);
+
+    for (int i = 0; i < count; i++) {
+        int group = findGroup(i);
+        if (groupSlot[group] == -1) {
+            for (int s = 0; s <= UINT8_COUNT; s++) taken[s] = s == 0;
+
+            for (int m = group; m != -1; m = emitter.groupNext[m]) {
+                uint64_t* row = setOf(emitter.interference, m);
+                for (int other = 0; other < count; other++) {
+                    if (!testBit(row, other)) continue;
+                    int otherSlot = groupSlot[findGroup(other)];
+                    if (otherSlot != -1 && otherSlot <= UINT8_COUNT) taken[otherSlot] = true;
+                }
+            }
+
+            int s = 1;
+            while (s < UINT8_COUNT && taken[s]) s++;
+            groupSlot[group] = s;
+        }
+
+        emitter.slot[i] = groupSlot[group];
+        if (emitter.slot[i] > highest) highest = emitter.slot[i];
+    }
+
+    FREE_ARRAY(bool, taken, UINT8_COUNT + 1);
+    FREE_ARRAY(int, groupSlot, count);
+    return highest;
+}
+
+static void emit(uint8_t byte) {
+    writeChunk(emitter.chunk, byte, emitter.line);
+}
+
+// phis and plain jumps have no line of their own, they keep the last one
+static void setLine(int line) {
+    if (line > 0) emitter.line = line;
+}
+
+static void emitOperand(OpCode op, int arg) {
+    writeOperand(emitter.chunk, op, arg, emitter.line);
+}
+
+static int slotOf(int value) {
+    return emitter.slot[emitter.slotIndex[value]];
+}
+
+static void emitTree(int value);
+
+static void emitValue(int value) {
+    IrFunction* ir = emitter.ir;
+    value = resolveValue(ir, value);
+
+    switch (ir->values[value].op) {
+        case IR_NIL:        emit(OP_NIL); return;
+        case IR_TRUE:       emit(OP_TRUE); return;
+        case IR_FALSE:      emit(OP_FALSE); return;
+        case IR_CONSTANT:   emitOperand(OP_CONSTANT, ir->values[value].arg); return;
+        default: break;
+    }
+
+    if (emitter.stackified[value]) {
+        emitTree(value);
+    } else {
+        emit(OP_GET_LOCAL);
+        emit((uint8_t)slotOf(value));
+    }
+}
+
+static void emitTree(int value) {
+    IrFunction* ir = emitter.ir;
+    for (int i = 0; i < ir->values[value].count; i++) emitValue(irOperand(ir, value, i));
+
+    IrValue* v = &ir->values[value];
+    setLine(v->line);
+    switch (v->op) {
+        case IR_GET_GLOBAL: emitOperand(OP_GET_GLOBAL, v->arg); break;
+        case IR_SET_GLOBAL: emitOperand(OP_SET_GLOBAL, v->arg); break;
+        case IR_GET_UPVALUE:
+            emit(OP_GET_UPVALUE);
+            emit((uint8_t)v->arg);
+            break;
+        case IR_SET_UPVALUE:
+            emit(OP_SET_UPVALUE);
+            emit((uint8_t)v->arg);
+            break;
+        case IR_ADD:        emit(v->numeric ? OP_ADD_NUM : OP_ADD); break;
+        case IR_SUBTRACT:   emit(v->numeric ? OP_SUBTRACT_NUM : OP_SUBTRACT); break;
+        case IR_MULTIPLY:   emit(v->numeric ? OP_MULTIPLY_NUM : OP_MULTIPLY); break;
+        case IR_DIVIDE:     emit(v->numeric ? OP_DIVIDE_NUM : OP_DIVIDE); break;
+        case IR_NEGATE:     emit(v->numeric ? OP_NEGATE_NUM : OP_NEGATE); break;
+        case IR_NOT:        emit(OP_NOT); break;
+        case IR_EQUAL:      emit(OP_EQUAL); break;
+        case IR_GREATER:    emit(v->numeric ? OP_GREATER_NUM : OP_GREATER); break;
+        case IR_LESS:       emit(v->numeric ? OP_LESS_NUM : OP_LESS); break;
+        case IR_CALL:
+            emit(OP_CALL);
+            emit((uint8_t)v->arg);
+            break;
+        case IR_PRINT:      emit(OP_PRINT); break;
+
+        default: break;
+    }
+}
+
+static void emitRoot(int root) {
+    IrFunction* ir = emitter.ir;
+    emitTree(root);
+
+    IrOp op = ir->values[root].op;
+    if (op == IR_PRINT) return;
+
+    if (producesValue(op) && emitter.slotIndex[root] != -1) {
+        emit(OP_SET_LOCAL);
+        emit((uint8_t)slotOf(root));
+    }
+    emit(OP_POP);
+}
+
+// Sets target's phis for the edge from block. All the operands are
+// pushed before any slot is written, which takes care of phis that
+// read each other
+static void emitPhiCopies(int block, int target) {
+    IrFunction* ir = emitter.ir;
+    IrBlock* t = &ir->blocks[target];
+    int index = predIndex(t, block);
+
+    int pushed = 0;
+    for (int i = 0; i < t->phis.count; i++) {
+        int phi = t->phis.items[i];
+        if (ir->values[phi].op == IR_REMOVED) continue;
+
+        int operand = irOperand(ir, phi, index);
+        if (emitter.slotIndex[operand] != -1 && slotOf(operand) == slotOf(phi)) continue;
+        emitValue(operand);
+        pushed++;
+    }
+
+    for (int i = t->phis.count - 1; i >= 0 && pushed > 0; i--) {
+        int phi = t->phis.items[i];
+        if (ir->values[phi].op == IR_REMOVED) continue;
+
+        int operand = irOperand(ir, phi, index);
+        if (emitter.slotIndex[operand] != -1 && slotOf(operand) == slotOf(phi)) continue;
+        emit(OP_SET_LOCAL);
+        emit((uint8_t)slotOf(phi));
+        emit(OP_POP);
+        pushed--;
+    }
+}
+
+static bool emitJumpTo(int block, int target) {
+    IrFunction* ir = emitter.ir;
+    int from = ir->blocks[block].order;
+    int to = ir->blocks[target].order;
+    if (to == from + 1) return true;
+
+    if (to <= from) {
+        writeLoop(emitter.chunk, emitter.blockStart[target], emitter.line);
+        return true;
+    }
+
+    emit(OP_JUMP);
+    writeIrList(&emitter.fixups, emitter.chunk->count);
+    writeIrList(&emitter.fixups, target);
+    emit(0xff);
+    emit(0xff);
+    return true;
+}
+
+static bool patchOffset(int offset, int target) {
+    int jump = target - offset - 2;
+    if (jump > UINT16_MAX) return false;
+
+    emitter.chunk->code[offset] = (jump >> 8) & 0xff;
+    emitter.chunk->code[offset + 1] = jump & 0xff;
+    return true;
+}
+
+static bool emitBlock(int block) {
+    IrFunction* ir = emitter.ir;
+    IrBlock* b = &ir->blocks[block];
+    emitter.blockStart[block] = emitter.chunk->count;
+
+    if (popsOnEntry(ir, block)) emit(OP_POP);
+
+    IrList* roots = &emitter.roots[block];
+    for (int i = 0; i < roots->count; i++) emitRoot(roots->items[i]);
+
+    setLine(b->exitLine);
+    switch (b->exit) {
+        case EXIT_JUMP:
+            emitPhiCopies(block, b->targets[0]);
+            return emitJumpTo(block, b->targets[0]);
+
+        case EXIT_BRANCH: {
+            emitValue(b->exitValue);
+            setLine(b->exitLine);
+            emit(OP_JUMP_IF_FALSE);
+
+            IrList* patches = popsOnEntry(ir, b->targets[1]) ? &emitter.fixups : &emitter.stubs;
+            writeIrList(patches, emitter.chunk->count);
+            writeIrList(patches, b->targets[1]);
+            emit(0xff);
+            emit(0xff);
+
+            emit(OP_POP);
+            return emitJumpTo(block, b->targets[0]);
+        }
+
+        case EXIT_RETURN: {
+            emitValue(b->exitValue);
+            setLine(b->exitLine);
+
+            // a call left on the stack is the last thing emitted
+            int value = resolveValue(ir, b->exitValue);
+            if (ir->values[value].op == IR_CALL && emitter.stackified[value]) {
+                emitter.chunk->code[emitter.chunk->count - 2] = OP_TAIL_CALL;
+            }
+            emit(OP_RETURN);
+            return true;
+        }
+
+        default:
+            return true;
+    }
+}
+
+static bool emitFunction(IrFunction* ir, int reserved) {
+    for (int i = 0; i < reserved; i++) emit(OP_NIL);
+
+    for (int i = 0; i < ir->order.count; i++) {
+        if (!emitBlock(ir->order.items[i])) return false;
+    }
+
+    for (int i = 0; i < emitter.fixups.count; i += 2) {
+        int target = emitter.blockStart[emitter.fixups.items[i + 1]];
+        if (!patchOffset(emitter.fixups.items[i], target)) return false;
+    }
+
+    // the false side of branches to blocks with other ways in
+    for (int i = 0; i < emitter.stubs.count; i += 2) {
+        if (!patchOffset(emitter.stubs.items[i], emitter.chunk->count)) return false;
+        emit(OP_POP);
+
+        emit(OP_LOOP);
+        int offset = emitter.chunk->count + 2 - emitter.blockStart[emitter.stubs.items[i + 1]];
+        if (offset > UINT16_MAX) return false;
+        emit((offset >> 8) & 0xff);
+        emit(offset & 0xff);
+    }
+
+    return true;
+}
+
+static bool emitIr(IrFunction* ir, Chunk* chunk, int line) {
+    splitCriticalEdges(ir);
+    computeOrder(ir);
+
+    emitter.ir = ir;
+    emitter.chunk = chunk;
+    emitter.line = line;
+    emitter.useCount = ALLOCATE(int, ir->count);
+    emitter.stackified = ALLOCATE(bool, ir->count);
+    emitter.slotIndex = ALLOCATE(int, ir->count);
+    emitter.roots = ALLOCATE(IrList, ir->blockCount);
+    emitter.blockStart = ALLOCATE(int, ir->blockCount);
+    initIrList(&emitter.slotValues);
+    initIrList(&emitter.fixups);
+    initIrList(&emitter.stubs);
+    for (int i = 0; i < ir->count; i++) {
+        emitter.useCount[i] = 0;
+        emitter.stackified[i] = false;
+        emitter.slotIndex[i] = -1;
+    }
+    for (int i = 0; i < ir->blockCount; i++) initIrList(&emitter.roots[i]);
+
+    countUses(ir);
+    for (int i = 0; i < ir->order.count; i++) stackify(ir, ir->order.items[i]);
+
+    // parameters first, they're given their own slots
+    for (int i = 0; i < ir->constants.count; i++) {
+        int value = ir->constants.items[i];
+        if (ir->values[value].op == IR_PARAMETER) addSlotValue(value);
+    }
+    for (int i = 0; i < ir->order.count; i++) {
+        IrBlock* block = &ir->blocks[ir->order.items[i]];
+        for (int j = 0; j < block->phis.count; j++) {
+            int phi = block->phis.items[j];
+            if (ir->values[phi].op == IR_PHI) addSlotValue(phi);
+        }
+        for (int j = 0; j < emitter.roots[ir->order.items[i]].count; j++) {
+            int root = emitter.roots[ir->order.items[i]].items[j];
+            if (producesValue(ir->values[root].op) && emitter.useCount[root] > 0) {
+                addSlotValue(root);
+            }
+        }
+    }
+
+    int count = emitter.slotValues.count;
+    bool emitted = false;
+
+    if (count <= MAX_SLOT_VALUES) {
+        emitter.words = (count + 63) / 64;
+        if (emitter.words == 0) emitter.words = 1;
+        size_t setWords = (size_t)emitter.words * ir->blockCount;
+        size_t matrixWords = (size_t)emitter.words * (count == 0 ? 1 : count);
+
+        emitter.liveIn = ALLOCATE(uint64_t, setWords);
+        emitter.liveOut = ALLOCATE(uint64_t, setWords);
+        emitter.interference = ALLOCATE(uint64_t, matrixWords);
+        memset(emitter.liveIn, 0, sizeof(uint64_t) * setWords);
+        memset(emitter.liveOut, 0, sizeof(uint64_t) * setWords);
+        memset(emitter.interference, 0, sizeof(uint64_t) * matrixWords);
+        emitter.group = ALLOCATE(int, count);
+        emitter.groupNext = ALLOCATE(int, count);
+        emitter.slot = ALLOCATE(int, count);
+
+        computeLiveness(ir);
+        computeInterference(ir);
+        coalesce(ir);
+        int highest = assignSlots(ir);
+
+        if (highest <= UINT8_MAX) emitted = emitFunction(ir, highest - ir->arity);
+
+        FREE_ARRAY(uint64_t, emitter.liveIn, setWords);
+        FREE_ARRAY(uint64_t, emitter.liveOut, setWords);
+        FREE_ARRAY(uint64_t, emitter.interference, matrixWords);
+        FREE_ARRAY(int, emitter.group, count);
+        FREE_ARRAY(int, emitter.groupNext, count);
+        FREE_ARRAY(int, emitter.slot, count);
+    }
+
+    for (int i = 0; i < ir->blockCount; i++) freeIrList(&emitter.roots[i]);
+    FREE_ARRAY(IrList, emitter.roots, ir->blockCount);
+    FREE_ARRAY(int, emitter.blockStart, ir->blockCount);
+    FREE_ARRAY(int, emitter.useCount, ir->count);
+    FREE_ARRAY(bool, emitter.stackified, ir->count);
+    FREE_ARRAY(int, emitter.slotIndex, ir->count);
+    freeIrList(&emitter.slotValues);
+    freeIrList(&emitter.fixups);
+    freeIrList(&emitter.stubs);
+    return emitted;
+}
+
+// Whether the body just compiled can be inlined, and its tree made to
+// mean the same wherever it's lowered: nonlocals are resolved now.
+// Anything capturing, calling itself, or too long is left alone
+static bool canInline(Ast* ast, int codeSize) {
+    ObjFunction* function = current->function;
+    if (current->type != TYPE_FUNCTION || function->upvalueCount > 0) return false;
+    if (codeSize > INLINE_MAX_CODE) return false;
+
+    ObjString* name = function->name;
+    for (int i = 0; i < ast->count; i++) {
+        Node* node = &ast->nodes[i];
+        if (node->type != NODE_NONLOCAL && node->type != NODE_ASSIGN_NONLOCAL) continue;
+        if (node->token.length == name->length
+            && memcmp(node->token.start, name->chars, name->length) == 0) return false;
+
+        // with no upvalues, what isn't a const is a global
+        Value value;
+        if (node->type == NODE_ASSIGN_NONLOCAL || !constBinding(&node->token, &value)) {
+            node->type = node->type == NODE_NONLOCAL ? NODE_GLOBAL : NODE_ASSIGN_GLOBAL;
+        } else if (IS_NUMBER(value)) {
+            node->type = NODE_NUMBER;
+            node->number = AS_NUMBER(value);
+        } else if (IS_BOOL(value)) {
+            node->type = AS_BOOL(value) ? NODE_TRUE : NODE_FALSE;
+        } else if (IS_NIL(value)) {
+            node->type = NODE_NIL;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int keepInlinable(Ast* ast) {
+    if (inlinables.capacity < inlinables.count + 1) {
+        int oldCapacity = inlinables.capacity;
+        inlinables.capacity = GROW_CAPACITY(oldCapacity);
+        inlinables.asts = GROW_ARRAY(Ast, inlinables.asts, oldCapacity, inlinables.capacity);
+    }
+
+    inlinables.asts[inlinables.count] = *ast;
+    initAst(ast);
+    return inlinables.count++;
+}
+
+void freeInlinables() {
+    for (int i = 0; i < inlinables.count; i++) freeAst(&inlinables.asts[i]);
+    FREE_ARRAY(Ast, inlinables.asts, inlinables.capacity);
+    inlinables.asts = NULL;
+    inlinables.count = 0;
+    inlinables.capacity = 0;
+}
+
+bool compileOptimizedBody(int* inlinable) {
+    Scanner saved = saveScanner();
+    int start = currentChunk()->count;
+
+    Ast ast;
+    initAst(&ast);
+    bool compiled = false;
+
+    if (parseFunctionBody(&ast, current, parser.current)) {
+        IrFunction ir;
+        initIr(&ir);
+        lowerAst(&ir, &ast);
+        optimizeIr(&ir);
+
+        // strings in the body are allocated while lowering, the function
+        // may have moved since
+        compiled = emitIr(&ir, currentChunk(), parser.previous.line);
+        freeIr(&ir);
+    }
+
+    *inlinable = -1;
+    if (compiled) {
+        parser.previous = ast.previous;
+        parser.current = ast.current;
+        if (canInline(&ast, currentChunk()->count - start)) *inlinable = keepInlinable(&ast);
+    } else {
+        truncateChunk(currentChunk(), start);
+        restoreScanner(saved);
+    }
+
+    freeAst(&ast);
+    return compiled;
+}
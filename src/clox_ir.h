@@ -0,0 +1,141 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+#include "common.h"
+#include "chunk.h"
+#include "clox_ast.h"
+
+// SSA form of a function body, what the optimizing compiler works on.
+// Every value is defined once. A local assigned in several places
+// becomes several values, merged by phis where control flow joins.
+// Constants and parameters belong to no block: they're loaded where
+// they're used. Values are referenced by index, blocks too
+typedef enum {
+    IR_CONSTANT,    // arg is its index in the constant pool
+    IR_NIL,
+    IR_TRUE,
+    IR_FALSE,
+    IR_PARAMETER,   // arg is its slot
+    IR_PHI,         // arg is the local it merges, -1 for the value of and, or, ?:
+    IR_GET_GLOBAL,  // arg is the name's index in the constant pool
+    IR_SET_GLOBAL,
+    IR_GET_UPVALUE, // arg is the upvalue's index
+    IR_SET_UPVALUE,
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_NEGATE,
+    IR_NOT,
+    IR_EQUAL,
+    IR_GREATER,
+    IR_LESS,
+    IR_CALL,        // the callee, then the arguments
+    IR_PRINT,
+    IR_REMOVED
+} IrOp;
+
+typedef struct {
+    int* items;
+    int count;
+    int capacity;
+} IrList;
+
+typedef struct {
+    IrOp op;
+    int arg;
+    // -1 for constants and parameters
+    int block;
+    // operands, in IrFunction.operands. A phi has one per predecessor,
+    // in the order of the block's preds
+    int first;
+    int count;
+    int line;
+    // the value this one was replaced with, -1 if it wasn't
+    int replacement;
+    // arithmetic or comparison on operands known to be numbers, which
+    // is emitted without the type checks
+    bool numeric;
+} IrValue;
+
+typedef enum {
+    EXIT_NONE,
+    EXIT_JUMP,
+    EXIT_BRANCH,
+    EXIT_RETURN
+} IrExit;
+
+typedef struct {
+    IrList phis;
+    IrList values;
+    IrList preds;
+
+    IrExit exit;
+    // branch condition or returned value
+    int exitValue;
+    // the jump's target, or where a branch goes when true and when false
+    int targets[2];
+    int exitLine;
+
+    // value of each local at the end of the block, as far as it's built
+    int* defs;
+    bool sealed;
+    bool removed;
+
+    // reverse postorder position, -1 if unreachable, and the immediate dominator
+    int order;
+    int idom;
+} IrBlock;
+
+typedef struct {
+    IrValue* values;
+    int count;
+    int capacity;
+
+    int* operands;
+    int operandCount;
+    int operandCapacity;
+
+    IrBlock* blocks;
+    int blockCount;
+    int blockCapacity;
+
+    // constants and parameters, shared by all their uses
+    IrList constants;
+    // reachable blocks in reverse postorder, the entry first
+    IrList order;
+
+    int localCount;
+    int arity;
+} IrFunction;
+
+void initIrList(IrList* list);
+void freeIrList(IrList* list);
+void writeIrList(IrList* list, int item);
+
+void initIr(IrFunction* ir);
+void freeIr(IrFunction* ir);
+
+int resolveValue(IrFunction* ir, int value);
+int irOperand(IrFunction* ir, int value, int index);
+void replaceValue(IrFunction* ir, int value, int replacement);
+int irConstant(IrFunction* ir, IrOp op, int arg);
+bool isConstantValue(IrFunction* ir, int value);
+bool producesValue(IrOp op);
+void setOperands(IrFunction* ir, int value, int* operands, int count);
+int addBlock(IrFunction* ir);
+void removePred(IrFunction* ir, int block, int index);
+void computeOrder(IrFunction* ir);
+bool dominates(IrFunction* ir, int a, int b);
+
+// clox_optimizer.c
+void optimizeIr(IrFunction* ir);
+
+// Compiles the body of the function being compiled through the tree and
+// the IR, from just past its '{'. False when the body isn't one the tree
+// can hold: nothing was consumed and the single-pass compiler takes it.
+// inlinable is set to where the tree was kept for calls to inline, or -1
+bool compileOptimizedBody(int* inlinable);
+// drops the kept trees, once the script is compiled
+void freeInlinables();
+
+#endif
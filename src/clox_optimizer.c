@@ -0,0 +1,641 @@
+#include <stdlib.h>
+#include <string.h>
+#include "clox_ir.h"
+#include "memory.h"
+#include "object.h"
+
+// The passes over the SSA form, in the order they run: copy propagation
+// (trivial phis), constant folding, CFG cleanup, common subexpression
+// elimination, loop-invariant code motion and dead code elimination.
+// None of them moves anything that can fail or has a side effect past
+// anything else, runtime errors are raised where they always were
+
+static Value constantOf(IrFunction* ir, int value) {
+    IrValue* v = &ir->values[value];
+    switch (v->op) {
+        case IR_NIL:    return NIL_VAL;
+        case IR_TRUE:   return BOOL_VAL(true);
+        case IR_FALSE:  return BOOL_VAL(false);
+        default:        return currentChunk()->constants.values[v->arg];
+    }
+}
+
+static int valueConstant(IrFunction* ir, Value value) {
+    if (IS_NIL(value)) return irConstant(ir, IR_NIL, 0);
+    if (IS_BOOL(value)) return irConstant(ir, AS_BOOL(value) ? IR_TRUE : IR_FALSE, 0);
+    return irConstant(ir, IR_CONSTANT, makeConstant(value));
+}
+
+static bool isFalseyValue(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool isNumberConstant(IrFunction* ir, int value) {
+    return ir->values[value].op == IR_CONSTANT && IS_NUMBER(constantOf(ir, value));
+}
+
+static bool removeTrivialPhis(IrFunction* ir) {
+    bool removed = false;
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (int i = 0; i < ir->count; i++) {
+            IrValue* phi = &ir->values[i];
+            if (phi->op != IR_PHI) continue;
+
+            int same = -1;
+            bool trivial = true;
+            for (int j = 0; j < phi->count; j++) {
+                int operand = irOperand(ir, i, j);
+                if (operand == same || operand == i) continue;
+                if (same != -1) {
+                    trivial = false;
+                    break;
+                }
+                same = operand;
+            }
+            if (!trivial) continue;
+
+            if (same == -1) same = irConstant(ir, IR_NIL, 0);
+            replaceValue(ir, i, same);
+            changed = true;
+            removed = true;
+        }
+    }
+
+    return removed;
+}
+
+// Only what the VM would compute the same way: arithmetic on numbers,
+// and the operators that can't fail
+static bool foldValue(IrFunction* ir, int value) {
+    IrValue* v = &ir->values[value];
+    if (v->op < IR_ADD || v->op > IR_LESS) return false;
+
+    int a = irOperand(ir, value, 0);
+    if (!isConstantValue(ir, a)) return false;
+    int b = v->count > 1 ? irOperand(ir, value, 1) : -1;
+    if (b != -1 && !isConstantValue(ir, b)) return false;
+
+    Value x = constantOf(ir, a);
+    Value y = b != -1 ? constantOf(ir, b) : NIL_VAL;
+    Value result;
+
+    switch (v->op) {
+        case IR_NOT:    result = BOOL_VAL(isFalseyValue(x)); break;
+        case IR_EQUAL:  result = BOOL_VAL(valuesEqual(x, y)); break;
+        case IR_NEGATE:
+            if (!IS_NUMBER(x)) return false;
+            result = NUMBER_VAL(-AS_NUMBER(x));
+            break;
+        default: {
+            if (!IS_NUMBER(x) || !IS_NUMBER(y)) return false;
+            double l = AS_NUMBER(x);
+            double r = AS_NUMBER(y);
+
+            switch (v->op) {
+                case IR_ADD:        result = NUMBER_VAL(l + r); break;
+                case IR_SUBTRACT:   result = NUMBER_VAL(l - r); break;
+                case IR_MULTIPLY:   result = NUMBER_VAL(l * r); break;
+                case IR_DIVIDE:     result = NUMBER_VAL(l / r); break;
+                case IR_GREATER:    result = BOOL_VAL(l > r); break;
+                default:            result = BOOL_VAL(l < r); break;
+            }
+        }
+    }
+
+    replaceValue(ir, value, valueConstant(ir, result));
+    return true;
+}
+
+static int successorCount(IrBlock* block) {
+    switch (block->exit) {
+        case EXIT_JUMP:     return 1;
+        case EXIT_BRANCH:   return 2;
+        default:            return 0;
+    }
+}
+
+static int predPosition(IrBlock* block, int pred) {
+    for (int i = 0; i < block->preds.count; i++) {
+        if (block->preds.items[i] == pred) return i;
+    }
+    return -1;
+}
+
+static void toJump(IrFunction* ir, int block, int kept) {
+    IrBlock* b = &ir->blocks[block];
+    int dropped = b->targets[kept == 0 ? 1 : 0];
+    int target = b->targets[kept];
+
+    b->exit = EXIT_JUMP;
+    b->exitValue = -1;
+    b->targets[0] = target;
+    b->targets[1] = -1;
+    removePred(ir, dropped, predPosition(&ir->blocks[dropped], block));
+}
+
+static bool foldConstants(IrFunction* ir) {
+    bool changed = false;
+
+    for (int i = 0; i < ir->blockCount; i++) {
+        IrBlock* block = &ir->blocks[i];
+        if (block->removed) continue;
+
+        for (int j = 0; j < block->values.count; j++) {
+            if (foldValue(ir, block->values.items[j])) changed = true;
+        }
+
+        block = &ir->blocks[i];
+        if (block->exit != EXIT_BRANCH) continue;
+
+        int condition = resolveValue(ir, block->exitValue);
+        if (block->targets[0] == block->targets[1]) {
+            // both edges come in as preds, one goes
+            toJump(ir, i, 0);
+            changed = true;
+        } else if (isConstantValue(ir, condition)) {
+            toJump(ir, i, isFalseyValue(constantOf(ir, condition)) ? 1 : 0);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static void removeBlock(IrFunction* ir, int block) {
+    IrBlock* b = &ir->blocks[block];
+    b->removed = true;
+
+    for (int i = 0; i < b->phis.count; i++) ir->values[b->phis.items[i]].op = IR_REMOVED;
+    for (int i = 0; i < b->values.count; i++) ir->values[b->values.items[i]].op = IR_REMOVED;
+
+    for (int i = 0; i < successorCount(b); i++) {
+        int successor = b->targets[i];
+        int index = predPosition(&ir->blocks[successor], block);
+        if (index != -1) removePred(ir, successor, index);
+    }
+    b->exit = EXIT_NONE;
+}
+
+static bool removeUnreachable(IrFunction* ir) {
+    computeOrder(ir);
+    bool changed = false;
+
+    for (int i = 0; i < ir->blockCount; i++) {
+        if (!ir->blocks[i].removed && ir->blocks[i].order == -1) {
+            removeBlock(ir, i);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static bool hasPhis(IrFunction* ir, IrBlock* block) {
+    for (int i = 0; i < block->phis.count; i++) {
+        if (ir->values[block->phis.items[i]].op == IR_PHI) return true;
+    }
+    return false;
+}
+
+// A block holding nothing but a jump is skipped by its predecessors.
+// Not when the target merges values: its phis are per predecessor
+static bool bypassEmptyBlocks(IrFunction* ir) {
+    bool changed = false;
+
+    for (int i = 1; i < ir->blockCount; i++) {
+        IrBlock* block = &ir->blocks[i];
+        if (block->removed || block->exit != EXIT_JUMP) continue;
+        if (block->values.count != 0 || hasPhis(ir, block)) continue;
+
+        int target = block->targets[0];
+        if (target == i || hasPhis(ir, &ir->blocks[target])) continue;
+
+        bool allJump = block->preds.count > 0;
+        for (int j = 0; j < block->preds.count; j++) {
+            if (ir->blocks[block->preds.items[j]].exit != EXIT_JUMP) allJump = false;
+        }
+        if (!allJump) continue;
+
+        IrBlock* t = &ir->blocks[target];
+        int index = predPosition(t, i);
+        for (int j = 0; j < block->preds.count; j++) {
+            int pred = block->preds.items[j];
+            ir->blocks[pred].targets[0] = target;
+            if (j == 0) t->preds.items[index] = pred;
+            else writeIrList(&t->preds, pred);
+        }
+
+        block->preds.count = 0;
+        block->exit = EXIT_NONE;
+        block->removed = true;
+        changed = true;
+    }
+
+    return changed;
+}
+
+// A block only reached by jumping from another one is appended to it,
+// which lets values flow from one to the other on the stack. Inlined
+// bodies leave a lot of these behind
+static bool mergeBlocks(IrFunction* ir) {
+    bool changed = false;
+
+    for (int i = 0; i < ir->blockCount; i++) {
+        IrBlock* block = &ir->blocks[i];
+        if (block->removed || block->exit != EXIT_JUMP) continue;
+
+        int next = block->targets[0];
+        IrBlock* n = &ir->blocks[next];
+        if (next == i || next == 0 || n->preds.count != 1 || hasPhis(ir, n)) continue;
+
+        for (int j = 0; j < n->values.count; j++) {
+            int value = n->values.items[j];
+            ir->values[value].block = i;
+            writeIrList(&block->values, value);
+        }
+
+        block = &ir->blocks[i];
+        block->exit = n->exit;
+        block->exitValue = n->exitValue;
+        block->targets[0] = n->targets[0];
+        block->targets[1] = n->targets[1];
+        block->exitLine = n->exitLine;
+
+        for (int j = 0; j < successorCount(n); j++) {
+            IrBlock* successor = &ir->blocks[n->targets[j]];
+            int index = predPosition(successor, next);
+            successor->preds.items[index] = i;
+        }
+
+        n->values.count = 0;
+        n->preds.count = 0;
+        n->exit = EXIT_NONE;
+        n->removed = true;
+        changed = true;
+        // the merged block may go on into the next one
+        i--;
+    }
+
+    return changed;
+}
+
+static void simplifyCfg(IrFunction* ir) {
+    bool changed = true;
+    while (changed) {
+        changed = removeTrivialPhis(ir);
+        if (foldConstants(ir)) changed = true;
+        if (removeUnreachable(ir)) changed = true;
+        if (bypassEmptyBlocks(ir)) changed = true;
+        if (mergeBlocks(ir)) changed = true;
+    }
+}
+
+static bool isPure(IrOp op) {
+    return op >= IR_ADD && op <= IR_LESS;
+}
+
+static bool sameExpression(IrFunction* ir, int a, int b) {
+    IrValue* x = &ir->values[a];
+    IrValue* y = &ir->values[b];
+    if (x->op != y->op || x->count != y->count) return false;
+
+    for (int i = 0; i < x->count; i++) {
+        if (irOperand(ir, a, i) != irOperand(ir, b, i)) return false;
+    }
+    return true;
+}
+
+// An expression computed again where an earlier one dominates is
+// replaced by it. Arithmetic that fails on its operands failed the
+// first time, so the second one is never reached either
+static void eliminateCommon(IrFunction* ir) {
+    IrList available;
+    initIrList(&available);
+
+    for (int i = 0; i < ir->order.count; i++) {
+        int block = ir->order.items[i];
+        IrBlock* b = &ir->blocks[block];
+
+        for (int j = 0; j < b->values.count; j++) {
+            int value = b->values.items[j];
+            if (!isPure(ir->values[value].op)) continue;
+
+            bool replaced = false;
+            for (int k = 0; k < available.count; k++) {
+                int other = available.items[k];
+                if (ir->values[other].op == IR_REMOVED) continue;
+                if (!sameExpression(ir, value, other)) continue;
+                if (!dominates(ir, ir->values[other].block, block)) continue;
+
+                replaceValue(ir, value, other);
+                replaced = true;
+                break;
+            }
+
+            if (!replaced) writeIrList(&available, value);
+        }
+    }
+
+    freeIrList(&available);
+}
+
+// Optimistic: a phi is a number unless one of its operands is shown not
+// to be, which settles loop counters started and stepped by numbers
+static void inferNumbers(IrFunction* ir, bool* isNumber) {
+    for (int i = 0; i < ir->count; i++) {
+        IrOp op = ir->values[i].op;
+        isNumber[i] = op == IR_PHI || isNumberConstant(ir, i)
+                      || op == IR_ADD || op == IR_SUBTRACT || op == IR_MULTIPLY
+                      || op == IR_DIVIDE || op == IR_NEGATE;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (int i = 0; i < ir->count; i++) {
+            if (!isNumber[i]) continue;
+            IrValue* v = &ir->values[i];
+            bool number = true;
+
+            if (v->op == IR_PHI) {
+                for (int j = 0; j < v->count; j++) {
+                    if (!isNumber[irOperand(ir, i, j)]) number = false;
+                }
+            } else if (v->op == IR_ADD) {
+                // strings add too
+                number = isNumber[irOperand(ir, i, 0)] && isNumber[irOperand(ir, i, 1)];
+            }
+
+            if (!number) {
+                isNumber[i] = false;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool cannotFail(IrFunction* ir, int value, bool* isNumber) {
+    IrValue* v = &ir->values[value];
+    if (v->op == IR_NOT || v->op == IR_EQUAL) return true;
+    if (!isPure(v->op)) return false;
+
+    for (int i = 0; i < v->count; i++) {
+        if (!isNumber[irOperand(ir, value, i)]) return false;
+    }
+    return true;
+}
+
+// Blocks of the loop headed by header: the ones reaching its back edges
+// without going through it
+static void loopBlocks(IrFunction* ir, int header, bool* inLoop) {
+    for (int i = 0; i < ir->blockCount; i++) inLoop[i] = false;
+    inLoop[header] = true;
+
+    IrList work;
+    initIrList(&work);
+    IrBlock* h = &ir->blocks[header];
+    for (int i = 0; i < h->preds.count; i++) {
+        int pred = h->preds.items[i];
+        if (dominates(ir, header, pred) && !inLoop[pred]) {
+            inLoop[pred] = true;
+            writeIrList(&work, pred);
+        }
+    }
+
+    while (work.count > 0) {
+        IrBlock* block = &ir->blocks[work.items[--work.count]];
+        for (int i = 0; i < block->preds.count; i++) {
+            int pred = block->preds.items[i];
+            if (!inLoop[pred] && ir->blocks[pred].order != -1) {
+                inLoop[pred] = true;
+                writeIrList(&work, pred);
+            }
+        }
+    }
+
+    freeIrList(&work);
+}
+
+static bool definedOutside(IrFunction* ir, int value, bool* inLoop) {
+    int block = ir->values[value].block;
+    return block == -1 || !inLoop[block];
+}
+
+// Pure values whose operands are all defined outside the loop are moved
+// to the end of its preheader. Only the ones that can't fail: hoisted
+// out of a loop that runs zero times, anything else would raise an
+// error the program never had
+static void hoistInvariants(IrFunction* ir) {
+    bool* isNumber = ALLOCATE(bool, ir->count);
+    bool* inLoop = ALLOCATE(bool, ir->blockCount);
+    inferNumbers(ir, isNumber);
+
+    // innermost loops come last in reverse postorder, their invariants
+    // can move on out of the enclosing ones afterwards
+    for (int i = ir->order.count - 1; i >= 0; i--) {
+        int header = ir->order.items[i];
+        IrBlock* h = &ir->blocks[header];
+
+        bool isLoop = false;
+        int preheader = -1;
+        int outside = 0;
+        for (int j = 0; j < h->preds.count; j++) {
+            int pred = h->preds.items[j];
+            if (dominates(ir, header, pred)) {
+                isLoop = true;
+            } else {
+                preheader = pred;
+                outside++;
+            }
+        }
+        if (!isLoop || outside != 1 || ir->blocks[preheader].exit != EXIT_JUMP) continue;
+
+        loopBlocks(ir, header, inLoop);
+
+        bool moved = true;
+        while (moved) {
+            moved = false;
+
+            for (int j = 0; j < ir->order.count; j++) {
+                int block = ir->order.items[j];
+                if (!inLoop[block]) continue;
+                IrBlock* b = &ir->blocks[block];
+
+                for (int k = 0; k < b->values.count; k++) {
+                    int value = b->values.items[k];
+                    if (ir->values[value].op == IR_REMOVED) continue;
+                    if (!cannotFail(ir, value, isNumber)) continue;
+
+                    bool invariant = true;
+                    for (int o = 0; o < ir->values[value].count; o++) {
+                        if (!definedOutside(ir, irOperand(ir, value, o), inLoop)) invariant = false;
+                    }
+                    if (!invariant) continue;
+
+                    memmove(b->values.items + k, b->values.items + k + 1,
+                            sizeof(int) * (b->values.count - k - 1));
+                    b->values.count--;
+                    k--;
+
+                    writeIrList(&ir->blocks[preheader].values, value);
+                    b = &ir->blocks[block];
+                    ir->values[value].block = preheader;
+                    moved = true;
+                }
+            }
+        }
+    }
+
+    FREE_ARRAY(bool, isNumber, ir->count);
+    FREE_ARRAY(bool, inLoop, ir->blockCount);
+}
+
+static void markLive(IrFunction* ir, int value, bool* live, IrList* work) {
+    value = resolveValue(ir, value);
+    if (live[value]) return;
+    live[value] = true;
+    writeIrList(work, value);
+}
+
+// Live values are the ones with an effect, or that can fail, and what
+// they read; everything else goes
+static void eliminateDead(IrFunction* ir) {
+    bool* isNumber = ALLOCATE(bool, ir->count);
+    bool* live = ALLOCATE(bool, ir->count);
+    inferNumbers(ir, isNumber);
+    for (int i = 0; i < ir->count; i++) live[i] = false;
+
+    IrList work;
+    initIrList(&work);
+
+    for (int i = 0; i < ir->order.count; i++) {
+        IrBlock* block = &ir->blocks[ir->order.items[i]];
+
+        for (int j = 0; j < block->values.count; j++) {
+            int value = block->values.items[j];
+            IrOp op = ir->values[value].op;
+            if (op == IR_REMOVED || op == IR_GET_UPVALUE) continue;
+            if (isPure(op) && cannotFail(ir, value, isNumber)) continue;
+            markLive(ir, value, live, &work);
+        }
+        if (block->exitValue != -1) markLive(ir, block->exitValue, live, &work);
+    }
+
+    while (work.count > 0) {
+        int value = work.items[--work.count];
+        for (int i = 0; i < ir->values[value].count; i++) {
+            markLive(ir, irOperand(ir, value, i), live, &work);
+        }
+    }
+
+    for (int i = 0; i < ir->count; i++) {
+        IrValue* v = &ir->values[i];
+        if (live[i] || v->block == -1 || v->op == IR_REMOVED) continue;
+        v->op = IR_REMOVED;
+    }
+
+    freeIrList(&work);
+    FREE_ARRAY(bool, isNumber, ir->count);
+    FREE_ARRAY(bool, live, ir->count);
+}
+
+// Arithmetic that raises an error unless its operands are numbers.
+// Addition isn't one, strings add too
+static bool checksNumbers(IrOp op) {
+    return op == IR_SUBTRACT || op == IR_MULTIPLY || op == IR_DIVIDE
+           || op == IR_NEGATE || op == IR_GREATER || op == IR_LESS;
+}
+
+typedef struct {
+    IrFunction* ir;
+    bool* isNumber;
+    // how many checks on each value dominate the block being visited
+    int* checked;
+    int* firstChild;
+    int* nextSibling;
+} NumericWalk;
+
+// Down the dominator tree. A value is known to be a number in a block
+// when it always is, or when a check on it ran in a block dominating
+// this one: anything else and that check would have stopped the
+// program. Checks in the same block don't count, their order isn't
+// kept once the block is emitted as trees
+static void markNumericFrom(NumericWalk* walk, int block) {
+    IrFunction* ir = walk->ir;
+    IrList* values = &ir->blocks[block].values;
+
+    for (int i = 0; i < values->count; i++) {
+        IrValue* v = &ir->values[values->items[i]];
+        if (v->op != IR_ADD && !checksNumbers(v->op)) continue;
+
+        v->numeric = true;
+        for (int j = 0; j < v->count; j++) {
+            int operand = irOperand(ir, values->items[i], j);
+            if (!walk->isNumber[operand] && walk->checked[operand] == 0) v->numeric = false;
+        }
+        // its uses are all dominated by it
+        if (v->numeric && v->op == IR_ADD) walk->isNumber[values->items[i]] = true;
+    }
+
+    for (int i = 0; i < values->count; i++) {
+        IrValue* v = &ir->values[values->items[i]];
+        if (!checksNumbers(v->op)) continue;
+        for (int j = 0; j < v->count; j++) walk->checked[irOperand(ir, values->items[i], j)]++;
+    }
+
+    for (int child = walk->firstChild[block]; child != -1; child = walk->nextSibling[child]) {
+        markNumericFrom(walk, child);
+    }
+
+    for (int i = 0; i < values->count; i++) {
+        IrValue* v = &ir->values[values->items[i]];
+        if (!checksNumbers(v->op)) continue;
+        for (int j = 0; j < v->count; j++) walk->checked[irOperand(ir, values->items[i], j)]--;
+    }
+}
+
+// Picks the arithmetic and comparisons whose operands are known to be
+// numbers, they're emitted as the opcodes that don't check
+static void markNumeric(IrFunction* ir) {
+    NumericWalk walk;
+    walk.ir = ir;
+    walk.isNumber = ALLOCATE(bool, ir->count);
+    walk.checked = ALLOCATE(int, ir->count);
+    walk.firstChild = ALLOCATE(int, ir->blockCount);
+    walk.nextSibling = ALLOCATE(int, ir->blockCount);
+    inferNumbers(ir, walk.isNumber);
+
+    for (int i = 0; i < ir->count; i++) walk.checked[i] = 0;
+    for (int i = 0; i < ir->blockCount; i++) {
+        walk.firstChild[i] = -1;
+        walk.nextSibling[i] = -1;
+    }
+    for (int i = ir->order.count - 1; i > 0; i--) {
+        int block = ir->order.items[i];
+        int idom = ir->blocks[block].idom;
+        walk.nextSibling[block] = walk.firstChild[idom];
+        walk.firstChild[idom] = block;
+    }
+
+    markNumericFrom(&walk, ir->order.items[0]);
+
+    FREE_ARRAY(bool, walk.isNumber, ir->count);
+    FREE_ARRAY(int, walk.checked, ir->count);
+    FREE_ARRAY(int, walk.firstChild, ir->blockCount);
+    FREE_ARRAY(int, walk.nextSibling, ir->blockCount);
+}
+
+void optimizeIr(IrFunction* ir) {
+    simplifyCfg(ir);
+    computeOrder(ir);
+
+    eliminateCommon(ir);
+    hoistInvariants(ir);
+    eliminateDead(ir);
+    markNumeric(ir);
+}
@@ -15,6 +15,14 @@ void initScanner(const char* source) {
     scanner.line = 1;
 }
 
+Scanner saveScanner() {
+    return scanner;
+}
+
+void restoreScanner(Scanner saved) {
+    scanner = saved;
+}
+
 static bool isAtEnd() {
     return *scanner.current == '\0';
 }
@@ -52,5 +52,8 @@ typedef struct {
 
 void initScanner(const char* source);
 Token scanToken();
+// the scanner's position, so a stretch of source can be scanned again
+Scanner saveScanner();
+void restoreScanner(Scanner saved);
 
 #endif
@@ -12,6 +12,7 @@
 // #define DEBUG_LOG_GC
 // #define DEBUG_PRINT_CODE
 // #define DEUBUG_STRESS_GC
+// #define DEBUG_CHECK_NUMBERS
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 #endif
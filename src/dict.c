@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "value.h"
+#include "dict.h"
+#include "object.h"
+
+#define INDEX_EMPTY (-1)
+#define INDEX_DELETED (-2)
+
+void initDict(Dict* dict) {
+    dict->count = 0;
+    dict->used = 0;
+    dict->capacity = 0;
+    dict->indexCapacity = 0;
+    dict->hasIdentityKeys = false;
+    dict->epoch = 0;
+    dict->entries = NULL;
+    dict->index = NULL;
+}
+
+void freeDict(Dict* dict) {
+    FREE_ARRAY(DictEntry, dict->entries, dict->capacity);
+    FREE_ARRAY(int32_t, dict->index, dict->indexCapacity);
+    initDict(dict);
+}
+
+static inline uint32_t mix64(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xFF51AFD7ED558CCDULL;
+    bits ^= bits >> 33;
+    bits *= 0xC4CEB9FE1A85EC53ULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static uint32_t hashKey(Value key) {
+    if (IS_STRING(key)) return AS_STRING(key)->hash;
+
+    if (IS_NUMBER(key)) {
+        double num = AS_NUMBER(key);
+        uint64_t bits;
+        memcpy(&bits, &num, sizeof(bits));
+        return mix64(bits);
+    }
+
+    if (IS_BOOL(key)) return AS_BOOL(key) ? 0x9E3779B9u : 0x7F4A7C15u;
+    if (IS_NIL(key)) return 0x85EBCA6Bu;
+
+    return mix64((uint64_t)(uintptr_t)AS_OBJ(key));
+}
+
+// Strings are compared by pointer once interned, and -0 is stored as 0
+// so that equal numbers share a bit pattern
+static inline Value canonicalKey(Value key) {
+    if (IS_NUMBER(key)) return AS_NUMBER(key) == 0 ? NUMBER_VAL(0) : key;
+    if (IS_STRING(key)) return OBJ_VAL(internString(AS_STRING(key)));
+    return key;
+}
+
+static inline bool keysEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type) return false;
+
+    switch (a.type) {
+        case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NIL:       return true;
+        case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        default:            return false;
+    }
+#endif
+}
+
+// Sparse slot holding the key's position, or the empty slot that ends
+// its probe sequence
+static int32_t* findSlot(Dict* dict, Value key, uint32_t hash) {
+    uint32_t mask = dict->indexCapacity - 1;
+    uint32_t i = hash & mask;
+
+    for (;;) {
+        int32_t* slot = &dict->index[i];
+        if (*slot == INDEX_EMPTY) return slot;
+        if (*slot >= 0 && keysEqual(dict->entries[*slot].key, key)) return slot;
+
+        i = (i + 1) & mask;
+    }
+}
+
+// Keeps the sparse index at most two thirds full of dense positions
+static void rebuildIndex(Dict* dict) {
+    int indexCapacity = 8;
+    while (indexCapacity * 2 < dict->capacity * 3) indexCapacity *= 2;
+
+    if (indexCapacity != dict->indexCapacity) {
+        FREE_ARRAY(int32_t, dict->index, dict->indexCapacity);
+        dict->index = ALLOCATE(int32_t, indexCapacity);
+        dict->indexCapacity = indexCapacity;
+    }
+    memset(dict->index, 0xFF, sizeof(int32_t) * indexCapacity); // INDEX_EMPTY
+
+    uint32_t mask = indexCapacity - 1;
+    for (int32_t pos = 0; pos < dict->used; pos++) {
+        Value key = dict->entries[pos].key;
+        if (IS_DICT_HOLE(key)) continue;
+
+        uint32_t i = hashKey(key) & mask;
+        while (dict->index[i] != INDEX_EMPTY) i = (i + 1) & mask;
+        dict->index[i] = pos;
+    }
+
+    dict->epoch = vHeap.collections;
+}
+
+// Called when the dense array is full: squeeze out the holes, and only
+// grow when they don't free at least half of it
+static void makeRoom(Dict* dict) {
+    int live = 0;
+    for (int i = 0; i < dict->used; i++) {
+        if (!IS_DICT_HOLE(dict->entries[i].key)) dict->entries[live++] = dict->entries[i];
+    }
+    dict->used = live;
+
+    if (live * 2 > dict->capacity || dict->capacity == 0) {
+        int oldCapacity = dict->capacity;
+        dict->capacity = GROW_CAPACITY(oldCapacity);
+        dict->entries = GROW_ARRAY(DictEntry, dict->entries, oldCapacity, dict->capacity);
+    }
+
+    rebuildIndex(dict);
+}
+
+// Objects used as keys may have been moved by a collection since the
+// index was built, and with them their hashes
+static inline void refreshIndex(Dict* dict) {
+    if (dict->hasIdentityKeys && dict->epoch != vHeap.collections) rebuildIndex(dict);
+}
+
+// Sizes the dense array for at least capacity pairs up front
+void dictReserve(Dict* dict, int capacity) {
+    if (capacity <= dict->capacity) return;
+
+    dict->entries = GROW_ARRAY(DictEntry, dict->entries, dict->capacity, capacity);
+    dict->capacity = capacity;
+    rebuildIndex(dict);
+}
+
+bool dictSet(Dict* dict, Value key, Value value) {
+    key = canonicalKey(key);
+    uint32_t hash = hashKey(key);
+
+    if (dict->count > 0) {
+        refreshIndex(dict);
+        int32_t* slot = findSlot(dict, key, hash);
+        if (*slot >= 0) {
+            dict->entries[*slot].value = value;
+            return false;
+        }
+    }
+
+    if (dict->used == dict->capacity) makeRoom(dict);
+    else refreshIndex(dict);
+
+    // first free sparse slot along the probe sequence, deleted ones included
+    uint32_t mask = dict->indexCapacity - 1;
+    uint32_t i = hash & mask;
+    while (dict->index[i] >= 0) i = (i + 1) & mask;
+
+    if (IS_OBJ(key) && !IS_STRING(key)) dict->hasIdentityKeys = true;
+
+    dict->index[i] = dict->used;
+    dict->entries[dict->used].key = key;
+    dict->entries[dict->used].value = value;
+    dict->used++;
+    dict->count++;
+    return true;
+}
+
+bool dictGet(Dict* dict, Value key, Value* value) {
+    if (dict->count == 0) return false;
+    key = canonicalKey(key);
+    refreshIndex(dict);
+
+    int32_t* slot = findSlot(dict, key, hashKey(key));
+    if (*slot < 0) return false;
+
+    *value = dict->entries[*slot].value;
+    return true;
+}
+
+bool dictDelete(Dict* dict, Value key) {
+    if (dict->count == 0) return false;
+    key = canonicalKey(key);
+    refreshIndex(dict);
+
+    int32_t* slot = findSlot(dict, key, hashKey(key));
+    if (*slot < 0) return false;
+
+    // leaves a hole in the dense array, iteration order is kept
+    dict->entries[*slot].key = DICT_HOLE;
+    dict->entries[*slot].value = NIL_VAL;
+    *slot = INDEX_DELETED;
+    dict->count--;
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef clox_dict_h
+#define clox_dict_h
+#include "common.h"
+#include "value.h"
+
+// Compact, insertion-ordered hash map used by dictionaries. Pairs live
+// once, in a dense array in insertion order; a sparse power-of-two index
+// of int32 positions into it is what gets probed. Removing a pair only
+// leaves a hole in the dense array, holes are squeezed out the next time
+// the dense array fills up.
+// Keys are any Value: strings hash by content, numbers by bit pattern,
+// other objects by identity
+typedef struct {
+    Value key;
+    Value value;
+} DictEntry;
+
+// a removed pair: an object key with no object behind it
+#define DICT_HOLE OBJ_VAL(NULL)
+#define IS_DICT_HOLE(key) (IS_OBJ(key) && AS_OBJ(key) == NULL)
+
+typedef struct {
+    int count;         // live pairs
+    int used;          // dense slots handed out, holes included
+    int capacity;      // dense slots allocated
+    int indexCapacity; // sparse slots, a power of two
+    // identity hashes are addresses, which a collection may change
+    bool hasIdentityKeys;
+    uint32_t epoch;
+    DictEntry* entries;
+    int32_t* index;
+} Dict;
+
+// the most pairs a dictionary can make room for: the index is sized to
+// more than 1.5 times the dense array and still has to fit an int
+#define DICT_MAX_CAPACITY ((1 << 30) / 3)
+
+void initDict(Dict* dict);
+void freeDict(Dict* dict);
+void dictReserve(Dict* dict, int capacity);
+bool dictSet(Dict* dict, Value key, Value value);
+bool dictGet(Dict* dict, Value key, Value* value);
+bool dictDelete(Dict* dict, Value key);
+#endif
@@ -8,6 +8,8 @@
 #include "clox_debug.h"
 #include "vm.h"
 #include "memory.h"
+#include "cache.h"
+#include "clox_compiler.h"
 
 volatile sig_atomic_t interrupted = 0;
 
@@ -26,7 +28,7 @@ static void repl() {
     }
 }
 
-static char* readFile(const char* path) {
+static char* readFile(const char* path, size_t* length) {
     FILE* file = fopen(path, "rb");
 
     if (file == NULL) {
@@ -55,16 +57,38 @@ static char* readFile(const char* path) {
     buffer[bytesRead] = '\0';
 
     fclose(file);
+    *length = bytesRead;
     return buffer;
 }
 
-static void runFile(const char* path) {
+// Scripts run from a file are compiled once, later runs of the same
+// source load the bytecode cached next to it
+static void runFile(const char* path, bool compileOnly) {
+    size_t length;
+    char* source = readFile(path, &length);
+    uint64_t sourceHash = hashSource(source, length);
+
+    char cachePath[4096];
+    cachePathFor(path, cachePath, sizeof(cachePath));
+
+    ObjFunction* function = readBytecodeCache(cachePath, sourceHash);
+    if (function == NULL) {
+        function = compile(source);
+        free(source);
+        if (function == NULL) exit(65);
+
+        // not being able to cache only costs the next run a compile
+        if (!writeBytecodeCache(cachePath, function, sourceHash) && compileOnly) {
+            fprintf(stderr, "Could not write \"%s\".\n", cachePath);
+            exit(74);
+        }
+    } else {
+        free(source);
+    }
 
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    if (compileOnly) return;
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    InterpretResult result = interpretFunction(function);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
@@ -72,18 +96,45 @@ void clear(int sig) {
     interrupted = 1;
 }
 
+static void usage() {
+    fprintf(stderr, "Usage: clox [-O | -O0] [--max-heap=MB] [--compile-only] [path]\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[]) {
     initVM();
     signal(SIGINT, clear);
     signal(SIGTERM, clear);
-    
-    if (argc == 1) {
+
+    bool compileOnly = false;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-O") == 0) {
+            // function bodies through the optimizing compiler
+            optimizationLevel = 1;
+        } else if (strcmp(argv[arg], "-O0") == 0) {
+            optimizationLevel = 0;
+        } else if (strncmp(argv[arg], "--max-heap=", 11) == 0) {
+            // objects and the stores they own, past it the process exits
+            long megabytes = strtol(argv[arg] + 11, NULL, 10);
+            if (megabytes <= 0) usage();
+            vHeap.limit = MB(megabytes);
+        } else if (strcmp(argv[arg], "--compile-only") == 0) {
+            // writes the bytecode cache without running the script
+            compileOnly = true;
+        } else {
+            usage();
+        }
+    }
+
+    if (arg == argc && !compileOnly) {
+        // each line is compiled as it's typed, it has to be quick
+        optimizationLevel = 0;
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg], compileOnly);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        usage();
     }
 
     freeVM();
@@ -23,6 +23,9 @@
 #define IS_IN_OLD(obj) \
                 ((uint8_t*)obj >= vHeap.oldGen.from.start \
                             && (uint8_t*)obj < vHeap.oldGen.from.start + vHeap.oldGen.from.bytesAllocated)
+#define IS_IN_LARGE(obj) \
+                ((uint8_t*)obj >= vHeap.large.start \
+                            && (uint8_t*)obj < vHeap.large.top)
 
 GenerationalHeap vHeap;
 
@@ -40,6 +43,7 @@ const char* objTypeName(int t) {
         case OBJ_NATIVE:     return "NATIVE";
         case OBJ_STRING:     return "STRING";
         case OBJ_RANGE:      return "RANGE";
+        case OBJ_STRING_BUILDER: return "STRING_BUILDER";
         default:             return "UNKNOWN";
     }
 }
@@ -122,17 +126,12 @@ static void updateFields(Obj* obj) {
         case OBJ_DICTIONARY: {
             ObjDictionary* dict = (ObjDictionary*)obj;
             ADJUST_INTERNAL(dict->klass);
-            size_t entriesCount = 0;
 
-            for (int i = 0; i < dict->map.capacity; i++) {
-                if (dict->map.entries[i].key != NULL) {
-                    ADJUST_INTERNAL(dict->map.entries[i].key);
+            for (int i = 0; i < dict->map.used; i++) {
+                if (!IS_DICT_HOLE(dict->map.entries[i].key)) {
+                    ADJUST_INTERNAL_VALUE(&dict->map.entries[i].key);
                     ADJUST_INTERNAL_VALUE(&dict->map.entries[i].value);
-
-                    dict->entries.entries[entriesCount].key = dict->map.entries[i].key;
-                    dict->entries.entries[entriesCount++].value = dict->map.entries[i].value;
                 }
-
             }
 
             break;
@@ -141,8 +140,9 @@ static void updateFields(Obj* obj) {
             ObjArray* arr = (ObjArray*)obj;
             ADJUST_INTERNAL(arr->klass);
 
-            for (int i = 0; i < arr->values.count; i++) {
-                ADJUST_INTERNAL_VALUE(&arr->values.values[i]);
+            // packed number arrays hold no references
+            for (int i = 0; !arr->isPacked && i < arr->count; i++) {
+                ADJUST_INTERNAL_VALUE(&arr->values[i]);
             }
 
             break;
@@ -184,6 +184,11 @@ static void updateFields(Obj* obj) {
             ADJUST_INTERNAL(bound->method);
             break;
         }
+        case OBJ_STRING_BUILDER: {
+            ObjStringBuilder* builder = (ObjStringBuilder*)obj;
+            ADJUST_INTERNAL(builder->klass);
+            break;
+        }
         case OBJ_NATIVE:
         case OBJ_STRING:
         case OBJ_RANGE:
@@ -206,6 +211,13 @@ static void scanAndUpdate(Heap* heap) {
     }
 }
 
+// Large objects don't move, but what they reference may have
+static void scanAndUpdateLarge() {
+    for (LargeObject* large = vHeap.large.objects; large != NULL; large = large->next) {
+        updateFields((Obj*)((uint8_t*)large + LARGE_HEADER_SIZE));
+    }
+}
+
 static void scanAndUpdateNursery() {
     uint8_t* start = vHeap.nursery.start;
     uint8_t* end = vHeap.nursery.curr;
@@ -252,6 +264,10 @@ static void updateReferences() {
         upval = &(*upval)->next;
     }
 
+    for (Compiler* compiler = compilerChain(); compiler != NULL; compiler = compiler->enclosing) {
+        ADJUST_REF(compiler->function);
+    }
+
     for (int i = 0; i <= vm.nestingLevel; i++) {
         for (int j = 0; j < vm.queueCount[i]; j++) {
             ADJUST_VALUE(&vm.queue[i].values[j]);
@@ -289,6 +305,7 @@ static void updateReferences() {
     ADJUST_REF(vm.initString);
     ADJUST_REF(vm.arrayClass);
     ADJUST_REF(vm.dictClass);
+    ADJUST_REF(vm.stringBuilderClass);
 
 
     for (int i = 0; i < vHeap.aging.dirty.count; i++) {
@@ -326,11 +343,23 @@ static void updateReferences() {
 
     }
 
+    scanAndUpdateLarge();
 }
 
 static void clearMarkBits() {
-    uint8_t* start = vHeap.aging.from.start;
-    uint8_t* end = vHeap.aging.from.start + vHeap.aging.from.bytesAllocated;
+    // young objects get marked too while tracing from them, a stale
+    // mark would otherwise be carried along when they're promoted
+    uint8_t* start = vHeap.nursery.start;
+    uint8_t* end = vHeap.nursery.curr;
+
+    while (start < end) {
+        Obj* obj = (Obj*)start;
+        obj->isMarked = false;
+        start += obj->size;
+    }
+
+    start = vHeap.aging.from.start;
+    end = vHeap.aging.from.start + vHeap.aging.from.bytesAllocated;
 
     while (start < end) {
         Obj* obj = (Obj*)start;
@@ -346,6 +375,10 @@ static void clearMarkBits() {
         obj->isMarked = false;
         start += obj->size;
     }
+
+    for (LargeObject* large = vHeap.large.objects; large != NULL; large = large->next) {
+        ((Obj*)((uint8_t*)large + LARGE_HEADER_SIZE))->isMarked = false;
+    }
 }
 
 static void clearForwardings() {
@@ -368,6 +401,17 @@ static void clearForwardings() {
     }
 }
 
+// Arrays small enough to keep their elements inside the object point
+// into themselves, a copy has to be pointed at its own storage
+static inline void relocateInline(Obj* copy, Obj* original) {
+    if (copy->type != OBJ_ARRAY) return;
+
+    ObjArray* arr = (ObjArray*)copy;
+    ObjArray* from = (ObjArray*)original;
+    if (arr->values == from->inlined.values) arr->values = arr->inlined.values;
+    if (arr->numbers == from->inlined.numbers) arr->numbers = arr->inlined.numbers;
+}
+
 static void compactOldGen() {
     uint8_t* start = vHeap.oldGen.from.start;
     uint8_t* end = vHeap.oldGen.from.start + vHeap.oldGen.from.bytesAllocated;
@@ -383,8 +427,11 @@ static void compactOldGen() {
         if (curr->isMarked) {
             Obj* survived = writeHeap(&vHeap.oldGen.to, curr->size);
             memcpy(survived, curr, curr->size);
+            relocateInline(survived, curr);
             curr->forwarded = survived;
 
+        } else {
+            freeObjectStore(curr);
         }
 
         start += curr->size;
@@ -412,11 +459,13 @@ static void promoteObjects() {
         if (curr->age == PROMOTING_AGE) {
             Obj* oldObj = (Obj*)writeHeap(&vHeap.oldGen.from, curr->size);
             memcpy(oldObj, curr, curr->size);
+            relocateInline(oldObj, curr);
             curr->forwarded = oldObj;
 
         } else {
             Obj* young = (Obj*)writeHeap(&vHeap.aging.to, curr->size);
             memcpy(young, curr, curr->size);
+            relocateInline(young, curr);
             curr->forwarded = young;
             young->age++;
         }
@@ -441,16 +490,53 @@ size_t align(size_t size, size_t alignment) {
     return aligned;
 }
 
-void minorCollection();
-void* writeNursery(Nursery* nursery, size_t size) {
-    size_t aligned = align(size, ALIGNMENT);
+// Everything the program holds on to: young and old objects, and the
+// stores outside the heap they own
+size_t heapInUse() {
+    return (size_t)(vHeap.nursery.curr - vHeap.nursery.start)
+            + vHeap.aging.from.bytesAllocated
+            + vHeap.oldGen.from.bytesAllocated
+            + vHeap.large.bytesAllocated
+            + vHeap.externalBytes;
+}
 
-    if (vHeap.oldGen.from.bytesAllocated > vm.nextGC
+static void outOfMemory() {
+    fprintf(stderr, "Out of memory: heap limit of %zu MB exceeded.\n", vHeap.limit / MB(1));
+    exit(1);
+}
+
+// Called at the end of every collection
+static void countSurvivingStores() {
+    vHeap.survivingStores = vHeap.externalBytes;
+    vHeap.nextExternalGC = vHeap.externalBytes + EXTERNAL_GC_STEP;
+}
+
+void minorCollection();
+// Runs whatever collection is due before size more bytes are allocated
+static void collectIfNeeded(size_t aligned) {
+    if (vHeap.oldGen.from.bytesAllocated + vHeap.large.bytesAllocated
+            + vHeap.survivingStores > vm.nextGC
         && !vm.isCollecting) {
 
         majorCollection();
     }
 
+    // stores of young objects mostly die with them
+    if (vHeap.externalBytes > vHeap.nextExternalGC && !vm.isCollecting) {
+        minorCollection();
+    }
+
+    if (vHeap.limit != 0 && heapInUse() + aligned > vHeap.limit && !vm.isCollecting) {
+        minorCollection();
+        majorCollection();
+        if (heapInUse() + aligned > vHeap.limit) outOfMemory();
+    }
+}
+
+void* writeNursery(Nursery* nursery, size_t size) {
+    size_t aligned = align(size, ALIGNMENT);
+    collectIfNeeded(aligned);
+
     if ((nursery->curr + aligned) > (nursery->start + NURSERY_SIZE)) {
         if (vm.isCollecting) {
             fprintf(stderr, "FATAL: Nursery overflow while GC disabled\n");
@@ -464,6 +550,124 @@ void* writeNursery(Nursery* nursery, size_t size) {
     return result;
 }
 
+// Pages for the large object space, first fit from the free runs,
+// otherwise past top
+static uint8_t* allocatePages(size_t size) {
+    LargeSpace* large = &vHeap.large;
+    size = align(size, PAGE_SIZE);
+    uint8_t* result = NULL;
+
+    for (int i = 0; i < large->freeCount; i++) {
+        PageRun* run = &large->free[i];
+        if (run->size < size) continue;
+
+        result = run->start;
+        run->start += size;
+        run->size -= size;
+        if (run->size == 0) {
+            memmove(run, run + 1, sizeof(PageRun) * (large->freeCount - i - 1));
+            large->freeCount--;
+        }
+        break;
+    }
+
+    if (result == NULL) {
+        if (large->top + size > large->start + LARGE_SPACE_SIZE) {
+            printf("Not enough virtual space for %zu bytes in the large object space.\nExiting process...", size);
+            exit(1);
+        }
+        result = large->top;
+        large->top += size;
+    }
+
+    if (!commit(result, size)) {
+        printf("Large object space commit failed. Exiting process...\n");
+        exit(1);
+    }
+    return result;
+}
+
+static void freePages(uint8_t* start, size_t size) {
+    LargeSpace* large = &vHeap.large;
+    size = align(size, PAGE_SIZE);
+    decommit(start, size);
+
+    int i = 0;
+    while (i < large->freeCount && large->free[i].start < start) i++;
+
+    bool joinsPrev = i > 0 && large->free[i - 1].start + large->free[i - 1].size == start;
+    bool joinsNext = i < large->freeCount && start + size == large->free[i].start;
+
+    if (joinsPrev && joinsNext) {
+        large->free[i - 1].size += size + large->free[i].size;
+        memmove(&large->free[i], &large->free[i + 1], sizeof(PageRun) * (large->freeCount - i - 1));
+        large->freeCount--;
+    } else if (joinsPrev) {
+        large->free[i - 1].size += size;
+    } else if (joinsNext) {
+        large->free[i].start = start;
+        large->free[i].size += size;
+    } else {
+        if (large->freeCapacity < large->freeCount + 1) {
+            large->freeCapacity = GROW_CAPACITY(large->freeCapacity);
+            large->free = realloc(large->free, sizeof(PageRun) * large->freeCapacity);
+
+            if (large->free == NULL) {
+                printf("Failed to realloc large.free\n");
+                exit(1);
+            }
+        }
+
+        memmove(&large->free[i + 1], &large->free[i], sizeof(PageRun) * (large->freeCount - i));
+        large->free[i].start = start;
+        large->free[i].size = size;
+        large->freeCount++;
+    }
+
+    // a run ending at top goes back to it
+    PageRun* last = &large->free[large->freeCount - 1];
+    if (last->start + last->size == large->top) {
+        large->top = last->start;
+        large->freeCount--;
+    }
+}
+
+// Objects past LARGE_OBJECT_SIZE skip the nursery: copying them around
+// costs more than a page granular allocation, and they could fill it
+// up on their own. They stay where they are until a major collection
+// finds them dead
+void* writeLargeSpace(size_t size) {
+    size_t aligned = align(size, ALIGNMENT);
+    collectIfNeeded(aligned);
+
+    LargeObject* large = (LargeObject*)allocatePages(LARGE_HEADER_SIZE + aligned);
+    large->size = align(LARGE_HEADER_SIZE + aligned, PAGE_SIZE);
+    large->next = vHeap.large.objects;
+    vHeap.large.objects = large;
+    vHeap.large.bytesAllocated += large->size;
+
+    return (uint8_t*)large + LARGE_HEADER_SIZE;
+}
+
+static void sweepLargeSpace() {
+    LargeObject** link = &vHeap.large.objects;
+
+    while (*link != NULL) {
+        LargeObject* large = *link;
+        Obj* obj = (Obj*)((uint8_t*)large + LARGE_HEADER_SIZE);
+
+        if (obj->isMarked) {
+            link = &large->next;
+            continue;
+        }
+
+        *link = large->next;
+        freeObjectStore(obj);
+        vHeap.large.bytesAllocated -= large->size;
+        freePages((uint8_t*)large, large->size);
+    }
+}
+
 static void growOldGen(size_t newSize) {
     size_t pageAligned = align(newSize, PAGE_SIZE);
 
@@ -540,7 +744,7 @@ void markDirty(Obj* obj) {
         vHeap.aging.dirty.objects[vHeap.aging.dirty.count++] = obj;
         obj->isDirty = true;
 
-    } else if (IS_IN_OLD(obj)) {
+    } else if (IS_IN_OLD(obj) || IS_IN_LARGE(obj)) {
 
         if (vHeap.oldGen.dirty.capacity < vHeap.oldGen.dirty.count + 1) {
             vHeap.oldGen.dirty.capacity = GROW_CAPACITY(vHeap.oldGen.dirty.capacity);
@@ -565,7 +769,7 @@ static Obj* copyObject(Obj* obj) {
             (void*)obj, objTypeName(obj->type), obj->size, obj->age, (void*)obj->forwarded);
 #endif
 
-    if (IS_IN_AGING(obj) || IS_IN_OLD(obj)) {
+    if (IS_IN_AGING(obj) || IS_IN_OLD(obj) || IS_IN_LARGE(obj)) {
 #ifdef DEBUG_LOG_GC
         fprintf(stderr, "[GC] copyObject: is in aging or oldGen %p\n", (void*)obj->forwarded);
 #endif
@@ -586,6 +790,7 @@ static Obj* copyObject(Obj* obj) {
             (void*)newObj, (void*)obj, obj->size);
 #endif
     memcpy(newObj, obj, obj->size);
+    relocateInline(newObj, obj);
     newObj->forwarded = NULL;
 
 #ifdef DEBUG_LOG_GC
@@ -601,7 +806,8 @@ static void copyValue(Value* value) {
     fprintf(stderr, "[GC] copyValue: slot=%p type=%d\n", (void*)value, value->type);
 #endif
     if (value->type != VAL_OBJ) return;
-    if (IS_IN_AGING(AS_OBJ(*value)) || IS_IN_OLD(AS_OBJ(*value))) return;
+    if (IS_IN_AGING(AS_OBJ(*value)) || IS_IN_OLD(AS_OBJ(*value))
+        || IS_IN_LARGE(AS_OBJ(*value))) return;
 
     Obj* old = AS_OBJ(*value);
 #ifdef DEBUG_LOG_GC
@@ -643,6 +849,16 @@ static void copyTable(Table* table) {
 #endif
 }
 
+static void copyDict(Dict* dict) {
+    for (int i = 0; i < dict->used; i++) {
+        DictEntry* entry = &dict->entries[i];
+        if (IS_DICT_HOLE(entry->key)) continue;
+
+        copyValue(&entry->key);
+        copyValue(&entry->value);
+    }
+}
+
 static void copyArray(ValueArray* arr) {
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "[GC] copyArray: arr=%p count=%d values=%p\n",
@@ -662,7 +878,11 @@ static void copyArray(ValueArray* arr) {
 static void scanObjectFields(Obj* obj) {
     switch (obj->type) {
         case OBJ_UPVALUE: {
-            copyValue(&((ObjUpvalue*)obj)->closed);
+            ObjUpvalue* upvalue = (ObjUpvalue*)obj;
+            copyValue(&upvalue->closed);
+            if (upvalue->next != NULL) {
+                upvalue->next = (ObjUpvalue*)copyObject((Obj*)upvalue->next);
+            }
             break;
         }
         case OBJ_FUNCTION: {
@@ -692,19 +912,16 @@ static void scanObjectFields(Obj* obj) {
         }
         case OBJ_DICTIONARY: {
             ObjDictionary* dict = (ObjDictionary*)obj;
-            copyTable(&dict->map);
-            for (int j = 0; j < dict->entries.count; j++) {
-                dict->entries.entries[j].key =
-                    (ObjString*)copyObject((Obj*)dict->entries.entries[j].key);
-                copyValue(&dict->entries.entries[j].value);
-            }
+            copyDict(&dict->map);
 
             dict->klass = (ObjClass*)copyObject((Obj*)dict->klass);
             break;
         }
         case OBJ_ARRAY: {
             ObjArray* arr = (ObjArray*)obj;
-            copyArray(&arr->values);
+            for (int i = 0; !arr->isPacked && i < arr->count; i++) {
+                copyValue(&arr->values[i]);
+            }
             arr->klass = (ObjClass*)copyObject((Obj*)arr->klass);
             break;
         }
@@ -727,6 +944,11 @@ static void scanObjectFields(Obj* obj) {
             bound->method = (ObjClosure*)copyObject((Obj*)bound->method);
             break;
         }
+        case OBJ_STRING_BUILDER: {
+            ObjStringBuilder* builder = (ObjStringBuilder*)obj;
+            builder->klass = (ObjClass*)copyObject((Obj*)builder->klass);
+            break;
+        }
         case OBJ_NATIVE:
         case OBJ_STRING:
         case OBJ_RANGE:
@@ -758,6 +980,19 @@ static void scanOldGenerations() {
 
 }
 
+// Survivors were copied out and left forwarded, anything else is dead and
+// its stores can go before the nursery is reused
+static void freeDeadNursery() {
+    uint8_t* start = vHeap.nursery.start;
+    uint8_t* end = vHeap.nursery.curr;
+
+    while (start < end) {
+        Obj* obj = (Obj*)start;
+        if (obj->forwarded == NULL) freeObjectStore(obj);
+        start += obj->size;
+    }
+}
+
 static void copyReferences() {
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "[GC] copyReferences: worklist.count=%d\n", vHeap.worklist.count);
@@ -775,6 +1010,7 @@ static void copyReferences() {
 void minorCollection() {
     vm.isCollecting = true;
     vm.isInMinor = true;
+    vHeap.collections++;
 
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "\n[GC] ===== Minor collection begin =====\n");
@@ -813,8 +1049,13 @@ void minorCollection() {
 #ifdef DEBUG_LOG_GC
     for (int i = 0; i < 5000; i++) fprintf(stderr, "[GC] Roots: openUpvalues head=%p\n", (void*)vm.openUpvalues);
 #endif
-    for (ObjUpvalue* upvalue = NULL; vm.openUpvalues != NULL; upvalue = upvalue->next) {
-        copyObject((Obj*)upvalue);
+    for (ObjUpvalue** upvalue = &vm.openUpvalues; *upvalue != NULL; upvalue = &(*upvalue)->next) {
+        *upvalue = (ObjUpvalue*)copyObject((Obj*)*upvalue);
+    }
+
+    // functions being compiled are only referenced by their compilers
+    for (Compiler* compiler = compilerChain(); compiler != NULL; compiler = compiler->enclosing) {
+        compiler->function = (ObjFunction*)copyObject((Obj*)compiler->function);
     }
 
 
@@ -841,11 +1082,6 @@ void minorCollection() {
 #endif
     copyTable(&vm.constGlobals);
 
-#ifdef DEBUG_LOG_GC
-    for (int i = 0; i < 5000; i++) fprintf(stderr, "[GC ROOT] Roots: strings\n");
-#endif
-    copyTable(&vm.strings);
-
 
     ObjString* oldArr = vm.array_NativeString;
     vm.array_NativeString = (ObjString*)copyObject((Obj*)vm.array_NativeString);
@@ -877,14 +1113,22 @@ void minorCollection() {
     for (int i = 0; i < 5000; i++) fprintf(stderr, "[GC ROOT] Root dictClass: old=%p -> new=%p\n", (void*)oldDictClass, (void*)vm.dictClass);
 #endif
 
+    vm.stringBuilderClass = (ObjClass*)copyObject((Obj*)vm.stringBuilderClass);
+
     scanOldGenerations();
     copyReferences();
 
+    // vm.strings isn't a root: interned strings survive only if
+    // something else reached them during the copy
+    tableSweepNursery(&vm.strings);
+
+    freeDeadNursery();
     vHeap.nursery.curr = vHeap.nursery.start;
     promoteObjects();
 
     clearForwardings();
-    initValueArray(&vHeap.worklist);
+    freeValueArray(&vHeap.worklist);
+    countSurvivingStores();
 
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "[GC] Nursery after reset: curr=%p used=0 free=%zu\n",
@@ -964,25 +1208,115 @@ void initGenHeap() {
     vHeap.oldGen.dirty.objects = realloc(vHeap.oldGen.dirty.objects, sizeof(Obj*) * vHeap.oldGen.dirty.capacity);
 
 
+    vHeap.large.start = (uint8_t*)reserve(LARGE_SPACE_SIZE);
+    if (vHeap.large.start == NULL) {
+        printf("Large object space reserve failed. Exiting process...\n");
+        exit(1);
+    }
+    vHeap.large.top = vHeap.large.start;
+
     initValueArray(&vHeap.worklist);
+    vHeap.nextExternalGC = EXTERNAL_GC_STEP;
+}
+
+// Size class of a small store, or -1 when it's left to malloc
+static inline int storeClass(size_t size) {
+    if (size == 0 || size > STORE_GRANULE * STORE_CLASSES) return -1;
+    return (int)((size - 1) / STORE_GRANULE);
+}
+
+static void* allocateStore(int sizeClass) {
+    StoreBlock* block = vHeap.freeStores[sizeClass];
+    if (block != NULL) {
+        vHeap.freeStores[sizeClass] = block->next;
+        return block;
+    }
+
+    // the rest of a chunk too small for this class is left unused
+    size_t size = (size_t)(sizeClass + 1) * STORE_GRANULE;
+    if (vHeap.storeChunkLeft < size) {
+        vHeap.storeChunk = malloc(STORE_CHUNK_SIZE);
+        if (vHeap.storeChunk == NULL) {
+            printf("Store chunk allocation failed");
+            exit(1);
+        }
+        vHeap.storeChunkLeft = STORE_CHUNK_SIZE;
+    }
+
+    void* result = vHeap.storeChunk;
+    vHeap.storeChunk += size;
+    vHeap.storeChunkLeft -= size;
+    return result;
+}
+
+static inline void freeStore(void* ptr, int sizeClass) {
+    StoreBlock* block = (StoreBlock*)ptr;
+    block->next = vHeap.freeStores[sizeClass];
+    vHeap.freeStores[sizeClass] = block;
+}
+
+static inline bool isLargeStore(size_t size) {
+    return size > LARGE_OBJECT_SIZE;
+}
+
+static void releaseStore(void* ptr, size_t size, int sizeClass) {
+    if (sizeClass >= 0) freeStore(ptr, sizeClass);
+    else if (isLargeStore(size)) freePages(ptr, size);
+    else free(ptr);
 }
 
+// All backing stores go through here, callers pass the exact size they
+// allocated so small stores find their class again, and large ones
+// their pages
 void* reallocate(void* ptr, size_t oldSize, size_t newSize) {
+    vHeap.externalBytes += newSize;
+    vHeap.externalBytes -= oldSize;
+
+    // callers hold pointers into objects, so there's no collecting here:
+    // stores alone past the limit can't be brought back under it anyway
+    if (vHeap.limit != 0 && newSize > oldSize && vHeap.externalBytes > vHeap.limit) {
+        outOfMemory();
+    }
+
+    int oldClass = ptr == NULL ? -1 : storeClass(oldSize);
+    int newClass = storeClass(newSize);
+    bool wasLarge = ptr != NULL && isLargeStore(oldSize);
 
     if (newSize == 0) {
-        free(ptr);
+        if (ptr != NULL) releaseStore(ptr, oldSize, oldClass);
         return NULL;
     }
 
-    void* result = realloc(ptr, newSize);
+    if (oldClass < 0 && newClass < 0 && !wasLarge && !isLargeStore(newSize)) {
+        void* result = realloc(ptr, newSize);
+        if (result == NULL) {
+            printf("realloc didn't realloc");
+            exit(1);
+        }
+        return result;
+    }
+
+    if (oldClass >= 0 && oldClass == newClass) return ptr;
+    if (wasLarge && isLargeStore(newSize)
+        && align(oldSize, PAGE_SIZE) == align(newSize, PAGE_SIZE)) return ptr;
+
+    void* result;
+    if (newClass >= 0) result = allocateStore(newClass);
+    else if (isLargeStore(newSize)) result = allocatePages(newSize);
+    else result = malloc(newSize);
+
     if (result == NULL) {
         printf("realloc didn't realloc");
         exit(1);
     }
+
+    if (ptr != NULL) {
+        memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+        releaseStore(ptr, oldSize, oldClass);
+    }
     return result;
 }
 
-
 void clearDirtyBits() {
     uint8_t* ptr = vHeap.aging.from.start;
     while (ptr < vHeap.aging.from.start + vHeap.aging.from.bytesAllocated) {
@@ -1041,6 +1375,16 @@ void markTable(Table* table) {
     }
 }
 
+void markDict(Dict* dict) {
+    for (int i = 0; i < dict->used; i++) {
+        DictEntry* entry = &dict->entries[i];
+        if (IS_DICT_HOLE(entry->key)) continue;
+
+        markValue(entry->key);
+        markValue(entry->value);
+    }
+}
+
 void markArray(ValueArray* arr) {
     for (int i = 0; i < arr->count; i++) {
         markValue(arr->values[i]);
@@ -1087,20 +1431,18 @@ static void blackenObject(Obj* obj) {
 #ifdef DEBUG_LOG_GC
             // fprintf(stderr, "  -> mark dictionary map\n");
 #endif
-            markTable(&dict->map);
-            for (int i = 0; i < dict->entries.count; i++) {
-                markObj((Obj*)dict->entries.entries[i].key);
-                markValue(dict->entries.entries[i].value);
-            }
+            markDict(&dict->map);
             markObj((Obj*)dict->klass);
             break;
         }
         case OBJ_ARRAY: {
             ObjArray* arr = (ObjArray*)obj;
 #ifdef DEBUG_LOG_GC
-            // fprintf(stderr, "  -> mark array values (%d)\n", ((ObjArray*)obj)->values.count);
+            // fprintf(stderr, "  -> mark array values (%d)\n", ((ObjArray*)obj)->count);
 #endif
-            markArray(&arr->values);
+            for (int i = 0; !arr->isPacked && i < arr->count; i++) {
+                markValue(arr->values[i]);
+            }
             markObj((Obj*)arr->klass);
             break;
         }
@@ -1123,6 +1465,10 @@ static void blackenObject(Obj* obj) {
             markObj((Obj*)bound->method);
             break;
         }
+        case OBJ_STRING_BUILDER: {
+            markObj((Obj*)((ObjStringBuilder*)obj)->klass);
+            break;
+        }
         case OBJ_NATIVE:
         case OBJ_STRING:
         case OBJ_RANGE:
@@ -1144,10 +1490,12 @@ static void markRoots() {
     }
 
     // traversing upvalue linked list
-    for (ObjUpvalue* upvalue = NULL; vm.openUpvalues != NULL; upvalue = upvalue->next) {
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
         markObj((Obj*)upvalue);
     }
 
+    markCompilerRoots();
+
     for (int i = 0; i <= vm.nestingLevel; i++) {
         for (int j = 0; j < vm.queueCount[i]; j++) {
             markValue(vm.queue[i].values[j]);
@@ -1156,12 +1504,12 @@ static void markRoots() {
 
     markTable(&vm.globals);
     markTable(&vm.constGlobals);
-    markTable(&vm.strings);
     markObj((Obj*)vm.array_NativeString);
     markObj((Obj*)vm.dict_NativeString);
     markObj((Obj*)vm.initString);
     markObj((Obj*)vm.dictClass);
     markObj((Obj*)vm.arrayClass);
+    markObj((Obj*)vm.stringBuilderClass);
 }
 
 static const char* typeName(ObjType type) {
@@ -1174,6 +1522,7 @@ static const char* typeName(ObjType type) {
         case OBJ_UPVALUE:    return "upvalue";
         case OBJ_DICTIONARY: return "dictionary";
         case OBJ_CLASS:      return "class";
+        case OBJ_STRING_BUILDER: return "string builder";
         default:             return "unknown";
     }
 }
@@ -1186,7 +1535,20 @@ static void traceReferences() {
     }
 }
 
+// Dead old objects can still be waiting in the dirty list, they'd be
+// scanned by the next minor collection after their memory is gone
+static void pruneDirty() {
+    int kept = 0;
+    for (int i = 0; i < vHeap.oldGen.dirty.count; i++) {
+        Obj* obj = vHeap.oldGen.dirty.objects[i];
+        if (obj->isMarked) vHeap.oldGen.dirty.objects[kept++] = obj;
+    }
+    vHeap.oldGen.dirty.count = kept;
+}
+
 static void sweep() {
+    pruneDirty();
+    sweepLargeSpace();
     compactOldGen();
 }
 
@@ -1218,15 +1580,21 @@ void majorCollection() {
 #endif
     vm.isCollecting = true;
     vm.isInMajor = true;
-    size_t before = vHeap.oldGen.from.bytesAllocated;
+    vHeap.collections++;
+    size_t before = vHeap.oldGen.from.bytesAllocated + vHeap.large.bytesAllocated
+                    + vHeap.externalBytes;
 
     markFromYoung();
     markRoots();
     traceReferences();
+    tableRemoveWhite(&vm.strings);
     sweep();
 
-    size_t survived = vHeap.oldGen.from.bytesAllocated;
-    double rate = (double)(survived / before);
+    size_t survived = vHeap.oldGen.from.bytesAllocated + vHeap.large.bytesAllocated
+                    + vHeap.externalBytes;
+    countSurvivingStores();
+    // collections can now start with an empty old generation
+    double rate = before == 0 ? 1 : (double)survived / before;
 
     if (rate > 0.75) {
         vm.nextGC = survived * 4;
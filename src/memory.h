@@ -33,6 +33,40 @@ typedef struct {
     DirtyObjects dirty;
 } SemiSpace;
 
+// A free small store, linked through its first word
+typedef struct StoreBlock {
+    struct StoreBlock* next;
+} StoreBlock;
+
+// A run of free pages in the large object space
+typedef struct {
+    uint8_t* start;
+    size_t size;
+} PageRun;
+
+// Sits in front of every large object, in the same pages
+typedef struct LargeObject {
+    struct LargeObject* next;
+    size_t size; // of the pages, header included
+} LargeObject;
+
+// Objects too big to be worth copying, and the biggest stores: each
+// gets whole pages, taken first fit from the free runs or past top.
+// Nothing here is ever moved, and freed pages are decommitted
+typedef struct {
+    uint8_t* start;
+    uint8_t* top;
+    size_t bytesAllocated; // by objects, stores count as external
+    LargeObject* objects;
+    PageRun* free; // sorted by address, neighbours are merged
+    int freeCount;
+    int freeCapacity;
+} LargeSpace;
+
+#define STORE_GRANULE 16
+#define STORE_CLASSES 64 // small stores are up to 1KB
+#define STORE_CHUNK_SIZE KB(256)
+
 typedef struct {
     uint8_t* baseAddr;
     size_t reservedSize;
@@ -51,12 +85,39 @@ typedef struct {
 
     size_t builtInOffset;
     Heap builtIn;
+
+    LargeSpace large;
+
+    // bumped by every collection: past it, objects may have moved
+    uint32_t collections;
+
+    // Backing stores (elements, entries, bytecode) are malloc'd outside
+    // the spaces above, but owned by their objects: they're freed when
+    // the owner is collected and count toward the next collection
+    size_t externalBytes;
+    size_t nextExternalGC;
+    // left after the last collection: mostly held by old objects, so
+    // they count toward a major one
+    size_t survivingStores;
+    // 0 when unlimited
+    size_t limit;
+
+    // Small stores come from free lists per size class, carved out of
+    // larger chunks: collections free them by the thousand
+    StoreBlock* freeStores[STORE_CLASSES];
+    uint8_t* storeChunk;
+    size_t storeChunkLeft;
 } GenerationalHeap;
 
 extern GenerationalHeap vHeap;
 
 #define FRAMES_INIT_CAPACITY 64
+#define FRAMES_MAX (1 << 20)
 #define STACK_INIT_CAPACITY (FRAMES_INIT_CAPACITY * UINT8_COUNT)
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// committed past how deep a frame's own code reaches, for the natives it
+// calls: what they push, and the callee and arguments of their callbacks
+#define NATIVE_STACK_ROOM 32
 
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * count)
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
@@ -82,6 +143,12 @@ extern GenerationalHeap vHeap;
 #define BUILTIN_SIZE MB(10)
 #define OLDGEN_SIZE (RESERVED_SIZE - 2 * AGING_SIZE - NURSERY_SIZE - BUILTIN_SIZE)
 #define OLDGEN_INITIAL_COMMIT (OLDGEN_SIZE / 16)
+#define LARGE_SPACE_SIZE GB(8)
+// objects and stores past it go to the large object space
+#define LARGE_OBJECT_SIZE KB(64)
+#define LARGE_HEADER_SIZE ALIGNMENT
+// new stores worth a minor collection
+#define EXTERNAL_GC_STEP NURSERY_SIZE
 #define ALIGNMENT 32
 #define PROMOTING_AGE 3
 
@@ -94,19 +161,27 @@ extern GenerationalHeap vHeap;
 #define IS_IN_OLD(obj) \
                 ((uint8_t*)obj >= vHeap.oldGen.from.start \
                             && (uint8_t*)obj < vHeap.oldGen.from.start + vHeap.oldGen.from.bytesAllocated)
+#define IS_IN_LARGE(obj) \
+                ((uint8_t*)obj >= vHeap.large.start \
+                            && (uint8_t*)obj < vHeap.large.top)
 
 void* reallocate(void* ptr, size_t oldSize, size_t newSize);
 void markObj(Obj* obj);
 void markValue(Value slot);
 void markTable(Table* table);
+void markDict(Dict* dict);
 void majorCollection();
 void minorCollection();
 void freeObjects();
 void initGenHeap();
 void* writeNursery(Nursery* nursery, size_t size);
 void* writeHeap(Heap* heap, size_t size);
+void* writeLargeSpace(size_t size);
 void markDirty(Obj* obj);
+void* reserve(size_t size);
+bool commit(void* addr, size_t size);
 void release(void* addr, size_t size);
 size_t align(size_t size, size_t alignment);
+size_t heapInUse();
 const char* objTypeName(int t);
 #endif
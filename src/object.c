@@ -9,7 +9,9 @@
 #define ALLOCATE_OBJ(type, objectType) ((type*)allocateObject(sizeof(type), objectType))
 
 Obj* allocateObject(size_t size, ObjType type) {
-    Obj* obj = (Obj*)writeNursery(&vHeap.nursery, size);
+    bool isLarge = size > LARGE_OBJECT_SIZE;
+    Obj* obj = isLarge ? (Obj*)writeLargeSpace(size)
+                       : (Obj*)writeNursery(&vHeap.nursery, size);
     // Obj* obj = reallocate(NULL, 0, size);
     obj->type = type;
     obj->isMarked = false;
@@ -18,6 +20,10 @@ Obj* allocateObject(size_t size, ObjType type) {
     obj->size = align(size, ALIGNMENT);
     obj->forwarded = NULL;
 
+    // large objects are old from the start, the fields they're about to
+    // be given may point into the nursery without a write barrier
+    if (isLarge) markDirty(obj);
+
     return obj;
 }
 
@@ -27,6 +33,7 @@ ObjFunction* newFunction() {
 
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStack = 0;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
@@ -36,75 +43,233 @@ ObjArray* newArray() {
     ObjArray* arr = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
 
     arr->type = VAL_NIL;
-    arr->values.values = NULL;
-    arr->values.count = 0;
-    arr->values.capacity = 0;
+    arr->count = 0;
+    arr->isPacked = false;
+    arr->shared = NULL;
+    arr->values = arr->inlined.values;
+    arr->numbers = NULL;
+    arr->capacity = ARRAY_INLINE_VALUES;
+    // read after allocating, a collection may have moved the class
+    arr->klass = vm.arrayClass;
+
+    return arr;
+}
 
-    Value arrClass;
-    if (!tableGet(&vm.globals, vm.array_NativeString, &arrClass)) {
-        runtimeError("Native class '%s' not found", vm.array_NativeString->chars);
+// Points an array back at the storage inside it, in its representation
+static void useInlineStore(ObjArray* arr) {
+    if (arr->isPacked) {
+        arr->values = NULL;
+        arr->numbers = arr->inlined.numbers;
+        arr->capacity = ARRAY_INLINE_NUMBERS;
+    } else {
+        arr->values = arr->inlined.values;
+        arr->numbers = NULL;
+        arr->capacity = ARRAY_INLINE_VALUES;
     }
-    arr->klass = AS_CLASS(arrClass);
+}
 
-    return arr;
+// Lets go of shared storage, freeing it if no other array still uses it
+static void releaseSharedStore(ArrayStore* store) {
+    if (--store->refCount > 0) return;
+
+    if (store->isPacked) FREE_ARRAY(double, store->base, store->capacity);
+    else FREE_ARRAY(Value, store->base, store->capacity);
+    FREE(ArrayStore, store);
+}
+
+static void freeArrayStore(ObjArray* arr) {
+    if (arr->shared != NULL) {
+        releaseSharedStore(arr->shared);
+        arr->shared = NULL;
+    } else if (!isArrayInline(arr)) {
+        if (arr->isPacked) FREE_ARRAY(double, arr->numbers, arr->capacity);
+        else FREE_ARRAY(Value, arr->values, arr->capacity);
+    }
+
+    useInlineStore(arr);
+}
+
+// Moves the elements to storage with room for capacity of them, out of
+// the object if they were still inline
+static void growArrayStore(ObjArray* arr, int capacity) {
+    if (isArrayInline(arr)) {
+        if (arr->isPacked) {
+            double* numbers = ALLOCATE(double, capacity);
+            memcpy(numbers, arr->numbers, sizeof(double) * arr->count);
+            arr->numbers = numbers;
+        } else {
+            Value* values = ALLOCATE(Value, capacity);
+            memcpy(values, arr->values, sizeof(Value) * arr->count);
+            arr->values = values;
+        }
+    } else if (arr->isPacked) {
+        arr->numbers = GROW_ARRAY(double, arr->numbers, arr->capacity, capacity);
+    } else {
+        arr->values = GROW_ARRAY(Value, arr->values, arr->capacity, capacity);
+    }
+    arr->capacity = capacity;
+}
+
+// Gives arr a private copy of the count elements at numbers or values
+static void copyIntoArray(ObjArray* arr, double* numbers, Value* values, int count) {
+    useInlineStore(arr);
+    if (count > arr->capacity) {
+        if (arr->isPacked) arr->numbers = ALLOCATE(double, count);
+        else arr->values = ALLOCATE(Value, count);
+        arr->capacity = count;
+    }
+
+    if (arr->isPacked) memcpy(arr->numbers, numbers, sizeof(double) * count);
+    else memcpy(arr->values, values, sizeof(Value) * count);
+    arr->count = count;
+}
+
+// Copy on write: gives a shared array storage of its own, holding just
+// its elements
+void unshareArray(ObjArray* arr) {
+    ArrayStore* store = arr->shared;
+    arr->shared = NULL;
+    copyIntoArray(arr, arr->numbers, arr->values, arr->count);
+    releaseSharedStore(store);
+}
+
+// Turns the empty array slice into a view of arr's elements start to end,
+// excluding end. Elements are not copied, each array copies the storage
+// only once it's written to. Slices small enough to be inline are copied
+// right away, as is anything taken from inline storage, which moves
+// along with its array
+void sliceArray(ObjArray* slice, ObjArray* arr, int start, int end) {
+    freeArrayStore(slice);
+    slice->type = arr->type;
+    slice->isPacked = arr->isPacked;
+
+    int count = end - start;
+    double* numbers = arr->isPacked ? arr->numbers + start : NULL;
+    Value* values = arr->isPacked ? NULL : arr->values + start;
+
+    int inlineCapacity = arr->isPacked ? ARRAY_INLINE_NUMBERS : ARRAY_INLINE_VALUES;
+    if (count <= inlineCapacity || isArrayInline(arr)) {
+        copyIntoArray(slice, numbers, values, count);
+        return;
+    }
+
+    if (arr->shared == NULL) {
+        ArrayStore* store = ALLOCATE(ArrayStore, 1);
+        store->refCount = 1;
+        store->capacity = arr->capacity;
+        store->isPacked = arr->isPacked;
+        store->base = arr->isPacked ? (void*)arr->numbers : (void*)arr->values;
+        arr->shared = store;
+    }
+
+    slice->numbers = numbers;
+    slice->values = values;
+    slice->count = count;
+    slice->capacity = count;
+    slice->shared = arr->shared;
+    slice->shared->refCount++;
+}
+
+// An empty array takes the type of its first element, and with it the
+// packed or boxed representation
+static void retypeArray(ObjArray* arr, ValueType type) {
+    bool packed = type == VAL_NUMBER;
+    if (packed != arr->isPacked) {
+        // room reserved up front is kept, in the new representation
+        int capacity = arr->shared != NULL || isArrayInline(arr) ? 0 : arr->capacity;
+        freeArrayStore(arr);
+        arr->isPacked = packed;
+        useInlineStore(arr);
+
+        if (capacity > arr->capacity) growArrayStore(arr, capacity);
+    }
+    arr->type = type;
+}
+
+// Makes room for at least capacity elements of the given type without
+// changing the count. Fails when a non-empty array holds another type
+bool reserveArray(ObjArray* arr, ValueType type, int capacity) {
+    if (arr->count == 0) {
+        retypeArray(arr, type);
+    }
+    if (type != arr->type) {
+        return false;
+    }
+    makeArrayWritable(arr);
+    if (capacity > arr->capacity) {
+        growArrayStore(arr, capacity);
+    }
+    return true;
 }
 
 bool appendArray(ObjArray* arr, Value value) {
-    if (arr->values.count == 0) {
-        arr->type = value.type;
+    if (arr->count == 0) {
+        retypeArray(arr, value.type);
     }
     if (value.type != arr->type) {
         // error, vm handles this
         return false;
     }
+    makeArrayWritable(arr);
 
-    push(OBJ_VAL(arr));
-    writeValueArray(&arr->values, value);
-    pop();
+    if (arr->capacity < arr->count + 1) {
+        growArrayStore(arr, GROW_CAPACITY(arr->capacity));
+    }
 
-    markDirty((Obj*)arr);
+    if (arr->isPacked) {
+        arr->numbers[arr->count++] = AS_NUMBER(value);
+    } else {
+        arr->values[arr->count++] = value;
+        markDirty((Obj*)arr);
+    }
     return true;
 }
 
 Value arrayPop(ObjArray* arr) {
-    if (arr->values.count == 0) {
+    if (arr->count == 0) {
         return NUMBER_VAL(0);
     }
 
-    markDirty((Obj*)arr);
-    return arr->values.values[--arr->values.count];
+    return arrayElement(arr, --arr->count);
 }
 
 bool arraySet(ObjArray* arr, int index, Value value) {
-    if (index < 0 || index >= arr->values.count || value.type != arr->type) {
+    if (index < 0 || index >= arr->count || value.type != arr->type) {
         return false;
     }
+    makeArrayWritable(arr);
 
-    arr->values.values[index] = value;
-    markDirty((Obj*)arr);
+    if (arr->isPacked) {
+        arr->numbers[index] = AS_NUMBER(value);
+    } else {
+        arr->values[index] = value;
+        markDirty((Obj*)arr);
+    }
     return true;
 }
 
 bool arrayGet(ObjArray* arr, int index, Value* value) {
-    if (index < 0 || index > arr->values.count) {
+    if (index < 0 || index >= arr->count) {
         return false;
     }
 
-    *value = arr->values.values[index];
+    *value = arrayElement(arr, index);
     return true;
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-
-    for (int i = 0; i <= function->upvalueCount - 1; i++) {
-        upvalues[i] = NULL;
+    int upvalueCount = function->upvalueCount;
+    // keep the function rooted: the allocation may move it
+    push(OBJ_VAL(function));
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * upvalueCount, OBJ_CLOSURE);
+
+    for (int i = 0; i < upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
     }
 
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
-    closure->function = function;
+    closure->upvalueCount = upvalueCount;
+    closure->function = AS_FUNCTION(pop());
     return closure;
 }
 
@@ -126,16 +291,8 @@ ObjUpvalue* newUpvalue(Value* slot) {
 ObjDictionary* newDictionary() {
     ObjDictionary* dict = ALLOCATE_OBJ(ObjDictionary, OBJ_DICTIONARY);
 
-    initTable(&dict->map);
-    initEntryList(&dict->entries);
-    Value dictClass;
-
-    if (!tableGet(&vm.globals, vm.dict_NativeString, &dictClass)) {
-        runtimeError("Native class '%s' not found", vm.dict_NativeString->chars);
-    }
-
-    dict->klass = AS_CLASS(dictClass);
-    // printf("Created an instance of %s\n")
+    initDict(&dict->map);
+    dict->klass = vm.dictClass;
     return dict;
 }
 
@@ -147,6 +304,31 @@ ObjRange* newRange(double start, double end) {
     return range;
 }
 
+ObjStringBuilder* newStringBuilder() {
+    ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+    builder->klass = vm.stringBuilderClass;
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->chars = NULL;
+    return builder;
+}
+
+void appendStringBuilder(ObjStringBuilder* builder, const char* chars, int length) {
+    // +1 keeps the buffer null terminated so it can be printed directly
+    if (builder->capacity < builder->length + length + 1) {
+        int oldCapacity = builder->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity < builder->length + length + 1) capacity *= 2;
+
+        builder->chars = GROW_ARRAY(char, builder->chars, oldCapacity, capacity);
+        builder->capacity = capacity;
+    }
+
+    memcpy(builder->chars + builder->length, chars, length);
+    builder->length += length;
+    builder->chars[builder->length] = '\0';
+}
+
 ObjClass* newClass(ObjString* name) {
     ObjClass* cclass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     cclass->name = name;
@@ -156,9 +338,11 @@ ObjClass* newClass(ObjString* name) {
 }
 
 ObjInstance* newInstance(ObjClass* klass) {
+    // keep the class rooted: the allocation may move it
+    push(OBJ_VAL(klass));
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     initTable(&instance->fields);
-    instance->klass = klass;
+    instance->klass = AS_CLASS(pop());
     return instance;
 }
 
@@ -169,8 +353,109 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     return bound;
 }
 
+// Frees what a dead object kept outside the heap. The collector calls it
+// for every object it doesn't keep, the object itself goes with its space
+void freeObjectStore(Obj* obj) {
+    switch (obj->type) {
+        case OBJ_FUNCTION:
+            freeChunk(&((ObjFunction*)obj)->chunk);
+            break;
+        case OBJ_ARRAY:
+            freeArrayStore((ObjArray*)obj);
+            break;
+        case OBJ_DICTIONARY:
+            freeDict(&((ObjDictionary*)obj)->map);
+            break;
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)obj;
+            freeTable(&klass->methods);
+            freeTable(&klass->fields);
+            break;
+        }
+        case OBJ_INSTANCE:
+            freeTable(&((ObjInstance*)obj)->fields);
+            break;
+        case OBJ_STRING_BUILDER: {
+            ObjStringBuilder* builder = (ObjStringBuilder*)obj;
+            FREE_ARRAY(char, builder->chars, builder->capacity);
+            builder->chars = NULL;
+            builder->capacity = 0;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
 //FNV-1a non-criptographic hash algorithm
+#define HASH_WORD_THRESHOLD 16
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t readWord(const char* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t word) {
+    acc += word * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+// xxHash64-style: four independent lanes of 8 byte words, so the
+// multiplies of a block can overlap instead of forming one long chain
+static uint32_t hashLong(const char* chars, int length) {
+    const char* p = chars;
+    const char* end = chars + length;
+
+    uint64_t v1 = PRIME64_1 + PRIME64_2;
+    uint64_t v2 = PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - PRIME64_1;
+
+    while (end - p >= 32) {
+        v1 = hashRound(v1, readWord(p));
+        v2 = hashRound(v2, readWord(p + 8));
+        v3 = hashRound(v3, readWord(p + 16));
+        v4 = hashRound(v4, readWord(p + 24));
+        p += 32;
+    }
+
+    uint64_t h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h += (uint64_t)length;
+
+    while (end - p >= 8) {
+        h ^= hashRound(0, readWord(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_3;
+        p += 8;
+    }
+
+    while (p < end) {
+        h ^= (uint8_t)*p++ * PRIME64_3;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    // final avalanche, then fold to the 32 bits the tables use
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return (uint32_t)h;
+}
+
 uint32_t hashString(const char* chars, int length) {
+    if (length >= HASH_WORD_THRESHOLD) return hashLong(chars, length);
+
     uint32_t hash = 2166136261;
 
     for(int i=0; i<length; i++) {
@@ -181,13 +466,43 @@ uint32_t hashString(const char* chars, int length) {
     return hash;
 }
 
-ObjString* allocateString(char* chars, int length, uint32_t hash) {
+// Allocates an uninterned string with room for length chars. The caller
+// writes the characters and either interns it right away or leaves that
+// to the first table that sees it as a key
+ObjString* allocateString(int length) {
     //contiguous allocation for the chars array
     ObjString* string = (ObjString*)allocateObject(sizeof(ObjString) + sizeof(char) * length + 1, OBJ_STRING);
     string->length = length;
-    memcpy(string->chars, chars, length);
     string->chars[length] = '\0';
+    string->hash = 0;
+    string->isInterned = false;
+
+    return string;
+}
+
+// Hashes a string filled in after allocateString and returns the canonical
+// instance: either a previously interned copy or the string itself
+ObjString* internString(ObjString* string) {
+    if (string->isInterned) return string;
+    string->hash = hashString(string->chars, string->length);
+
+    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, string->hash);
+    // the fresh copy is left as garbage in the nursery
+    if (interned != NULL) return interned;
+
+    string->isInterned = true;
+    push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+
+    return string;
+}
+
+static ObjString* newInternedString(const char* chars, int length, uint32_t hash) {
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
     string->hash = hash;
+    string->isInterned = true;
 
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
@@ -202,12 +517,13 @@ ObjString* takeString(char* chars, int length) {
 
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
 
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    if (interned == NULL) {
+        interned = newInternedString(chars, length, hash);
     }
 
-    return allocateString(chars, length, hash);
+    // the chars now live inside the ObjString, the buffer is ours to free
+    FREE_ARRAY(char, chars, length + 1);
+    return interned;
 }
 
 ObjString* copyString(const char* chars, int length) {
@@ -217,11 +533,8 @@ ObjString* copyString(const char* chars, int length) {
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     //if interned we just return the rerence
     if (interned != NULL) return interned;
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
 
-    return allocateString(heapChars, length, hash);
+    return newInternedString(chars, length, hash);
 }
 
 static void printFunction(ObjFunction* function) {
@@ -265,9 +578,9 @@ void printObject(Value value) {
         // #ifdef DEBUG_TRACE_EXECUTION
         //     printf(" ");
         //     ObjDictionary* dict = AS_MAP(value);
-        //     Entry first = dict->entries.entries[0];
+        //     DictEntry first = dict->map.entries[0];
         //     printf("Key: ");
-        //     printValue(OBJ_VAL(first.key));
+        //     printValue(first.key);
         //     printf(" Value: ");
         //     printValue(first.value);
         // #endif
@@ -290,6 +603,11 @@ void printObject(Value value) {
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
         }
+        case OBJ_STRING_BUILDER: {
+            ObjStringBuilder* builder = AS_STRING_BUILDER(value);
+            printf("%.*s", builder->length, builder->length > 0 ? builder->chars : "");
+            break;
+        }
 
 
     }
@@ -4,6 +4,7 @@
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
+#include "dict.h"
 
 typedef enum {
     OBJ_BOUND_METHOD,
@@ -16,7 +17,8 @@ typedef enum {
     OBJ_DICTIONARY,
     OBJ_RANGE,
     OBJ_CLASS,
-    OBJ_INSTANCE
+    OBJ_INSTANCE,
+    OBJ_STRING_BUILDER
 } ObjType;
 
 struct Obj {
@@ -31,6 +33,7 @@ struct ObjString {
     Obj obj;
     int length;
     uint32_t hash;
+    bool isInterned; // hash is computed lazily, when first used as a key
     char chars[]; //flexible array member
 };
 
@@ -38,6 +41,8 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    // the most stack slots a frame running it takes, see chunkMaxStack
+    int maxStack;
     Chunk chunk;
     ObjString* name;
 } ObjFunction;
@@ -61,8 +66,8 @@ typedef struct ObjUpvalue {
 typedef struct {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalueCount;
+    ObjUpvalue* upvalues[]; // upvalueCount of them, inside the object
 } ObjClosure;
 
 typedef struct {
@@ -84,20 +89,56 @@ typedef struct {
     Table fields;
 } ObjInstance;
 
+// Arrays are homogeneous. Number arrays keep their elements packed as raw
+// doubles, which the GC never has to scan; other arrays keep Values.
+// Small arrays keep them inside the object, values and numbers then point
+// into it, and only spill them to a separate buffer once they outgrow it.
+// A slice borrows a range of its parent's storage instead of copying it,
+// both are then shared and take a private copy before their next write.
+// Shared storage is counted, the last array to let go of it frees it
+#define ARRAY_INLINE_BYTES 32
+#define ARRAY_INLINE_VALUES ((int)(ARRAY_INLINE_BYTES / sizeof(Value)))
+#define ARRAY_INLINE_NUMBERS ((int)(ARRAY_INLINE_BYTES / sizeof(double)))
+
+typedef struct {
+    int refCount;
+    int capacity;
+    bool isPacked;
+    void* base;
+} ArrayStore;
+
 typedef struct {
     Obj obj;
     ObjClass* klass;
     ValueType type;
-    ValueArray values;
+    int count;
+    int capacity;
+    bool isPacked;
+    ArrayStore* shared;
+    Value* values;
+    double* numbers;
+    union {
+        Value values[ARRAY_INLINE_VALUES];
+        double numbers[ARRAY_INLINE_NUMBERS];
+    } inlined;
 } ObjArray;
 
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table map;
-    EntryList entries;
+    Dict map;
 } ObjDictionary;
 
+// growable char buffer: appends are amortized O(1) and the result
+// is hashed and interned only once, when toString() is called
+typedef struct {
+    Obj obj;
+    ObjClass* klass;
+    int length;
+    int capacity;
+    char* chars;
+} ObjStringBuilder;
+
 typedef struct {
     Obj obj;
     double current;
@@ -117,6 +158,7 @@ typedef struct {
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
 #define IS_RANGE(value)         isObjType(value, OBJ_RANGE)
+#define IS_STRING_BUILDER(value) isObjType(value, OBJ_STRING_BUILDER)
 
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value)) //points to an objstring on heap
@@ -130,6 +172,7 @@ typedef struct {
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_RANGE(value)         ((ObjRange*)AS_OBJ(value))
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
 
 ObjFunction* newFunction();
 ObjArray* newArray();
@@ -137,16 +180,38 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjUpvalue*newUpvalue(Value* value);
 ObjDictionary* newDictionary();
 ObjRange* newRange(double start, double end);
+ObjStringBuilder* newStringBuilder();
+void appendStringBuilder(ObjStringBuilder* builder, const char* chars, int length);
 ObjClass* newClass(ObjString* name);
 ObjInstance* newInstance(ObjClass* klass);
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+void freeObjectStore(Obj* obj);
+void unshareArray(ObjArray* arr);
+void sliceArray(ObjArray* slice, ObjArray* arr, int start, int end);
+
+static inline bool isArrayInline(ObjArray* arr) {
+    return arr->isPacked ? arr->numbers == arr->inlined.numbers : arr->values == arr->inlined.values;
+}
+
+// Called before anything writes to an array's elements or grows it
+static inline void makeArrayWritable(ObjArray* arr) {
+    if (arr->shared != NULL) unshareArray(arr);
+}
+
+bool reserveArray(ObjArray* arr, ValueType type, int capacity);
 bool appendArray(ObjArray* arr, Value value);
 bool arraySet(ObjArray* array, int index, Value value);
+
+static inline Value arrayElement(ObjArray* arr, int index) {
+    return arr->isPacked ? NUMBER_VAL(arr->numbers[index]) : arr->values[index];
+}
+
 bool arrayGet(ObjArray* arr, int index, Value* value);
 Value arrayPop(ObjArray* arr);
 ObjNative* newNative(NativeFn function, bool isBuiltIn);
 ObjString* copyString(const char* chars, int length);
-ObjString* allocateString(char* chars, int length, uint32_t hash);
+ObjString* allocateString(int length);
+ObjString* internString(ObjString* string);
 ObjString* takeString(char* chars, int length);
 void printObject(Value value);
 uint32_t hashString(const char* chars, int length);
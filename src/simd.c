@@ -0,0 +1,288 @@
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X86
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+SimdKernels simd;
+
+// Plain C versions, for other targets and the tails of the vector
+// loops. Independent accumulators so the compiler can still overlap
+// the additions
+
+static double scalarSum(const double* a, int count) {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        s0 += a[i];
+        s1 += a[i + 1];
+        s2 += a[i + 2];
+        s3 += a[i + 3];
+    }
+    for (; i < count; i++) s0 += a[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+static double scalarMin(const double* a, int count) {
+    double result = a[0];
+    for (int i = 1; i < count; i++) {
+        if (a[i] < result) result = a[i];
+    }
+    return result;
+}
+
+static double scalarMax(const double* a, int count) {
+    double result = a[0];
+    for (int i = 1; i < count; i++) {
+        if (a[i] > result) result = a[i];
+    }
+    return result;
+}
+
+static double scalarDot(const double* a, const double* b, int count) {
+    double s0 = 0, s1 = 0;
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+    }
+    for (; i < count; i++) s0 += a[i] * b[i];
+    return s0 + s1;
+}
+
+static void scalarScale(double* a, int count, double factor) {
+    for (int i = 0; i < count; i++) a[i] *= factor;
+}
+
+static void scalarAdd(double* dst, const double* src, int count) {
+    for (int i = 0; i < count; i++) dst[i] += src[i];
+}
+
+static void scalarFill(double* a, int count, double value) {
+    for (int i = 0; i < count; i++) a[i] = value;
+}
+
+static void scalarIota(double* a, int count, double start) {
+    for (int i = 0; i < count; i++) a[i] = start + i;
+}
+
+#ifdef SIMD_X86
+
+// SSE2 is part of x86-64, so these need no detection
+
+static inline double hsum128(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+static double sse2Sum(const double* a, int count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+    }
+    double result = hsum128(_mm_add_pd(acc0, acc1));
+    return result + scalarSum(a + i, count - i);
+}
+
+static double sse2Min(const double* a, int count) {
+    if (count < 2) return a[0];
+    __m128d acc = _mm_loadu_pd(a);
+    int i = 2;
+    for (; i + 2 <= count; i += 2) acc = _mm_min_pd(acc, _mm_loadu_pd(a + i));
+    double result = _mm_cvtsd_f64(_mm_min_sd(acc, _mm_unpackhi_pd(acc, acc)));
+    for (; i < count; i++) {
+        if (a[i] < result) result = a[i];
+    }
+    return result;
+}
+
+static double sse2Max(const double* a, int count) {
+    if (count < 2) return a[0];
+    __m128d acc = _mm_loadu_pd(a);
+    int i = 2;
+    for (; i + 2 <= count; i += 2) acc = _mm_max_pd(acc, _mm_loadu_pd(a + i));
+    double result = _mm_cvtsd_f64(_mm_max_sd(acc, _mm_unpackhi_pd(acc, acc)));
+    for (; i < count; i++) {
+        if (a[i] > result) result = a[i];
+    }
+    return result;
+}
+
+static double sse2Dot(const double* a, const double* b, int count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double result = hsum128(_mm_add_pd(acc0, acc1));
+    return result + scalarDot(a + i, b + i, count - i);
+}
+
+static void sse2Scale(double* a, int count, double factor) {
+    __m128d f = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), f));
+    scalarScale(a + i, count - i, factor);
+}
+
+static void sse2Add(double* dst, const double* src, int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(dst + i, _mm_add_pd(_mm_loadu_pd(dst + i), _mm_loadu_pd(src + i)));
+    }
+    scalarAdd(dst + i, src + i, count - i);
+}
+
+static void sse2Fill(double* a, int count, double value) {
+    __m128d v = _mm_set1_pd(value);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) _mm_storeu_pd(a + i, v);
+    scalarFill(a + i, count - i, value);
+}
+
+static void sse2Iota(double* a, int count, double start) {
+    __m128d v = _mm_set_pd(start + 1, start);
+    __m128d step = _mm_set1_pd(2);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(a + i, v);
+        v = _mm_add_pd(v, step);
+    }
+    scalarIota(a + i, count - i, start + i);
+}
+
+// AVX2 versions, selected at runtime
+
+TARGET_AVX2 static inline double hsum256(__m256d v) {
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+TARGET_AVX2 static double avx2Sum(const double* a, int count) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    }
+    double result = hsum256(_mm256_add_pd(acc0, acc1));
+    return result + scalarSum(a + i, count - i);
+}
+
+TARGET_AVX2 static double avx2Min(const double* a, int count) {
+    if (count < 4) return scalarMin(a, count);
+    __m256d acc = _mm256_loadu_pd(a);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) acc = _mm256_min_pd(acc, _mm256_loadu_pd(a + i));
+    __m128d half = _mm_min_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double result = _mm_cvtsd_f64(_mm_min_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; i < count; i++) {
+        if (a[i] < result) result = a[i];
+    }
+    return result;
+}
+
+TARGET_AVX2 static double avx2Max(const double* a, int count) {
+    if (count < 4) return scalarMax(a, count);
+    __m256d acc = _mm256_loadu_pd(a);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) acc = _mm256_max_pd(acc, _mm256_loadu_pd(a + i));
+    __m128d half = _mm_max_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double result = _mm_cvtsd_f64(_mm_max_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; i < count; i++) {
+        if (a[i] > result) result = a[i];
+    }
+    return result;
+}
+
+TARGET_AVX2 static double avx2Dot(const double* a, const double* b, int count) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    double result = hsum256(_mm256_add_pd(acc0, acc1));
+    return result + scalarDot(a + i, b + i, count - i);
+}
+
+TARGET_AVX2 static void avx2Scale(double* a, int count, double factor) {
+    __m256d f = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), f));
+    scalarScale(a + i, count - i, factor);
+}
+
+TARGET_AVX2 static void avx2Add(double* dst, const double* src, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_loadu_pd(dst + i), _mm256_loadu_pd(src + i)));
+    }
+    scalarAdd(dst + i, src + i, count - i);
+}
+
+TARGET_AVX2 static void avx2Fill(double* a, int count, double value) {
+    __m256d v = _mm256_set1_pd(value);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) _mm256_storeu_pd(a + i, v);
+    scalarFill(a + i, count - i, value);
+}
+
+TARGET_AVX2 static void avx2Iota(double* a, int count, double start) {
+    __m256d v = _mm256_set_pd(start + 3, start + 2, start + 1, start);
+    __m256d step = _mm256_set1_pd(4);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(a + i, v);
+        v = _mm256_add_pd(v, step);
+    }
+    scalarIota(a + i, count - i, start + i);
+}
+
+static bool cpuHasAvx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    // the OS must also save the upper halves of the ymm registers
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+void initSimd() {
+#ifdef SIMD_X86
+    if (cpuHasAvx2()) {
+        simd = (SimdKernels){ avx2Sum, avx2Min, avx2Max, avx2Dot,
+                              avx2Scale, avx2Add, avx2Fill, avx2Iota, "avx2" };
+        return;
+    }
+
+    simd = (SimdKernels){ sse2Sum, sse2Min, sse2Max, sse2Dot,
+                          sse2Scale, sse2Add, sse2Fill, sse2Iota, "sse2" };
+#else
+    simd = (SimdKernels){ scalarSum, scalarMin, scalarMax, scalarDot,
+                          scalarScale, scalarAdd, scalarFill, scalarIota, "scalar" };
+#endif
+}
@@ -0,0 +1,22 @@
+#ifndef clox_simd_h
+#define clox_simd_h
+#include "common.h"
+
+// Kernels over packed double arrays used by the array natives. initSimd
+// picks AVX2, SSE2 or plain C versions for the running CPU
+typedef struct {
+    double (*sum)(const double* a, int count);
+    double (*min)(const double* a, int count);
+    double (*max)(const double* a, int count);
+    double (*dot)(const double* a, const double* b, int count);
+    void (*scale)(double* a, int count, double factor);
+    void (*add)(double* dst, const double* src, int count);
+    void (*fill)(double* a, int count, double value);
+    void (*iota)(double* a, int count, double start);
+    const char* name;
+} SimdKernels;
+
+extern SimdKernels simd;
+
+void initSimd();
+#endif
@@ -5,86 +5,201 @@
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "vm.h"
 
 #define TABLE_MAX_LOAD 0.75
 
+// Swiss table layout: next to the entries sits one control byte per slot.
+// Full slots store the low 7 bits of the key's hash (H2), so a probe can
+// reject almost every mismatch without touching the entry or the key.
+// Slots are probed a group of 16 control bytes at a time
+#define GROUP_SIZE 16
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7F))
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+
+static inline uint32_t groupMatch(const uint8_t* group, uint8_t h2) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)h2)));
+}
+
+// empty and deleted are the only control bytes with the top bit set
+static inline uint32_t groupMatchFree(const uint8_t* group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static inline uint32_t groupMatch(const uint8_t* group, uint8_t h2) {
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] == h2) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline uint32_t groupMatchFree(const uint8_t* group) {
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+}
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static inline uint32_t groupMatchEmpty(const uint8_t* group) {
+    return groupMatch(group, CTRL_EMPTY);
+}
+
+static inline int lowestBit(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Tables smaller than a group still load 16 control bytes: the tail is
+// padding and gets masked off
+static inline int controlSize(int capacity) {
+    return capacity < GROUP_SIZE ? GROUP_SIZE : capacity;
+}
+
+static inline uint32_t groupMask(int capacity) {
+    return capacity < GROUP_SIZE ? (1u << capacity) - 1 : 0xFFFF;
+}
+
+static inline int groupCount(int capacity) {
+    return capacity < GROUP_SIZE ? 1 : capacity / GROUP_SIZE;
+}
+
 void initTable(Table* table) {
     table->count = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
+}
+
+// entries and control bytes share one allocation, control bytes last
+static inline size_t tableBytes(int capacity) {
+    return sizeof(Entry) * capacity + controlSize(capacity);
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->entries != NULL) reallocate(table->entries, tableBytes(table->capacity), 0);
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
+// Groups are visited with triangular steps, which covers all of them
+// since the group count is a power of two
+static Entry* findEntry(Table* table, ObjString* key) {
+    int groups = groupCount(table->capacity);
+    uint32_t valid = groupMask(table->capacity);
+    uint8_t h2 = H2(key->hash);
+    int group = H1(key->hash) & (groups - 1);
+
+    for (int step = 1; ; step++) {
+        const uint8_t* control = table->control + group * GROUP_SIZE;
+        Entry* entries = table->entries + group * GROUP_SIZE;
+
+        for (uint32_t match = groupMatch(control, h2) & valid; match != 0; match &= match - 1) {
+            Entry* entry = &entries[lowestBit(match)];
+            if (entry->key == key) return entry;
+        }
 
-    for(;;) {
-        Entry* entry = &entries[index];
+        // an empty slot ends the probe sequence: the key would have gone there
+        if (groupMatchEmpty(control) & valid) return NULL;
+        group = (group + step) & (groups - 1);
+    }
+}
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone = NULL ? tombstone : entry;
-            }
-            else {
-                //we found a tombstone. If tombstone is NULL, now it points
-                //to the entry and we continue the for loop
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            //key found
-            return entry;
-        }
+// First empty or deleted slot along the key's probe sequence
+static int findFreeSlot(uint8_t* control, int capacity, uint32_t hash) {
+    int groups = groupCount(capacity);
+    uint32_t valid = groupMask(capacity);
+    int group = H1(hash) & (groups - 1);
 
-        index = (index + 1) & (capacity - 1); //the modulo is for wrapping around the array
+    for (int step = 1; ; step++) {
+        uint32_t slots = groupMatchFree(control + group * GROUP_SIZE) & valid;
+        if (slots != 0) return group * GROUP_SIZE + lowestBit(slots);
+        group = (group + step) & (groups - 1);
     }
 }
 
+// Runtime strings (concatenation results) skip interning until they are
+// used as a key. Tables only ever hold the canonical copy, so lookups can
+// keep comparing pointers
+static inline ObjString* canonicalKey(ObjString* key) {
+    if (key->isInterned) return key;
+    return internString(key);
+}
+
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    Entry* entries = (Entry*)reallocate(NULL, 0, tableBytes(capacity));
+    uint8_t* control = (uint8_t*)(entries + capacity);
+    memset(control, CTRL_EMPTY, controlSize(capacity));
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
 
     //since the table's capacity gets changed, we have to adjust the entries
-    //of the table to their new corresponding bucket.
+    //of the table to their new corresponding bucket. Tombstones are dropped
 
     table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        int slot = findFreeSlot(control, capacity, entry->key->hash);
+        control[slot] = H2(entry->key->hash);
+        entries[slot] = *entry;
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->entries != NULL) reallocate(table->entries, tableBytes(table->capacity), 0);
     table->entries = entries;
+    table->control = control;
     table->capacity = capacity;
 }
 
+static inline void markDeleted(Table* table, Entry* entry) {
+    table->control[entry - table->entries] = CTRL_DELETED;
+    entry->key = NULL;
+    entry->value = NIL_VAL;
+}
+
 bool tableSet(Table* table, ObjString* key, Value value) {
+    key = canonicalKey(key);
 
     if (table->count + 1 > (table->capacity) * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
         adjustCapacity(table, capacity);
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
+    Entry* entry = findEntry(table, key);
+    if (entry != NULL) {
+        entry->value = value;
+        return false;
+    }
 
-    bool isNewKey = (entry->key == NULL);
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    // count includes tombstones, reusing one doesn't change the load
+    int slot = findFreeSlot(table->control, table->capacity, key->hash);
+    if (table->control[slot] == CTRL_EMPTY) table->count++;
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    table->control[slot] = H2(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    return true;
 }
 
 void tableAddAll(Table* src, Table* dest) {
@@ -99,22 +214,23 @@ void tableAddAll(Table* src, Table* dest) {
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
+    key = canonicalKey(key);
 
     // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
     // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    markDeleted(table, entry);
     return true;
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
+    key = canonicalKey(key);
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
     *value = entry->value;
     return true;
@@ -124,45 +240,54 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
+    int groups = groupCount(table->capacity);
+    uint32_t valid = groupMask(table->capacity);
+    int group = H1(hash) & (groups - 1);
 
-    for(;;) {
+    for (int step = 1; ; step++) {
+        const uint8_t* control = table->control + group * GROUP_SIZE;
+        Entry* entries = table->entries + group * GROUP_SIZE;
 
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-
-            if(IS_NIL(entry->value)) return NULL;
-
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
+        for (uint32_t match = groupMatch(control, H2(hash)) & valid; match != 0; match &= match - 1) {
+            ObjString* key = entries[lowestBit(match)].key;
             //if the length and hash are equal, and memcmp is 0, the strings must be equal
-            return entry->key;
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
 
-        index = (index + 1) & (table->capacity - 1);
+        if (groupMatchEmpty(control) & valid) return NULL;
+        group = (group + step) & (groups - 1);
     }
 }
 
 
 
-void initEntryList(EntryList* arr) {
-    arr->capacity = 0;
-    arr->count = 0;
-    arr->entries = NULL;
-}
-
-void writeEntryList(EntryList* arr,  Entry value) {
-    if (arr->capacity < arr->count + 1) {
-        int oldCapacity = arr->capacity;
-        arr->capacity = GROW_CAPACITY(oldCapacity);
-        arr->entries = GROW_ARRAY(Entry, arr->entries, oldCapacity, arr->capacity);
+// The intern table is weak: it must not keep strings alive by itself.
+// Called by a major collection after tracing, only old generation and
+// large keys have meaningful mark bits, younger ones are left to minor
+// collections
+void tableRemoveWhite(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key != NULL && (IS_IN_OLD(entry->key) || IS_IN_LARGE(entry->key))
+            && !entry->key->obj.isMarked) {
+            markDeleted(table, entry);
+        }
     }
-
-    arr->entries[arr->count] = value;
-    arr->count++;
 }
 
+// Minor collection counterpart of tableRemoveWhite: nursery keys that
+// were copied are redirected to their new location, the others are dead
+void tableSweepNursery(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL || !IS_IN_NURSERY(entry->key)) continue;
 
-void freeEntryList(EntryList* arr) {
-    FREE_ARRAY(uint8_t, arr->entries, arr->capacity);
-    initEntryList(arr);
+        if (entry->key->obj.forwarded != NULL) {
+            entry->key = (ObjString*)entry->key->obj.forwarded;
+        } else {
+            markDeleted(table, entry);
+        }
+    }
 }
@@ -12,12 +12,7 @@ typedef struct {
     int count;
     int capacity;
     Entry* entries;
-} EntryList;
-
-typedef struct {
-    int count;
-    int capacity;
-    Entry* entries;
+    uint8_t* control; // one byte per slot: empty, deleted or 7 hash bits
 } Table;
 
 void initTable(Table* table);
@@ -28,7 +23,5 @@ bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableDelete(Table* table, ObjString* key);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 void tableRemoveWhite(Table* table);
-void initEntryList(EntryList* arr);
-void writeEntryList(EntryList* arr,  Entry value);
-void freeEntryList(EntryList* arr);
+void tableSweepNursery(Table* table);
 #endif
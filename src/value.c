@@ -28,15 +28,28 @@ void writeValueArray(ValueArray* arr,  Value value) {
 
 
 void freeValueArray(ValueArray* arr) {
-    FREE_ARRAY(uint8_t, arr->values, arr->capacity);
+    FREE_ARRAY(Value, arr->values, arr->capacity);
     initValueArray(arr);
 }
 
 
 
+// Interned strings are equal only if they are the same object, strings
+// that are not interned yet need a comparison by content
+static bool stringsEqual(Value a, Value b) {
+    if (!IS_STRING(a) || !IS_STRING(b)) return false;
+
+    ObjString* aString = AS_STRING(a);
+    ObjString* bString = AS_STRING(b);
+    if (aString->isInterned && bString->isInterned) return false;
+
+    return aString->length == bString->length
+        && memcmp(aString->chars, bString->chars, aString->length) == 0;
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
-    return a == b;
+    return a == b || stringsEqual(a, b);
 #else
     if (a.type != b.type) return false;
 
@@ -44,7 +57,7 @@ bool valuesEqual(Value a, Value b) {
         case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:       return true;
         case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b) || stringsEqual(a, b);
 
         default:            return false;
     }
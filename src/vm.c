@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
@@ -12,6 +13,7 @@
 #include "value.h"
 #include "clox_compiler.h"
 #include "clox_debug.h"
+#include "simd.h"
 #include "vm.h"
 
 
@@ -43,44 +45,67 @@ static Value endLine(int argCount, Value* args) {
     return NIL_VAL;
 }
 
+// The frames and the value stack are reserved once, for FRAMES_MAX
+// calls and a window of UINT8_COUNT values each, and never move: frame
+// slots and open upvalues point into them for good. Pages are committed
+// as calls get deeper, the page past each reservation never is, so a
+// stray access beyond it faults instead of running into other memory
+static void* reserveStack(size_t size) {
+    void* base = reserve(size + PAGE_SIZE);
+    if (base == NULL) {
+        printf("Stack reservation failed. Exiting process...\n");
+        exit(1);
+    }
+    return base;
+}
+
+static void commitStack(void* base, size_t size) {
+    if (!commit(base, align(size, PAGE_SIZE))) {
+        printf("Stack commit failed. Exiting process...\n");
+        exit(1);
+    }
+}
+
 void initCallFrameArray(CallFrameArray* arr) {
-    arr->capacity = FRAMES_INIT_CAPACITY;
+    arr->capacity = 0;
     arr->count = 0;
-    arr->frames = ALLOCATE(CallFrame, vm.frameArray.capacity);
+    arr->frames = reserveStack(align(sizeof(CallFrame) * FRAMES_MAX, PAGE_SIZE));
+    vm.reservedFrames = arr->frames + FRAMES_MAX;
 }
 
 void freeCallFrameArray(CallFrameArray* arr) {
-    FREE_ARRAY(CallFrame, arr->frames, arr->capacity);
-    initCallFrameArray(arr);
+    release(arr->frames, align(sizeof(CallFrame) * FRAMES_MAX, PAGE_SIZE) + PAGE_SIZE);
+    arr->frames = NULL;
+    arr->capacity = 0;
+    arr->count = 0;
 }
 
-static void growStack() {
+// Commits room for more frames, false when the reservation is used up.
+// What's committed already stays in place
+static bool commitFrames() {
+    if (vm.frameArray.frames + vm.frameArray.capacity == vm.reservedFrames) return false;
 
-    if (vm.frameArray.capacity <= vm.frameArray.count) {
-        printf("Growing stack...\n");
+    int capacity = GROW_FRAMES_CAPACITY(vm.frameArray.capacity);
+    if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
 
-        int oldStackCapacity = vm.stack.capacity;
-        int oldFramesCapacity = vm.frameArray.capacity;
-        int stackSize = (int)(vm.stackTop - vm.stack.values);
-
-        Value* oldStack = vm.stack.values;
+    commitStack(vm.frameArray.frames, sizeof(CallFrame) * capacity);
+    vm.frameArray.capacity = capacity;
+    return true;
+}
 
-        vm.stack.capacity = GROW_STACK_CAPACITY(oldStackCapacity);
-        vm.frameArray.capacity = GROW_FRAMES_CAPACITY(oldFramesCapacity);
-        vm.stack.values = GROW_ARRAY(Value, vm.stack.values, oldStackCapacity, vm.stack.capacity);
-        vm.frameArray.frames = GROW_ARRAY(CallFrame, vm.frameArray.frames, oldFramesCapacity, vm.frameArray.capacity);
+// Commits the value stack up to end at least. Frames are committed by
+// count, values by how far the stack reaches: a frame's locals and
+// temporaries together may take more than UINT8_COUNT slots
+static bool commitValues(Value* end) {
+    if (end > vm.reservedStack) return false;
 
-        vm.stackTop = vm.stack.values + stackSize;
+    int capacity = vm.stack.capacity;
+    while (vm.stack.values + capacity < end) capacity = GROW_STACK_CAPACITY(capacity);
+    if (capacity > STACK_MAX) capacity = STACK_MAX;
 
-        int reallocDiff = (int)(vm.stack.values - oldStack); // diff between new reallocated address and previous
-        for (int i = vm.frameArray.count - 1; i >= 0; i--) {
-            if (vm.frameArray.frames[i].slots != NULL) {
-                vm.frameArray.frames[i].slots += reallocDiff;
-            }
-        }
-
-        printf("Stack grown\n");
-    }
+    commitStack(vm.stack.values, sizeof(Value) * capacity);
+    vm.stack.capacity = capacity;
+    return true;
 }
 
 void push(Value value) {
@@ -139,6 +164,9 @@ static bool isBuiltInAndSet(Value value, ObjClass** klass) {
         case OBJ_DICTIONARY:
             *klass = AS_MAP(value)->klass;
             return true;
+        case OBJ_STRING_BUILDER:
+            *klass = AS_STRING_BUILDER(value)->klass;
+            return true;
     }
     return false;
 }
@@ -149,6 +177,7 @@ static bool isBuiltIn(Value value) {
     switch (AS_OBJ(value)->type) {
         case OBJ_ARRAY:
         case OBJ_DICTIONARY:
+        case OBJ_STRING_BUILDER:
             return true;
     }
 
@@ -156,13 +185,24 @@ static bool isBuiltIn(Value value) {
 }
 
 
+// Commits the stack for a frame at slots running function, as far as its
+// code reaches
+static bool commitFrameStack(Value* slots, ObjFunction* function) {
+    Value* end = slots + function->maxStack + NATIVE_STACK_ROOM;
+    return end <= vm.stack.values + vm.stack.capacity || commitValues(end);
+}
+
 static bool call(ObjClosure* closure, int argc) {
     if (argc != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d" , closure->function->arity, argc);
         return false;
     }
 
-    growStack();
+    if ((vm.frameArray.count == vm.frameArray.capacity && !commitFrames())
+        || !commitFrameStack(vm.stackTop - argc - 1, closure->function)) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
 
     CallFrame* frame = &vm.frameArray.frames[vm.frameArray.count++];
     frame->closure= closure;
@@ -180,17 +220,23 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_CLOSURE: return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
+                // read before calling, the native may collect and move itself
+                bool isBuiltIn = AS_NATIVE_OBJ(callee)->isBuiltIn;
                 Value result = native(argCount, vm.stackTop - argCount);
+                // a native that reported an error has reset the stack
+                if (vm.stackTop == vm.stack.values) return false;
                 vm.stackTop -= argCount + 1;
-                if (AS_NATIVE_OBJ(callee)->isBuiltIn) pop();
+                if (isBuiltIn) pop();
                 push(result);
                 return true;
             }
             case OBJ_CLASS: {
                 ObjClass* klass = AS_CLASS(callee);
                 push(OBJ_VAL(klass));
-                vm.stackTop[-argCount - 2] = OBJ_VAL(newInstance(klass));
-                pop();
+                ObjInstance* instance = newInstance(klass);
+                // the allocation may have moved the class
+                klass = AS_CLASS(pop());
+                vm.stackTop[-argCount - 1] = OBJ_VAL(instance);
                 
                 // ObjString* check = tableFindString(&klass->methods, "init", 4, hashString("init", 4));
                 // printValue(OBJ_VAL(check));
@@ -373,6 +419,8 @@ static bool invokeFromNative(ObjClass* klass, ObjString* name, int argc) {
 
     NativeFn native = AS_NATIVE(method);
     Value result = native(argc, vm.stackTop - argc);
+    // a native that reported an error has reset the stack
+    if (vm.stackTop == vm.stack.values) return false;
     vm.stackTop -= argc + 1;
     push(result);
     return true;
@@ -409,21 +457,23 @@ static bool isFalsey(Value value) {
 static ObjString* intToString(int num) {
     // Handle negative
     bool negative = num < 0;
-    if (negative) num = -num;
+    unsigned int n = negative ? 0u - (unsigned int)num : (unsigned int)num;
 
-    // Convert digits (backwards)
-    char buffer[16];
-    int pos = 15;
-    buffer[pos--] = '\0';
+    int digits = 1;
+    for (unsigned int rest = n / 10; rest > 0; rest /= 10) digits++;
+
+    // Convert digits (backwards) straight into the string object
+    ObjString* string = allocateString(digits + negative);
+    int pos = string->length - 1;
 
     do {
-        buffer[pos--] = '0' + (num % 10);
-        num /= 10;
-    } while (num > 0);
+        string->chars[pos--] = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
 
-    if (negative) buffer[pos--] = '-';
+    if (negative) string->chars[0] = '-';
 
-    return copyString(&buffer[pos + 1], 14 - pos);
+    return internString(string);
 }
 
 static ObjString* valueToString(Value value) {
@@ -446,6 +496,10 @@ static ObjString* valueToString(Value value) {
 
     } else if (IS_NIL(value)) {
         return copyString("nil", 3);
+
+    } else if (IS_STRING_BUILDER(value)) {
+        ObjStringBuilder* builder = AS_STRING_BUILDER(value);
+        return copyString(builder->length > 0 ? builder->chars : "", builder->length);
     }
 
     // temporary fallback for obj types
@@ -453,6 +507,11 @@ static ObjString* valueToString(Value value) {
 }
 
 
+// Reports a missing dictionary key, formatted as it's concatenated
+static void keyError(const char* format, Value key) {
+    runtimeError(format, valueToString(key)->chars);
+}
+
 static bool queue(ValueArray* arr) {
     if (vm.nestingLevel < 0) {
         return false;
@@ -486,23 +545,21 @@ static void concatenate() {
     ObjString* b = valueToString(peek(0));
     push(OBJ_VAL(b));
     ObjString* a = valueToString(peek(2));
-    pop();
-    push(OBJ_VAL(b));
     push(OBJ_VAL(a));
 
-    int length = a->length + b->length;
-    char* newString = ALLOCATE(char, length + 1);
+    // a and b stay on the stack since the allocation may move them
+    ObjString* result = allocateString(a->length + b->length);
+    a = AS_STRING(peek(0));
+    b = AS_STRING(peek(1));
 
-    memcpy(newString, a->chars, a->length);
-    memcpy(newString + a->length, b->chars, b->length);
-    newString[length] = '\0';
-
-    ObjString* result = takeString(newString, length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+    // left uninterned: most intermediates are never used as keys
 
+    pop();  // a
+    pop();  // b
     pop();
     pop();
-    pop();  // b
-    pop();  // a
 
     push(OBJ_VAL(result));
 }
@@ -620,6 +677,50 @@ static Value array_PopNative(int argCount, Value* args) {
     return arrayPop(AS_ARRAY(args[-1]));
 }
 
+// Reads a length or capacity argument, a whole number from 0 to max.
+// Reports what's wrong with it otherwise, name says whose argument it is
+static bool sizeArgument(Value value, const char* name, int max, int* size) {
+    if (!IS_NUMBER(value)) {
+        runtimeError("%s must be a number", name);
+        return false;
+    }
+
+    double number = AS_NUMBER(value);
+    if (number != floor(number)) {
+        runtimeError("%s must be a whole number", name);
+        return false;
+    }
+    if (number < 0) {
+        runtimeError("%s can't be negative", name);
+        return false;
+    }
+    if (number > max) {
+        runtimeError("%s can't be larger than %d", name, max);
+        return false;
+    }
+
+    *size = (int)number;
+    return true;
+}
+
+static Value array_ReserveNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[-1])) {
+        runtimeError("Object is not an array");
+        return NIL_VAL;
+    }
+    if (argCount != 1) {
+        runtimeError("Array.reserve() expects one argument: capacity");
+        return NIL_VAL;
+    }
+
+    int capacity;
+    if (!sizeArgument(args[0], "Array.reserve() capacity", INT32_MAX, &capacity)) return NIL_VAL;
+
+    ObjArray* arr = AS_ARRAY(args[-1]);
+    if (capacity > arr->capacity) reserveArray(arr, arr->type, capacity);
+    return OBJ_VAL(arr);
+}
+
 static Value array_LengthNative(int argCount, Value* args) {
     if (!IS_ARRAY(args[-1])) {
         runtimeError("Object is not an array");
@@ -630,7 +731,495 @@ static Value array_LengthNative(int argCount, Value* args) {
         return NIL_VAL;
     }
 
-    return NUMBER_VAL(AS_ARRAY(args[-1])->values.count);
+    return NUMBER_VAL(AS_ARRAY(args[-1])->count);
+}
+
+// Returns a view of the elements start to end, excluding end, that
+// shares the array's storage until one of the two is modified
+static Value array_SliceNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[-1])) {
+        runtimeError("Value is not an array");
+        return NIL_VAL;
+    }
+    if (argCount < 1 || argCount > 2 || !IS_NUMBER(args[0]) || (argCount == 2 && !IS_NUMBER(args[1]))) {
+        runtimeError("Array.slice() expects one or two arguments: start, end");
+        return NIL_VAL;
+    }
+
+    int count = AS_ARRAY(args[-1])->count;
+    int start = (int)AS_NUMBER(args[0]);
+    int end = argCount == 2 ? (int)AS_NUMBER(args[1]) : count;
+    if (start < 0 || end > count || start > end) {
+        runtimeError("Array.slice() range %d..%d is out of bounds for length %d", start, end, count);
+        return NIL_VAL;
+    }
+
+    ObjArray* slice = newArray();
+    // the allocation may have moved the array
+    sliceArray(slice, AS_ARRAY(args[-1]), start, end);
+    return OBJ_VAL(slice);
+}
+
+// The numeric natives below run over the packed doubles directly. An
+// empty array counts as a number array of length 0
+static ObjArray* numberArray(Value value, const char* method) {
+    if (!IS_ARRAY(value)) {
+        runtimeError("Array.%s() expects an array", method);
+        return NULL;
+    }
+
+    ObjArray* arr = AS_ARRAY(value);
+    if (arr->count > 0 && !arr->isPacked) {
+        runtimeError("Array.%s() expects an array of numbers", method);
+        return NULL;
+    }
+    return arr;
+}
+
+static Value array_SumNative(int argCount, Value* args) {
+    ObjArray* arr = numberArray(args[-1], "sum");
+    if (arr == NULL) return NIL_VAL;
+    if (argCount != 0) {
+        runtimeError("Array.sum() doesn't expect arguments");
+        return NIL_VAL;
+    }
+
+    if (arr->count == 0) return NUMBER_VAL(0);
+    return NUMBER_VAL(simd.sum(arr->numbers, arr->count));
+}
+
+static Value array_MinNative(int argCount, Value* args) {
+    ObjArray* arr = numberArray(args[-1], "min");
+    if (arr == NULL) return NIL_VAL;
+    if (argCount != 0) {
+        runtimeError("Array.min() doesn't expect arguments");
+        return NIL_VAL;
+    }
+
+    if (arr->count == 0) return NIL_VAL;
+    return NUMBER_VAL(simd.min(arr->numbers, arr->count));
+}
+
+static Value array_MaxNative(int argCount, Value* args) {
+    ObjArray* arr = numberArray(args[-1], "max");
+    if (arr == NULL) return NIL_VAL;
+    if (argCount != 0) {
+        runtimeError("Array.max() doesn't expect arguments");
+        return NIL_VAL;
+    }
+
+    if (arr->count == 0) return NIL_VAL;
+    return NUMBER_VAL(simd.max(arr->numbers, arr->count));
+}
+
+static Value array_DotNative(int argCount, Value* args) {
+    ObjArray* arr = numberArray(args[-1], "dot");
+    if (arr == NULL) return NIL_VAL;
+    if (argCount != 1) {
+        runtimeError("Array.dot() expects one argument: other");
+        return NIL_VAL;
+    }
+
+    ObjArray* other = numberArray(args[0], "dot");
+    if (other == NULL) return NIL_VAL;
+    if (other->count != arr->count) {
+        runtimeError("Array.dot() expects arrays of the same length, got %d and %d", arr->count, other->count);
+        return NIL_VAL;
+    }
+
+    if (arr->count == 0) return NUMBER_VAL(0);
+    return NUMBER_VAL(simd.dot(arr->numbers, other->numbers, arr->count));
+}
+
+static Value array_ScaleNative(int argCount, Value* args) {
+    ObjArray* arr = numberArray(args[-1], "scale");
+    if (arr == NULL) return NIL_VAL;
+    if (argCount != 1 || !IS_NUMBER(args[0])) {
+        runtimeError("Array.scale() expects one argument: factor");
+        return NIL_VAL;
+    }
+
+    makeArrayWritable(arr);
+    if (arr->count > 0) simd.scale(arr->numbers, arr->count, AS_NUMBER(args[0]));
+    return OBJ_VAL(arr);
+}
+
+static Value array_AddArrayNative(int argCount, Value* args) {
+    ObjArray* arr = numberArray(args[-1], "addArray");
+    if (arr == NULL) return NIL_VAL;
+    if (argCount != 1) {
+        runtimeError("Array.addArray() expects one argument: other");
+        return NIL_VAL;
+    }
+
+    ObjArray* other = numberArray(args[0], "addArray");
+    if (other == NULL) return NIL_VAL;
+    if (other->count != arr->count) {
+        runtimeError("Array.addArray() expects arrays of the same length, got %d and %d", arr->count, other->count);
+        return NIL_VAL;
+    }
+
+    makeArrayWritable(arr);
+    if (arr->count > 0) simd.add(arr->numbers, other->numbers, arr->count);
+    return OBJ_VAL(arr);
+}
+
+static Value array_FillNative(int argCount, Value* args) {
+    ObjArray* arr = numberArray(args[-1], "fill");
+    if (arr == NULL) return NIL_VAL;
+    if (argCount != 1 || !IS_NUMBER(args[0])) {
+        runtimeError("Array.fill() expects one argument: value");
+        return NIL_VAL;
+    }
+
+    makeArrayWritable(arr);
+    if (arr->count > 0) simd.fill(arr->numbers, arr->count, AS_NUMBER(args[0]));
+    return OBJ_VAL(arr);
+}
+
+// Appends start, start + 1, ... up to but excluding end
+static Value array_RangeNative(int argCount, Value* args) {
+    ObjArray* arr = numberArray(args[-1], "range");
+    if (arr == NULL) return NIL_VAL;
+    if (argCount != 2 || !IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
+        runtimeError("Array.range() expects two arguments: start, end");
+        return NIL_VAL;
+    }
+
+    double start = AS_NUMBER(args[0]);
+    double end = AS_NUMBER(args[1]);
+    // NaN would slip past both checks below and cast to a garbage length
+    if (!isfinite(start) || !isfinite(end)) {
+        runtimeError("Array.range() bounds must be finite numbers");
+        return NIL_VAL;
+    }
+    if (end <= start) return OBJ_VAL(arr);
+    if (end - start > INT32_MAX - arr->count) {
+        runtimeError("Array.range() is too large");
+        return NIL_VAL;
+    }
+
+    int length = (int)(end - start);
+    if (start + length < end) length++;
+    reserveArray(arr, VAL_NUMBER, arr->count + length);
+    simd.iota(arr->numbers + arr->count, length, start);
+    arr->count += length;
+    return OBJ_VAL(arr);
+}
+
+static InterpretResult run(int baseFrame);
+
+// Calls the callee sitting below the argc arguments on top of the stack
+// and leaves its result in their place. Closures run in a nested run()
+// that hands control back when their frame returns. On failure the error
+// has been reported and the stack reset, the caller must return at once.
+// Every closure callback enters run() again, once per element. Driving
+// them from the caller's dispatch loop instead would take turning each
+// native, the merge sort's runs included, into a state machine resumed
+// on OP_RETURN. The nested loop shares the stack and the frames, so a
+// callback costs a C call and the dispatch setup on top of the call
+// itself, and the natives still beat the interpreted loops
+// (profiler/perf_test_8.lox)
+static bool callFromNative(int argc) {
+    int baseFrame = vm.frameArray.count;
+    if (!callValue(peek(argc), argc)) return false;
+    if (vm.frameArray.count == baseFrame) return true;
+
+    return run(baseFrame) == INTERPRET_OK;
+}
+
+// The callbacks below may grow the stack or move objects, so natives that
+// make them address their arguments by stack slot and reload every object
+#define NATIVE_SLOT(index) (vm.stack.values[index])
+#define SLOT_ARRAY(index) AS_ARRAY(vm.stack.values[index])
+
+static Value array_MapNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[-1])) {
+        runtimeError("Value is not an array");
+        return NIL_VAL;
+    }
+    if (argCount != 1) {
+        runtimeError("Array.map() expects one argument: function");
+        return NIL_VAL;
+    }
+
+    int base = (int)(args - vm.stack.values);
+    int count = AS_ARRAY(args[-1])->count;
+    push(OBJ_VAL(newArray()));
+
+    for (int i = 0; i < SLOT_ARRAY(base - 1)->count; i++) {
+        push(NATIVE_SLOT(base));
+        push(arrayElement(SLOT_ARRAY(base - 1), i));
+        if (!callFromNative(1)) return NIL_VAL;
+
+        ObjArray* result = SLOT_ARRAY(base + 1);
+        if (!appendArray(result, peek(0))) {
+            runtimeError("Array.map() results must all have the same type");
+            return NIL_VAL;
+        }
+        // the first result fixes the type, size the rest up front
+        if (i == 0) reserveArray(result, result->type, count);
+        pop();
+    }
+
+    return pop();
+}
+
+static Value array_FilterNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[-1])) {
+        runtimeError("Value is not an array");
+        return NIL_VAL;
+    }
+    if (argCount != 1) {
+        runtimeError("Array.filter() expects one argument: predicate");
+        return NIL_VAL;
+    }
+
+    int base = (int)(args - vm.stack.values);
+    ObjArray* arr = AS_ARRAY(args[-1]);
+    ValueType type = arr->type;
+    int count = arr->count;
+    push(OBJ_VAL(newArray()));
+    if (count > 0) reserveArray(SLOT_ARRAY(base + 1), type, count);
+
+    for (int i = 0; i < SLOT_ARRAY(base - 1)->count; i++) {
+        push(NATIVE_SLOT(base));
+        push(arrayElement(SLOT_ARRAY(base - 1), i));
+        if (!callFromNative(1)) return NIL_VAL;
+
+        if (!isFalsey(pop())) {
+            appendArray(SLOT_ARRAY(base + 1), arrayElement(SLOT_ARRAY(base - 1), i));
+        }
+    }
+
+    return pop();
+}
+
+static Value array_ReduceNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[-1])) {
+        runtimeError("Value is not an array");
+        return NIL_VAL;
+    }
+    if (argCount != 1 && argCount != 2) {
+        runtimeError("Array.reduce() expects one or two arguments: function, initial");
+        return NIL_VAL;
+    }
+
+    int base = (int)(args - vm.stack.values);
+    ObjArray* arr = AS_ARRAY(args[-1]);
+    int start = 0;
+
+    // the accumulator lives on the stack, above the arguments
+    if (argCount == 2) {
+        push(args[1]);
+    } else if (arr->count > 0) {
+        push(arrayElement(arr, 0));
+        start = 1;
+    } else {
+        return NIL_VAL;
+    }
+
+    for (int i = start; i < SLOT_ARRAY(base - 1)->count; i++) {
+        Value acc = pop();
+        push(NATIVE_SLOT(base));
+        push(acc);
+        push(arrayElement(SLOT_ARRAY(base - 1), i));
+        if (!callFromNative(2)) return NIL_VAL;
+    }
+
+    return pop();
+}
+
+static Value array_ForEachNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[-1])) {
+        runtimeError("Value is not an array");
+        return NIL_VAL;
+    }
+    if (argCount != 1) {
+        runtimeError("Array.forEach() expects one argument: function");
+        return NIL_VAL;
+    }
+
+    int base = (int)(args - vm.stack.values);
+    for (int i = 0; i < SLOT_ARRAY(base - 1)->count; i++) {
+        push(NATIVE_SLOT(base));
+        push(arrayElement(SLOT_ARRAY(base - 1), i));
+        if (!callFromNative(1)) return NIL_VAL;
+        pop();
+    }
+
+    return NIL_VAL;
+}
+
+static int compareNumbers(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int compareStrings(const void* a, const void* b) {
+    ObjString* x = AS_STRING(*(const Value*)a);
+    ObjString* y = AS_STRING(*(const Value*)b);
+    int length = x->length < y->length ? x->length : y->length;
+    int result = memcmp(x->chars, y->chars, length);
+    return result != 0 ? result : x->length - y->length;
+}
+
+// Without a comparator only numbers and strings have an order, and
+// sorting them never calls back into Lox
+static bool sortDefault(ObjArray* arr) {
+    makeArrayWritable(arr);
+    if (arr->isPacked) {
+        qsort(arr->numbers, arr->count, sizeof(double), compareNumbers);
+        return true;
+    }
+
+    for (int i = 0; i < arr->count; i++) {
+        if (!IS_STRING(arr->values[i])) {
+            runtimeError("Array.sort() needs a comparator unless the elements are numbers or strings");
+            return false;
+        }
+    }
+    qsort(arr->values, arr->count, sizeof(Value), compareStrings);
+    return true;
+}
+
+// Bottom-up merge sort, stable, calling cmp(left, right) and taking the
+// right element first only when the result is positive. Runs are merged
+// back and forth between the array and a scratch array in stack slot
+// base + 1, both reloaded after every comparison
+static bool sortWithComparator(int base) {
+    int count = SLOT_ARRAY(base - 1)->count;
+    ObjArray* scratch = SLOT_ARRAY(base + 1);
+    reserveArray(scratch, SLOT_ARRAY(base - 1)->type, count);
+    for (int i = 0; i < count; i++) appendArray(scratch, arrayElement(SLOT_ARRAY(base - 1), i));
+
+    int src = base - 1;
+    int dst = base + 1;
+
+    for (int width = 1; width < count; width *= 2) {
+        for (int lo = 0; lo < count; lo += 2 * width) {
+            int mid = lo + width < count ? lo + width : count;
+            int hi = lo + 2 * width < count ? lo + 2 * width : count;
+            int left = lo;
+            int right = mid;
+
+            for (int out = lo; out < hi; out++) {
+                bool takeRight = left >= mid;
+                if (left < mid && right < hi) {
+                    push(NATIVE_SLOT(base));
+                    push(arrayElement(SLOT_ARRAY(src), left));
+                    push(arrayElement(SLOT_ARRAY(src), right));
+                    if (!callFromNative(2)) return false;
+
+                    Value order = pop();
+                    if (!IS_NUMBER(order)) {
+                        runtimeError("Array.sort() comparator must return a number");
+                        return false;
+                    }
+                    if (SLOT_ARRAY(base - 1)->count != count) {
+                        runtimeError("Array was resized during sort");
+                        return false;
+                    }
+                    takeRight = AS_NUMBER(order) > 0;
+                }
+
+                int from = takeRight ? right++ : left++;
+                arraySet(SLOT_ARRAY(dst), out, arrayElement(SLOT_ARRAY(src), from));
+            }
+        }
+
+        int swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != base - 1) {
+        for (int i = 0; i < count; i++) {
+            arraySet(SLOT_ARRAY(base - 1), i, arrayElement(SLOT_ARRAY(src), i));
+        }
+    }
+    return true;
+}
+
+static Value array_SortNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[-1])) {
+        runtimeError("Value is not an array");
+        return NIL_VAL;
+    }
+    if (argCount > 1) {
+        runtimeError("Array.sort() expects at most one argument: comparator");
+        return NIL_VAL;
+    }
+
+    ObjArray* arr = AS_ARRAY(args[-1]);
+    if (arr->count < 2) return OBJ_VAL(arr);
+
+    if (argCount == 0) {
+        if (!sortDefault(arr)) return NIL_VAL;
+        return OBJ_VAL(arr);
+    }
+
+    int base = (int)(args - vm.stack.values);
+    push(OBJ_VAL(newArray()));
+    if (!sortWithComparator(base)) return NIL_VAL;
+    pop();
+
+    return NATIVE_SLOT(base - 1);
+}
+
+static Value array_IndexOfNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[-1])) {
+        runtimeError("Value is not an array");
+        return NIL_VAL;
+    }
+    if (argCount != 1) {
+        runtimeError("Array.indexOf() expects one argument: value");
+        return NIL_VAL;
+    }
+
+    ObjArray* arr = AS_ARRAY(args[-1]);
+    Value value = args[0];
+
+    if (arr->isPacked) {
+        if (!IS_NUMBER(value)) return NUMBER_VAL(-1);
+        double number = AS_NUMBER(value);
+        for (int i = 0; i < arr->count; i++) {
+            if (arr->numbers[i] == number) return NUMBER_VAL(i);
+        }
+        return NUMBER_VAL(-1);
+    }
+
+    for (int i = 0; i < arr->count; i++) {
+        if (valuesEqual(arr->values[i], value)) return NUMBER_VAL(i);
+    }
+    return NUMBER_VAL(-1);
+}
+
+static Value array_ReverseNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[-1])) {
+        runtimeError("Value is not an array");
+        return NIL_VAL;
+    }
+    if (argCount != 0) {
+        runtimeError("Array.reverse() doesn't expect arguments");
+        return NIL_VAL;
+    }
+
+    ObjArray* arr = AS_ARRAY(args[-1]);
+    makeArrayWritable(arr);
+    for (int i = 0, j = arr->count - 1; i < j; i++, j--) {
+        if (arr->isPacked) {
+            double swap = arr->numbers[i];
+            arr->numbers[i] = arr->numbers[j];
+            arr->numbers[j] = swap;
+        } else {
+            Value swap = arr->values[i];
+            arr->values[i] = arr->values[j];
+            arr->values[j] = swap;
+        }
+    }
+    return OBJ_VAL(arr);
 }
 
 static Value dict_AddNative(int argCount, Value* args) {
@@ -645,21 +1234,14 @@ static Value dict_AddNative(int argCount, Value* args) {
 
 
     ObjDictionary* dict = AS_MAP(args[-1]);
-    push(OBJ_VAL(dict));
-    ObjString* key = valueToString(args[0]);
-    pop();
+    Value key = args[0];
 
 
-    Value value;
-    if (!tableSet(&dict->map, key, args[1])) {
+    if (!dictSet(&dict->map, key, args[1])) {
         // runtimeError("Entry already exists in dictionary");
         return NIL_VAL;
     }
 
-
-    Entry entry = {.key = key, .value = args[1]};
-    writeEntryList(&dict->entries, entry);
-
     markDirty((Obj*)dict);
     return OBJ_VAL(dict);
 }
@@ -675,11 +1257,9 @@ static Value dict_SetNative(int argCount, Value* args) {
     }
 
     ObjDictionary* dict = AS_MAP(args[-1]);
-    push(OBJ_VAL(dict));
-    ObjString* key = valueToString(args[0]);
-    pop();
+    Value key = args[0];
 
-    tableSet(&dict->map, key, args[1]);
+    dictSet(&dict->map, key, args[1]);
 
     markDirty((Obj*)dict);
     return args[1];
@@ -697,12 +1277,10 @@ static Value dict_GetNative(int argCount, Value* args) {
     }
 
     ObjDictionary* dict = AS_MAP(args[-1]);
-    push(OBJ_VAL(dict));
-    ObjString* key = valueToString(args[0]);
-    pop();
+    Value key = args[0];
 
     Value value;
-    if (!tableGet(&dict->map, key, &value)) {
+    if (!dictGet(&dict->map, key, &value)) {
         // runtimeError("Key not found");
         return NIL_VAL;
     }
@@ -721,11 +1299,9 @@ static Value dict_RemoveNative(int argCount, Value* args) {
     }
 
     ObjDictionary* dict = AS_MAP(args[-1]);
-    push(OBJ_VAL(dict));
-    ObjString* key = valueToString(args[0]);
-    pop();
+    Value key = args[0];
 
-    if (!tableDelete(&dict->map, key)) {
+    if (!dictDelete(&dict->map, key)) {
         // runtimeError("Key not found");
         return NUMBER_VAL(0);
     }
@@ -744,24 +1320,161 @@ static Value dict_LengthNative(int argCount, Value* args) {
         return NIL_VAL;
     }
 
-    return NUMBER_VAL(AS_MAP(args[-1])->entries.count);
+    return NUMBER_VAL(AS_MAP(args[-1])->map.count);
+}
+
+// Array(length, fill) makes an array of length copies of fill, zeros when
+// fill is left out, allocated at its final size
+static Value arrayNative(int argCount, Value* args) {
+    if (argCount > 2) {
+        runtimeError("Array() expects at most two arguments: length, fill");
+        return NIL_VAL;
+    }
+
+    int length = 0;
+    if (argCount > 0 && !sizeArgument(args[0], "Array() length", INT32_MAX, &length)) return NIL_VAL;
+
+    ObjArray* arr = newArray();
+    if (length == 0) return OBJ_VAL(arr);
+
+    // read after allocating, a collection may have moved an object fill
+    Value fill = argCount == 2 ? args[1] : NUMBER_VAL(0);
+    reserveArray(arr, fill.type, length);
+
+    if (arr->isPacked) {
+        simd.fill(arr->numbers, length, AS_NUMBER(fill));
+    } else {
+        for (int i = 0; i < length; i++) arr->values[i] = fill;
+        markDirty((Obj*)arr);
+    }
+    arr->count = length;
+    return OBJ_VAL(arr);
+}
+
+// Dict(capacity) makes an empty dictionary with room for capacity pairs
+static Value dictNative(int argCount, Value* args) {
+    if (argCount > 1) {
+        runtimeError("Dict() expects at most one argument: capacity");
+        return NIL_VAL;
+    }
+
+    int capacity = 0;
+    if (argCount == 1 && !sizeArgument(args[0], "Dict() capacity", DICT_MAX_CAPACITY, &capacity)) return NIL_VAL;
+
+    ObjDictionary* dict = newDictionary();
+    if (capacity > 0) dictReserve(&dict->map, capacity);
+    return OBJ_VAL(dict);
+}
+
+static Value stringBuilderNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        runtimeError("StringBuilder() doesn't expect arguments");
+        return NIL_VAL;
+    }
+
+    return OBJ_VAL(newStringBuilder());
+}
+
+static Value builder_AppendNative(int argCount, Value* args) {
+    if (!IS_STRING_BUILDER(args[-1])) {
+        runtimeError("Value is not a string builder");
+        return NIL_VAL;
+    }
+    if (argCount != 1) {
+        runtimeError("StringBuilder.append() expects only one argument");
+        return NIL_VAL;
+    }
+
+    Value value = args[0];
+
+    // numbers, bools and nil are formatted straight into the buffer,
+    // so appending them never allocates (or interns) a temporary string
+    if (IS_STRING(value)) {
+        appendStringBuilder(AS_STRING_BUILDER(args[-1]), AS_CSTRING(value), AS_STRING(value)->length);
+    } else if (IS_NUMBER(value)) {
+        char buffer[40];
+        double num = AS_NUMBER(value);
+        int length = num == (int)num ? snprintf(buffer, sizeof(buffer), "%d", (int)num)
+                                     : snprintf(buffer, sizeof(buffer), "%g", num);
+        appendStringBuilder(AS_STRING_BUILDER(args[-1]), buffer, length);
+    } else if (IS_BOOL(value)) {
+        AS_BOOL(value) ? appendStringBuilder(AS_STRING_BUILDER(args[-1]), "true", 4)
+                       : appendStringBuilder(AS_STRING_BUILDER(args[-1]), "false", 5);
+    } else if (IS_NIL(value)) {
+        appendStringBuilder(AS_STRING_BUILDER(args[-1]), "nil", 3);
+    } else {
+        // valueToString can trigger a collection, so the builder is
+        // read back from the stack only after the string exists
+        ObjString* string = valueToString(value);
+        appendStringBuilder(AS_STRING_BUILDER(args[-1]), string->chars, string->length);
+    }
+
+    return args[-1];
+}
+
+static Value builder_ToStringNative(int argCount, Value* args) {
+    if (!IS_STRING_BUILDER(args[-1])) {
+        runtimeError("Value is not a string builder");
+        return NIL_VAL;
+    }
+    if (argCount != 0) {
+        runtimeError("StringBuilder.toString() doesn't expect arguments");
+        return NIL_VAL;
+    }
+
+    ObjStringBuilder* builder = AS_STRING_BUILDER(args[-1]);
+    return OBJ_VAL(copyString(builder->length > 0 ? builder->chars : "", builder->length));
+}
+
+static Value builder_LengthNative(int argCount, Value* args) {
+    if (!IS_STRING_BUILDER(args[-1])) {
+        runtimeError("Value is not a string builder");
+        return NIL_VAL;
+    }
+    if (argCount != 0) {
+        runtimeError("StringBuilder.length() doesn't expect arguments");
+        return NIL_VAL;
+    }
+
+    return NUMBER_VAL(AS_STRING_BUILDER(args[-1])->length);
+}
+
+static Value builder_ClearNative(int argCount, Value* args) {
+    if (!IS_STRING_BUILDER(args[-1])) {
+        runtimeError("Value is not a string builder");
+        return NIL_VAL;
+    }
+    if (argCount != 0) {
+        runtimeError("StringBuilder.clear() doesn't expect arguments");
+        return NIL_VAL;
+    }
+
+    // keeps the buffer around for reuse
+    ObjStringBuilder* builder = AS_STRING_BUILDER(args[-1]);
+    builder->length = 0;
+    if (builder->chars != NULL) builder->chars[0] = '\0';
+    return args[-1];
 }
 
 void initVM() {
     initGenHeap();
+    initSimd();
     vm.nextGC = 8 * 1024 * 1024;
     vm.isCollecting = false;
     vm.isInMajor = false;
     vm.isInMinor = false;
     vm.stack.count = 0;
-    vm.stack.capacity = STACK_INIT_CAPACITY;
-    vm.stack.values = ALLOCATE(Value, vm.stack.capacity);
+    vm.stack.capacity = 0;
+    vm.stack.values = reserveStack(align(sizeof(Value) * STACK_MAX, PAGE_SIZE));
+    vm.reservedStack = vm.stack.values + STACK_MAX;
     vm.stackTop = vm.stack.values;
     vm.openUpvalues = NULL;
 
 
     initValueArray(&vm.queue[0]);
     initCallFrameArray(&vm.frameArray);
+    commitFrames();
+    commitValues(vm.stack.values + STACK_INIT_CAPACITY);
 
     initTable(&vm.strings);
     initTable(&vm.globals);
@@ -784,12 +1497,37 @@ void initVM() {
     defineBuiltinMethod(vm.arrayClass, "get", array_GetNative);
     defineBuiltinMethod(vm.arrayClass, "pop", array_PopNative);
     defineBuiltinMethod(vm.arrayClass, "length", array_LengthNative);
+    defineBuiltinMethod(vm.arrayClass, "reserve", array_ReserveNative);
+    defineBuiltinMethod(vm.arrayClass, "slice", array_SliceNative);
+    defineBuiltinMethod(vm.arrayClass, "sum", array_SumNative);
+    defineBuiltinMethod(vm.arrayClass, "min", array_MinNative);
+    defineBuiltinMethod(vm.arrayClass, "max", array_MaxNative);
+    defineBuiltinMethod(vm.arrayClass, "dot", array_DotNative);
+    defineBuiltinMethod(vm.arrayClass, "scale", array_ScaleNative);
+    defineBuiltinMethod(vm.arrayClass, "addArray", array_AddArrayNative);
+    defineBuiltinMethod(vm.arrayClass, "fill", array_FillNative);
+    defineBuiltinMethod(vm.arrayClass, "range", array_RangeNative);
+    defineBuiltinMethod(vm.arrayClass, "map", array_MapNative);
+    defineBuiltinMethod(vm.arrayClass, "filter", array_FilterNative);
+    defineBuiltinMethod(vm.arrayClass, "reduce", array_ReduceNative);
+    defineBuiltinMethod(vm.arrayClass, "forEach", array_ForEachNative);
+    defineBuiltinMethod(vm.arrayClass, "sort", array_SortNative);
+    defineBuiltinMethod(vm.arrayClass, "indexOf", array_IndexOfNative);
+    defineBuiltinMethod(vm.arrayClass, "reverse", array_ReverseNative);
     vm.dictClass = defineBuiltinClass(vm.dict_NativeString);
     defineBuiltinMethod(vm.dictClass, "add", dict_AddNative);
     defineBuiltinMethod(vm.dictClass, "set", dict_SetNative);
     defineBuiltinMethod(vm.dictClass, "get", dict_GetNative);
     defineBuiltinMethod(vm.dictClass, "remove", dict_RemoveNative);
     defineBuiltinMethod(vm.dictClass, "length", dict_LengthNative);
+    defineNative("Array", arrayNative);
+    defineNative("Dict", dictNative);
+    defineNative("StringBuilder", stringBuilderNative);
+    vm.stringBuilderClass = defineBuiltinClass(copyString("__StringBuilder__", 17));
+    defineBuiltinMethod(vm.stringBuilderClass, "append", builder_AppendNative);
+    defineBuiltinMethod(vm.stringBuilderClass, "toString", builder_ToStringNative);
+    defineBuiltinMethod(vm.stringBuilderClass, "length", builder_LengthNative);
+    defineBuiltinMethod(vm.stringBuilderClass, "clear", builder_ClearNative);
 }
 
 void freeVM() {
@@ -803,7 +1541,8 @@ void freeVM() {
 
     vm.nestingLevel = 0;
 
-    FREE_ARRAY(Value, vm.stack.values, vm.stack.capacity);
+    release(vm.stack.values, align(sizeof(Value) * STACK_MAX, PAGE_SIZE) + PAGE_SIZE);
+    vm.stack.values = NULL;
     vm.stack.capacity = 0;
     vm.stackTop = NULL;
 
@@ -815,12 +1554,14 @@ void freeVM() {
     vm.dict_NativeString = NULL;
 }
 
-static InterpretResult run() {
+static InterpretResult run(int baseFrame) {
     CallFrame* frame = &vm.frameArray.frames[vm.frameArray.count - 1];
+    // high bits of the next operand, left by OP_WIDE
+    uint32_t wide = 0;
+    uint32_t arg;
 
     static void* dispatchTable[] = {
         &&DO_OP_CONSTANT,
-        &&DO_OP_CONSTANT_LONG,
         &&DO_OP_NIL,
         &&DO_OP_TRUE,
         &&DO_OP_FALSE,
@@ -831,16 +1572,13 @@ static InterpretResult run() {
         &&DO_OP_LOOP,
         &&DO_OP_GET_LOCAL,
         &&DO_OP_GET_GLOBAL,
-        &&DO_OP_GET_GLOBAL_LONG,
         &&DO_OP_DEFINE_GLOBAL,
         &&DO_OP_DEFINE_CONST_GLOBAL,
-        &&DO_OP_DEFINE_GLOBAL_LONG,
-        &&DO_OP_DEFINE_CONST_GLOBAL_LONG,
         &&DO_OP_SET_LOCAL,
         &&DO_OP_SET_GLOBAL,
-        &&DO_OP_SET_GLOBAL_LONG,
         &&DO_OP_CLOSURE,
         &&DO_OP_CALL,
+        &&DO_OP_TAIL_CALL,
         &&DO_OP_ARRAY_CALL,
         &&DO_OP_GET_UPVALUE,
         &&DO_OP_SET_UPVALUE,
@@ -850,15 +1588,11 @@ static InterpretResult run() {
         &&DO_OP_SWAP,
         &&DO_OP_CLOSE_UPVALUE,
         &&DO_OP_ARRAY,
-        &&DO_OP_ARRAY_LONG,
         &&DO_OP_MAP,
-        &&DO_OP_MAP_LONG,
         &&DO_OP_GET_ELEMENT,
         &&DO_OP_SET_ELEMENT,
         &&DO_OP_GET_ELEMENT_GLOBAL,
         &&DO_OP_SET_ELEMENT_GLOBAL,
-        &&DO_OP_GET_ELEMENT_GLOBAL_LONG,
-        &&DO_OP_SET_ELEMENT_GLOBAL_LONG,
         &&DO_OP_FOR_EACH,
         &&DO_OP_SAVE_VALUE,
         &&DO_OP_REVERSE_N,
@@ -875,6 +1609,7 @@ static InterpretResult run() {
         &&DO_OP_RANGE,
         &&DO_OP_EQUAL,
         &&DO_OP_EQUAL_AND,
+        &&DO_OP_MATCH_TABLE,
         &&DO_OP_GREATER,
         &&DO_OP_LESS,
         &&DO_OP_ADD,
@@ -883,6 +1618,13 @@ static InterpretResult run() {
         &&DO_OP_DIVIDE,
         &&DO_OP_NOT,
         &&DO_OP_NEGATE,
+        &&DO_OP_ADD_NUM,
+        &&DO_OP_SUBTRACT_NUM,
+        &&DO_OP_MULTIPLY_NUM,
+        &&DO_OP_DIVIDE_NUM,
+        &&DO_OP_NEGATE_NUM,
+        &&DO_OP_GREATER_NUM,
+        &&DO_OP_LESS_NUM,
         &&DO_OP_PRINT,
         &&DO_OP_RETURN,
         &&DO_OP_CLASS,
@@ -893,26 +1635,18 @@ static InterpretResult run() {
         &&DO_OP_INVOKE,
         &&DO_OP_INHERIT,
         &&DO_OP_GET_SUPER,
-        &&DO_OP_GET_PROPERTY_LONG,
-        &&DO_OP_SET_PROPERTY_LONG,
-        &&DO_OP_DEFINE_PROPERTY_LONG,
-        &&DO_OP_INVOKE_LONG,
-        &&DO_OP_GET_SUPER_LONG,
-        &&DO_OP_METHOD_LONG,
-        &&DO_OP_CLASS_LONG,
-        &&DO_OP_CLOSURE_LONG
+        &&DO_OP_WIDE
     };
 
     #define DISPATCH() goto *dispatchTable[*frame->ip++]
 
     #define READ_BYTE() (*frame->ip++)
     #define READ_WORD() (frame->ip += 2, (uint16_t)(frame->ip[-2] << 8 | frame->ip[-1]))
-    #define READ_LONG() (frame->ip += 3, (uint32_t)(frame->ip[-3] | frame->ip[-2] << 8 | frame->ip[-1] << 16))
-    #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-    #define READ_CONSTANT_LONG() (frame->closure->function->chunk.constants.values[READ_LONG()])
+    // the operand byte of an instruction OP_WIDE may come before
+    #define READ_ARG() (arg = wide | READ_BYTE(), wide = 0, arg)
+    #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_ARG()])
 
     #define READ_STRING() AS_STRING(READ_CONSTANT())
-    #define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
 
     #define BINARY_OP(valueType, op)\
         do {\
@@ -925,6 +1659,29 @@ static InterpretResult run() {
             push(valueType(a op b));\
         } while(0)
 
+    // Operands the compiler knows to be numbers. DEBUG_CHECK_NUMBERS
+    // checks them anyway, to catch it being wrong
+#ifdef DEBUG_CHECK_NUMBERS
+    #define CHECK_NUMBERS(count)\
+        do {\
+            for (int i = 0; i < (count); i++) {\
+                if (!IS_NUMBER(peek(i))) {\
+                    runtimeError("Operand taken for a number is not one.");\
+                    return INTERPRET_RUNTIME_ERROR;\
+                }\
+            }\
+        } while(0)
+#else
+    #define CHECK_NUMBERS(count) do { } while(0)
+#endif
+
+    #define NUMBER_OP(valueType, op)\
+        do {\
+            CHECK_NUMBERS(2);\
+            vm.stackTop--;\
+            vm.stackTop[-1] = valueType(AS_NUMBER(vm.stackTop[-1]) op AS_NUMBER(vm.stackTop[0]));\
+        } while(0)
+
     #ifdef DEBUG_TRACE_EXECUTION
         // int count = 0;
     #endif
@@ -960,12 +1717,6 @@ static InterpretResult run() {
             push(constant);
             DISPATCH();
         }
-        DO_OP_CONSTANT_LONG: {
-            uint32_t longIndex = READ_LONG(); // longIndex is 3 bytes
-            Value constantLong = frame->closure->function->chunk.constants.values[longIndex];
-            push(constantLong);
-            DISPATCH();
-        }
         DO_OP_NIL:
             push(NIL_VAL); DISPATCH();
         DO_OP_TRUE:
@@ -978,17 +1729,20 @@ static InterpretResult run() {
             pop();
             DISPATCH();
         DO_OP_JUMP: {
-            uint16_t offset = READ_WORD();
+            uint32_t offset = wide << 8 | READ_WORD();
+            wide = 0;
             frame->ip += offset;
             DISPATCH();
         }
         DO_OP_LOOP: {
-            uint16_t offset = READ_WORD();
+            uint32_t offset = wide << 8 | READ_WORD();
+            wide = 0;
             frame->ip -= offset;
             DISPATCH();
         }
         DO_OP_JUMP_IF_FALSE: {
-            uint16_t offset = READ_WORD();
+            uint32_t offset = wide << 8 | READ_WORD();
+            wide = 0;
             // checking the if condtition on top of the stack
             if (isFalsey(peek(0))) frame->ip += offset;
             DISPATCH();
@@ -1010,17 +1764,6 @@ static InterpretResult run() {
             push(value);
             DISPATCH();
         }
-        DO_OP_GET_GLOBAL_LONG: {
-            uint32_t longIndex = READ_LONG();
-            ObjString* name = AS_STRING(frame->closure->function->chunk.constants.values[longIndex]);
-            Value valueLong;
-            if(!tableGet(&vm.globals, name, &valueLong)) {
-                runtimeError("Undefined variable '%s' .", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(valueLong);
-            DISPATCH();
-        }
         DO_OP_DEFINE_GLOBAL: {
             ObjString* name = READ_STRING();
             Value value = peek(0);
@@ -1045,28 +1788,6 @@ static InterpretResult run() {
             pop();
             DISPATCH();
         }
-        DO_OP_DEFINE_GLOBAL_LONG: {
-            uint32_t longIndex = READ_LONG();
-            ObjString* name = AS_STRING(frame->closure->function->chunk.constants.values[longIndex]);
-            Value value = peek(0);
-            if (!tableSet(&vm.globals, name, value) || tableGet(&vm.constGlobals, name, &value)) {
-                runtimeError("Variable '%s' is already defined.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            pop();
-            DISPATCH();
-        }
-        DO_OP_DEFINE_CONST_GLOBAL_LONG: {
-            uint32_t longIndex = READ_LONG();
-            ObjString* name = AS_STRING(frame->closure->function->chunk.constants.values[longIndex]);
-            Value value = peek(0);
-            if (!tableSet(&vm.constGlobals, name, value) || tableGet(&vm.globals, name, &value)) {
-                runtimeError("Variable '%s' is already defined.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            pop();
-            DISPATCH();
-        }
         DO_OP_SET_LOCAL: {
             // we need to push the local's value on top of the stack since
             // other bytecode instructions only look for stackTop - 1
@@ -1090,27 +1811,14 @@ static InterpretResult run() {
 
             DISPATCH();
         }
-        DO_OP_SET_GLOBAL_LONG: {
-            uint32_t longIndex = READ_LONG();
-            ObjString* name = AS_STRING(frame->closure->function->chunk.constants.values[longIndex]);
-            if (tableFindString(&vm.constGlobals, name->chars, name->length, name->hash)) {
-                runtimeError("Variable '%s' is const.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            if (tableSet(&vm.globals, name, peek(0))) {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            DISPATCH();
-        }
-
         DO_OP_ARRAY: {
-            int length = READ_BYTE();
+            int length = READ_ARG();
             // -1 because peek already returns last element so this way
             // distance becomes -1 -(length - 1),  thus length elements from top
             ObjArray* arr = newArray();
             push(OBJ_VAL(arr));
+            // sized for the literal, typed by its first element
+            if (length > 0) reserveArray(arr, peek(length).type, length);
 
             for (int i = length - 1; i >= 0; i--) {
                 if (!appendArray(arr, peek(i + 1))) {
@@ -1130,80 +1838,27 @@ static InterpretResult run() {
             push(OBJ_VAL(arr));
             DISPATCH();
         }
-        DO_OP_ARRAY_LONG: {
-            int length = READ_LONG();
-            // -1 because peek already returns last element so this way
-            // distance becomes -1 -(length - 1),  thus length elements from top
-            ObjArray* arr = newArray();
-            push(OBJ_VAL(arr));
-
-            for (int i = length - 1; i >= 0; i--) {
-                if (!appendArray(arr, peek(i + 1))) {
-                    ObjString* errorType = valueTypeToString(peek(i).type);
-                    ObjString* arrType = valueTypeToString(VAL_NUMBER);
-                    runtimeError("Expected a value of type %s but tried to append %s", arrType->chars, errorType->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-            }
-
-            pop();
-
-            for (int i = length - 1; i >= 0; i--) {
-                pop();
-            }
-
-            push(OBJ_VAL(arr));
-            DISPATCH();
-        }
         DO_OP_MAP: {
-            int count = READ_BYTE();
+            int count = READ_ARG();
             ObjDictionary* dict = newDictionary();
             push(OBJ_VAL(dict));
+            // the literal's keys and values are both on the stack
+            dictReserve(&dict->map, count / 2);
 
             for (int i = count; i > 0; i -= 2) {
-                ObjString* key = valueToString(peek(i));
+                Value key = peek(i);
                 Value elem = peek(i - 1);
 
-                if (tableSet(&dict->map, key, elem)) {
-                    Entry curr = {.key = key, .value = elem};
-                    writeEntryList(&dict->entries, curr);
-                }
+                dictSet(&dict->map, key, elem);
 
                 markDirty((Obj*)dict);
-            }
-
-            for (int i = 0; i < count; i++) {
-                pop();
-            }
-
-            pop();
-            push(OBJ_VAL(dict));
-            DISPATCH();
-        }
-        DO_OP_MAP_LONG: {
-            uint32_t count = READ_LONG();
-            ObjDictionary* dict = newDictionary();
-            push(OBJ_VAL(dict));
-
-            for (int i = count; i > 0; i -= 2) {
-                ObjString* key = valueToString(peek(i));
-                Value elem = peek(i - 1);
-
-                if (tableSet(&dict->map, key, elem)) {
-                    Entry curr = {.key = key, .value = elem};
-                    writeEntryList(&dict->entries, curr);
-                }
-
-                markDirty((Obj*)dict);
-            }
-
-            pop();
+            }
 
             for (int i = 0; i < count; i++) {
                 pop();
             }
 
-
+            pop();
             push(OBJ_VAL(dict));
             DISPATCH();
         }
@@ -1237,17 +1892,16 @@ static InterpretResult run() {
                 }
                 case OBJ_DICTIONARY: {
                     ObjDictionary* dict = AS_MAP(frame->slots[slot]);
-                    push(OBJ_VAL(dict));
-                    ObjString* key = valueToString(elementIndex);
-                    pop();
 
-                    if (!tableGet(&dict->map, key, &value)) {
-                        runtimeError("Key '%s' not found in dictionary\n", key->chars);
+                    if (!dictGet(&dict->map, elementIndex, &value)) {
+                        keyError("Key '%s' not found in dictionary\n", elementIndex);
                         // goto endBranch;
                     }
 
                     break;
                 }
+                case OBJ_STRING_BUILDER:
+                    break;
             }
 
             // endBranch:
@@ -1286,22 +1940,18 @@ static InterpretResult run() {
                     break;
                 }
                 case OBJ_DICTIONARY: {
-                    if (!IS_STRING(elementIndex)) {
-                        runtimeError("Indexing expression must evaluate to string for maps");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
                     ObjDictionary* dict = AS_MAP(frame->slots[slot]);
-                    ObjString* key = AS_STRING(elementIndex);
 
-                    if (tableSet(&dict->map, key, setVal)) {
-                        runtimeError("Key '%s' not found in dictionary\n", key->chars);
+                    if (dictSet(&dict->map, elementIndex, setVal)) {
+                        keyError("Key '%s' not found in dictionary\n", elementIndex);
                         return INTERPRET_RUNTIME_ERROR;
                     }
 
                     markDirty((Obj*)dict);
                     break;
                 }
+                case OBJ_STRING_BUILDER:
+                    break;
 
             }
 
@@ -1314,26 +1964,16 @@ static InterpretResult run() {
             Value elementIndex = pop();
             Value arr;
 
-            if (!IS_STRING(elementIndex) && !IS_NUMBER(elementIndex)) {
-                runtimeError("Array index must evaluate to positive integer.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
             if(!tableGet(&vm.globals, name, &arr)) {
                 runtimeError("Undefined variable '%s' .", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            if (IS_STRING(elementIndex)) {
-                if (!IS_MAP(arr)) {
-                    runtimeError("Element must be a dictionary");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            if (IS_MAP(arr)) {
                 ObjDictionary* dict = AS_MAP(arr);
-                ObjString* key = AS_STRING(elementIndex);
                 Value value;
 
-                if (!tableGet(&dict->map, key, &value)) {
+                if (!dictGet(&dict->map, elementIndex, &value)) {
                     runtimeError("Key not found");
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -1342,54 +1982,16 @@ static InterpretResult run() {
                 DISPATCH();
             }
 
-            if (!IS_ARRAY(arr)) {
-                runtimeError("Indexed variable is not an array");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            ObjArray* cachedArr = AS_ARRAY(arr);
-            Value element;
-            if (!arrayGet(cachedArr, AS_NUMBER(elementIndex), &element)){
-                runtimeError("Index out of bounds.");
+            if (!IS_ARRAY(arr) && !IS_NUMBER(elementIndex)) {
+                runtimeError("Element must be a dictionary");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            push(element);
-            DISPATCH();
-        }
-        DO_OP_GET_ELEMENT_GLOBAL_LONG: {
-            ObjString* name = READ_STRING_LONG();
-            Value elementIndex = pop();
-            Value arr;
-
-            if (!IS_STRING(elementIndex) && !IS_NUMBER(elementIndex)) {
+            if (!IS_NUMBER(elementIndex)) {
                 runtimeError("Array index must evaluate to positive integer.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            if(!tableGet(&vm.globals, name, &arr)) {
-                runtimeError("Undefined variable '%s' .", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            if (IS_STRING(elementIndex)) {
-                if (!IS_MAP(arr)) {
-                    runtimeError("Element must be a dictionary");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjDictionary* dict = AS_MAP(arr);
-                ObjString* key = AS_STRING(elementIndex);
-                Value value;
-
-                if (!tableGet(&dict->map, key, &value)) {
-                    runtimeError("Key not found");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                push(value);
-                DISPATCH();
-            }
-
             if (!IS_ARRAY(arr)) {
                 runtimeError("Indexed variable is not an array");
                 return INTERPRET_RUNTIME_ERROR;
@@ -1411,11 +2013,6 @@ static InterpretResult run() {
             Value elementIndex = peek(0);
             Value arr;
 
-            if (!IS_STRING(elementIndex) && !IS_NUMBER(elementIndex)) {
-                runtimeError("Array index expression must evaluate to positive integer.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
             if (tableFindString(&vm.constGlobals, name->chars, name->length, name->hash)) {
                 runtimeError("Variable '%s' is const.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
@@ -1426,17 +2023,12 @@ static InterpretResult run() {
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            if (IS_STRING(elementIndex)) {
-                if (!IS_MAP(arr)) {
-                    runtimeError("Element must be a dictionary");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            if (IS_MAP(arr)) {
                 ObjDictionary* dict = AS_MAP(arr);
-                ObjString* key = AS_STRING(elementIndex);
 
                 Value value;
-                if (tableSet(&dict->map, key, setValue)) {
-                    runtimeError("'%s' doesn't exist in this dictionary", key->chars);
+                if (dictSet(&dict->map, elementIndex, setValue)) {
+                    keyError("'%s' doesn't exist in this dictionary", elementIndex);
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
@@ -1444,61 +2036,16 @@ static InterpretResult run() {
                 DISPATCH();
             }
 
-            if (!IS_ARRAY(arr)) {
-                runtimeError("Indexed variable is not an array");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            ObjArray* cachedArray = AS_ARRAY(arr);
-
-            if (!arraySet(cachedArray, AS_NUMBER(elementIndex), setValue)) {
-                ObjString* name = valueTypeToString(cachedArray->type);
-                runtimeError("Error in setting element %g of array. Array type is %s", AS_NUMBER(elementIndex), name->chars);
+            if (!IS_ARRAY(arr) && !IS_NUMBER(elementIndex)) {
+                runtimeError("Element must be a dictionary");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            DISPATCH();
-
-        }
-        DO_OP_SET_ELEMENT_GLOBAL_LONG: {
-            ObjString* name = READ_STRING_LONG();
-            Value setValue = pop();
-            Value elementIndex = peek(0);
-            Value arr;
-
-            if (!IS_STRING(elementIndex) && !IS_NUMBER(elementIndex)) {
+            if (!IS_NUMBER(elementIndex)) {
                 runtimeError("Array index expression must evaluate to positive integer.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            if (tableFindString(&vm.constGlobals, name->chars, name->length, name->hash)) {
-                runtimeError("Variable '%s' is const.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            if (!tableGet(&vm.globals, name, &arr)) {
-                runtimeError("Variable '%s' is not defined", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            if (IS_STRING(elementIndex)) {
-                if (!IS_MAP(arr)) {
-                    runtimeError("Element must be a dictionary");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjDictionary* dict = AS_MAP(arr);
-                ObjString* key = AS_STRING(elementIndex);
-
-                Value value;
-                if (tableSet(&dict->map, key, setValue)) {
-                    runtimeError("'%s' doesn't exist in this dictionary", key->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                push(value);
-                DISPATCH();
-            }
-
             if (!IS_ARRAY(arr)) {
                 runtimeError("Indexed variable is not an array");
                 return INTERPRET_RUNTIME_ERROR;
@@ -1528,29 +2075,33 @@ static InterpretResult run() {
 
             switch (AS_OBJ(iterable)->type) {
                 case OBJ_ARRAY: {
-                    if (count >= AS_ARRAY(iterable)->values.count) {
-                        push(NUMBER_VAL(AS_ARRAY(iterable)->values.count));
+                    if (count >= AS_ARRAY(iterable)->count) {
+                        push(NUMBER_VAL(AS_ARRAY(iterable)->count));
                         break;
                     }
 
-                    item = AS_ARRAY(iterable)->values.values[count];
+                    item = arrayElement(AS_ARRAY(iterable), count);
                     frame->slots[arg - 1] = item;
                     frame->slots[arg] = NUMBER_VAL(count);
 
-                    push(NUMBER_VAL(AS_ARRAY(iterable)->values.count));
+                    push(NUMBER_VAL(AS_ARRAY(iterable)->count));
                     break;
                 }
                 case OBJ_DICTIONARY: {
-                    if (count >= AS_MAP(iterable)->map.count) {
-                        push(NUMBER_VAL(AS_MAP(iterable)->map.count));
+                    Dict* map = &AS_MAP(iterable)->map;
+                    // the counter is a position in the dense entries, skip removed pairs
+                    while (count < map->used && IS_DICT_HOLE(map->entries[count].key)) count++;
+
+                    if (count >= map->used) {
+                        push(NUMBER_VAL(map->used));
                         break;
                     }
 
-                    item = OBJ_VAL(AS_MAP(iterable)->entries.entries[count].key);
+                    item = map->entries[count].key;
                     frame->slots[arg - 1] = item;
                     frame->slots[arg] = NUMBER_VAL(count);
 
-                    push(NUMBER_VAL(AS_MAP(iterable)->map.count));
+                    push(NUMBER_VAL(map->used));
                     break;
                 }
                 case OBJ_RANGE: {
@@ -1629,6 +2180,28 @@ static InterpretResult run() {
         DO_OP_GREATER:
             BINARY_OP(BOOL_VAL, >);
             DISPATCH();
+        DO_OP_ADD_NUM:
+            NUMBER_OP(NUMBER_VAL, +);
+            DISPATCH();
+        DO_OP_SUBTRACT_NUM:
+            NUMBER_OP(NUMBER_VAL, -);
+            DISPATCH();
+        DO_OP_MULTIPLY_NUM:
+            NUMBER_OP(NUMBER_VAL, *);
+            DISPATCH();
+        DO_OP_DIVIDE_NUM:
+            NUMBER_OP(NUMBER_VAL, /);
+            DISPATCH();
+        DO_OP_NEGATE_NUM:
+            CHECK_NUMBERS(1);
+            vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+            DISPATCH();
+        DO_OP_GREATER_NUM:
+            NUMBER_OP(BOOL_VAL, >);
+            DISPATCH();
+        DO_OP_LESS_NUM:
+            NUMBER_OP(BOOL_VAL, <);
+            DISPATCH();
         DO_OP_PRINT:
             printValue(pop());
             printf("\n");
@@ -1643,6 +2216,41 @@ static InterpretResult run() {
             frame = &vm.frameArray.frames[vm.frameArray.count - 1];
             DISPATCH();
         }
+        DO_OP_TAIL_CALL: {
+            int argCount = READ_BYTE();
+            Value callee = peek(argCount);
+            ObjClosure* closure;
+            if (IS_CLOSURE(callee)) {
+                closure = AS_CLOSURE(callee);
+            } else if (IS_BOUND_METHOD(callee)) {
+                ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+                vm.stackTop[-argCount - 1] = bound->receiver;
+                closure = bound->method;
+            } else {
+                // natives and classes don't get a frame of their own
+                if (!callValue(callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+                frame = &vm.frameArray.frames[vm.frameArray.count - 1];
+                DISPATCH();
+            }
+
+            if (argCount != closure->function->arity) {
+                runtimeError("Expected %d arguments but got %d" , closure->function->arity, argCount);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!commitFrameStack(frame->slots, closure->function)) {
+                runtimeError("Stack overflow.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            // the callee and its arguments take the place of this frame's window,
+            // the frame returns to where this one would have
+            closeUpvalues(frame->slots);
+            memmove(frame->slots, vm.stackTop - argCount - 1, (argCount + 1) * sizeof(Value));
+            vm.stackTop = frame->slots + argCount + 1;
+            frame->closure = closure;
+            frame->ip = closure->function->chunk.code;
+            DISPATCH();
+        }
         DO_OP_ARRAY_CALL: {
             int argCount = READ_BYTE();
 
@@ -1691,8 +2299,8 @@ static InterpretResult run() {
             Value dataStruct = *frame->closure->upvalues[index]->location;
             push(dataStruct);
 
-            if (!IS_STRING(elementIndex) && !IS_NUMBER(elementIndex)) {
-                runtimeError("Index expression must evaluate to positive integer or string for dictionaries");
+            if (IS_ARRAY(dataStruct) && !IS_NUMBER(elementIndex)) {
+                runtimeError("Index expression must evaluate to positive integer for arrays");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
@@ -1709,7 +2317,7 @@ static InterpretResult run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
             } else {
-                if (!tableGet(&AS_MAP(dataStruct)->map, AS_STRING(elementIndex), &element)) {
+                if (!dictGet(&AS_MAP(dataStruct)->map, elementIndex, &element)) {
                     runtimeError("Key not found");
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -1728,8 +2336,8 @@ static InterpretResult run() {
             Value dataStruct = *frame->closure->upvalues[index]->location;
             push(dataStruct);
 
-            if (!IS_STRING(elementIndex) && !IS_NUMBER(elementIndex)) {
-                runtimeError("Index expression must evaluate to positive integer or string for dictionaries");
+            if (IS_ARRAY(dataStruct) && !IS_NUMBER(elementIndex)) {
+                runtimeError("Index expression must evaluate to positive integer for arrays");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
@@ -1746,9 +2354,8 @@ static InterpretResult run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
             } else {
-                if (!tableSet(&AS_MAP(dataStruct)->map, AS_STRING(elementIndex), setValue)) {
-                    ObjString* type = valueTypeToString(AS_ARRAY(dataStruct)->type);
-                    runtimeError("Error in setting entry %s, elem of type %s of map", AS_STRING(elementIndex), type->chars);
+                if (!dictSet(&AS_MAP(dataStruct)->map, elementIndex, setValue)) {
+                    runtimeError("Error in setting entry of map");
                     return INTERPRET_RUNTIME_ERROR;
                 }
             }
@@ -1777,11 +2384,7 @@ static InterpretResult run() {
                     break;
                 }
                 case OBJ_DICTIONARY: {
-                    if (!IS_STRING(elemIndex)) {
-                        runtimeError("Index must evaluate to string for dictionaries");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    if (!tableGet(&AS_MAP(peek(0))->map, AS_STRING(elemIndex), &elem)) {
+                    if (!dictGet(&AS_MAP(peek(0))->map, elemIndex, &elem)) {
                         runtimeError("Value not found");
                         return INTERPRET_RUNTIME_ERROR;
                     }
@@ -1811,6 +2414,52 @@ static InterpretResult run() {
             *second = temp;
             DISPATCH();
         }
+        DO_OP_MATCH_TABLE: {
+            // jumps to the arm the value on top matches, leaving it there
+            uint8_t kind = READ_BYTE();
+            uint16_t size = READ_WORD();
+            uint16_t target = READ_WORD();
+            Value value = peek(0);
+
+            if (kind == MATCH_DENSE) {
+                int32_t min = (int32_t)((uint32_t)frame->ip[0] << 24 | frame->ip[1] << 16
+                                        | frame->ip[2] << 8 | frame->ip[3]);
+                uint8_t* entries = frame->ip + 4;
+                frame->ip = entries + size * 2;
+
+                if (IS_NUMBER(value)) {
+                    double key = AS_NUMBER(value) - min;
+                    if (key >= 0 && key < size && key == (int)key) {
+                        uint8_t* entry = entries + (int)key * 2;
+                        uint16_t offset = (uint16_t)(entry[0] << 8 | entry[1]);
+                        if (offset != MATCH_EMPTY
+                            && valuesEqual(value, NUMBER_VAL(min + (int)key))) {
+                            target = offset;
+                        }
+                    }
+                }
+            } else {
+                Value* constants = frame->closure->function->chunk.constants.values;
+                uint8_t* entries = frame->ip;
+                frame->ip = entries + size * 4;
+
+                // at most half full, the probe ends on an empty entry
+                uint32_t mask = size - 1;
+                for (uint32_t i = hashMatchKey(value) & mask; ; i = (i + 1) & mask) {
+                    uint8_t* entry = entries + i * 4;
+                    uint16_t constant = (uint16_t)(entry[0] << 8 | entry[1]);
+                    if (constant == MATCH_EMPTY) break;
+
+                    if (valuesEqual(value, constants[constant])) {
+                        target = (uint16_t)(entry[2] << 8 | entry[3]);
+                        break;
+                    }
+                }
+            }
+
+            frame->ip += target;
+            DISPATCH();
+        }
         DO_OP_SAVE_VALUE: {
             push(peek(0));
             DISPATCH();
@@ -1921,21 +2570,17 @@ static InterpretResult run() {
                     break;
                 }
                 case OBJ_DICTIONARY: {
-                    if (!IS_STRING(refIndex)) {
-                        runtimeError("Indexing expression must evaluate to string for maps");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
                     ObjDictionary* dict = AS_MAP(refObj);
-                    ObjString* key = AS_STRING(refIndex);
 
-                    if (tableSet(&dict->map, key, setVal)) {
-                        runtimeError("Key '%s' not found in dictionary\n", key->chars);
+                    if (dictSet(&dict->map, refIndex, setVal)) {
+                        keyError("Key '%s' not found in dictionary\n", refIndex);
                         return INTERPRET_RUNTIME_ERROR;
                     }
 
                     break;
                 }
+                case OBJ_STRING_BUILDER:
+                    break;
 
             }
 
@@ -1977,35 +2622,20 @@ static InterpretResult run() {
             pop();
             push(OBJ_VAL(closure));
 
-            for (int i = 0; i < closure->function->upvalueCount; i++) {
-                bool isLocal = READ_BYTE();
-                int index = READ_BYTE();
-
-                if (isLocal) {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                } else {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-            }
-            DISPATCH();
-        }
-        DO_OP_CLOSURE_LONG: {
-            ObjFunction* function = AS_FUNCTION(READ_CONSTANT_LONG());
-            push(OBJ_VAL(function));
-            ObjClosure* closure = newClosure(function);
-            pop();
-            push(OBJ_VAL(closure));
-
-            for (int i = 0; i < closure->function->upvalueCount; i++) {
+            for (int i = 0; i < closure->upvalueCount; i++) {
                 bool isLocal = READ_BYTE();
                 int index = READ_BYTE();
 
                 if (isLocal) {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    ObjUpvalue* upvalue = captureUpvalue(frame->slots + index);
+                    // the upvalues live inside the closure, which capturing may have moved
+                    closure = AS_CLOSURE(peek(0));
+                    closure->upvalues[i] = upvalue;
                 } else {
                     closure->upvalues[i] = frame->closure->upvalues[index];
                 }
             }
+            markDirty((Obj*)closure);
             DISPATCH();
         }
         DO_OP_RETURN:
@@ -2020,6 +2650,8 @@ static InterpretResult run() {
 
             vm.stackTop = frame->slots;
             push(rv);
+            // back in the native that called into this frame
+            if (vm.frameArray.count == baseFrame) return INTERPRET_OK;
 
             frame = &vm.frameArray.frames[vm.frameArray.count - 1];
             DISPATCH();
@@ -2031,14 +2663,6 @@ static InterpretResult run() {
             push(OBJ_VAL(klass));
             DISPATCH();
         }
-        DO_OP_CLASS_LONG: {
-            ObjString* name = READ_STRING_LONG();
-            push(OBJ_VAL(name));
-            ObjClass* klass = newClass(name);
-            pop();
-            push(OBJ_VAL(klass));
-            DISPATCH();
-        }
         DO_OP_GET_PROPERTY: {
             ObjString* name = READ_STRING();
 
@@ -2075,43 +2699,6 @@ static InterpretResult run() {
             runtimeError("Only instances can have properties");
             return INTERPRET_RUNTIME_ERROR;
 
-        }
-        DO_OP_GET_PROPERTY_LONG: {
-            ObjString* name = READ_STRING_LONG();
-
-            if (IS_INSTANCE(peek(0))) {
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();
-                    push(value);
-                    DISPATCH();
-                }
-
-                // debugMethodLookup(instance->klass, name);
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                DISPATCH();
-            }
-
-            ObjClass* nativeClass = NULL;
-            if (isBuiltInAndSet(peek(0), &nativeClass)) {
-#ifdef DEBUG_LOG_GC
-                debugMethodLookup(nativeClass, name);
-#endif
-            if (!bindNativeMethod(nativeClass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                DISPATCH();
-            }
-
-            runtimeError("Only instances can have properties");
-            return INTERPRET_RUNTIME_ERROR;
-
         }
         DO_OP_SET_PROPERTY: {
             if (!IS_INSTANCE(peek(1))) {
@@ -2140,38 +2727,6 @@ static InterpretResult run() {
             markDirty((Obj*)instance);
 
 
-            // we remove the instance from the stack
-            // and leave only the property set value
-            Value value = pop();
-            pop();
-            push(value);
-            DISPATCH();
-        }
-        DO_OP_SET_PROPERTY_LONG: {
-            if (!IS_INSTANCE(peek(1))) {
-                runtimeError("Only instances can have properties");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            ObjInstance* instance = AS_INSTANCE(peek(1));
-            ObjString* fieldName = READ_STRING_LONG();
-            Value constValue;
-
-            if (tableGet(&instance->klass->fields, fieldName, &constValue)) {
-                //  0 -> mutable
-                // -1 -> const but has to be initialized
-                // -2 -> const initialized
-                if (valuesEqual(constValue, NUMBER_VAL(-1))) {
-                    tableSet(&instance->klass->fields, fieldName, NUMBER_VAL(-2));
-                } else if (valuesEqual(constValue, NUMBER_VAL(-2))) {
-                    runtimeError("Can't modify const field '%s' of class '%s'", fieldName->chars, instance->klass->name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-            }
-
-            tableSet(&instance->fields, fieldName, peek(0));
-            markDirty((Obj*)instance);
-
             // we remove the instance from the stack
             // and leave only the property set value
             Value value = pop();
@@ -2182,21 +2737,12 @@ static InterpretResult run() {
         DO_OP_METHOD:
             defineMethod(READ_STRING());
             DISPATCH();
-        DO_OP_METHOD_LONG:
-            defineMethod(READ_STRING_LONG());
-            DISPATCH();
         DO_OP_DEFINE_PROPERTY: {
             ObjString* name = READ_STRING();
             bool isConst = READ_BYTE();
             defineProperty(name, isConst);
             DISPATCH();
         }
-        DO_OP_DEFINE_PROPERTY_LONG: {
-            ObjString* name = READ_STRING_LONG();
-            bool isConst = READ_BYTE();
-            defineProperty(name, isConst);
-            DISPATCH();
-        }
         DO_OP_INVOKE: {
             ObjString* method = READ_STRING();
             int argc = READ_BYTE();
@@ -2208,27 +2754,8 @@ static InterpretResult run() {
                 if (!invokeFromNative(nativeClass, method, argc)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-
-            } else {
-                if (!invoke(method, argc)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                // natives calling back into Lox may have grown the frames
                 frame = &vm.frameArray.frames[vm.frameArray.count - 1];
-            }
-
-            DISPATCH();
-        }
-        DO_OP_INVOKE_LONG: {
-            ObjString* method = READ_STRING_LONG();
-            int argc = READ_BYTE();
-            ObjClass* nativeClass = NULL;
-            if (isBuiltInAndSet(peek(argc), &nativeClass)) {
-#ifdef DEBUG_LOG_GC
-                // debugMethodLookup(nativeClass, method);
-#endif
-                if (!invokeFromNative(nativeClass, method, argc)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
             } else {
                 if (!invoke(method, argc)) {
@@ -2259,23 +2786,19 @@ static InterpretResult run() {
             }
             DISPATCH();
         }
-        DO_OP_GET_SUPER_LONG: {
-            ObjString* name = READ_STRING_LONG();
-            ObjClass* super = AS_CLASS(pop());
-
-            if (!bindMethod(super, name)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
+        DO_OP_WIDE:
+            wide = (uint32_t)READ_WORD() << 8;
             DISPATCH();
-        }
-
     }
 
     #undef READ_BYTE
     #undef READ_WORD
+    #undef READ_ARG
     #undef READ_CONSTANT
     #undef READ_STRING
     #undef BINARY_OP
+    #undef CHECK_NUMBERS
+    #undef NUMBER_OP
 }
 
 
@@ -2284,13 +2807,19 @@ InterpretResult interpret(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+    return interpretFunction(function);
+}
+
+// Runs a script that's already compiled, by compile() or loaded from a
+// bytecode cache
+InterpretResult interpretFunction(ObjFunction* function) {
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
     callValue(OBJ_VAL(closure), 0);
 
-    return run();
+    return run(0);
 }
 
 
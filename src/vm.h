@@ -19,6 +19,8 @@ typedef struct {
 } CallFrameArray;
 
 typedef struct {
+    // both reserved once, up to the guard page past their end. Their
+    // capacities are what's committed so far
     CallFrameArray frameArray;
     CallFrame* reservedFrames;
 
@@ -39,6 +41,7 @@ typedef struct {
     ObjString* initString;
     ObjClass* arrayClass;
     ObjClass* dictClass;
+    ObjClass* stringBuilderClass;
     bool isLong;
 
     size_t nextGC;
@@ -63,6 +66,7 @@ void freeVM();
 Value pop();
 void push(Value value);
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
 void runtimeError(const char* format, ...);
 ObjString* valueTypeToString(ValueType type);
 #endif